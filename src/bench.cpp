@@ -0,0 +1,698 @@
+// icecale_bench: runs a built icecale over synthetic clips and reports per-stage and end-to-end throughput, peak
+// memory and peak workspace disk usage, so versions and settings can be compared on the same machine.
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "process.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+using icecale::Process;
+using icecale::ProcessOptions;
+using icecale::runCommand;
+
+// Just enough JSON to read back the metrics file icecale writes.
+struct JsonValue {
+    enum class Type { Null, Bool, Number, String, Array, Object };
+    Type type = Type::Null;
+    double number = 0.0;
+    std::string text;
+    std::vector<JsonValue> items;
+    std::map<std::string, JsonValue> members;
+
+    const JsonValue& operator[](const std::string& key) const {
+        static const JsonValue missing;
+        auto it = members.find(key);
+        return it == members.end() ? missing : it->second;
+    }
+};
+
+class JsonParser {
+public:
+    explicit JsonParser(std::string_view text) : text_(text) {}
+
+    JsonValue parse() {
+        JsonValue value = parseValue();
+        skipSpace();
+        if (pos_ != text_.size()) {
+            fail("trailing characters");
+        }
+        return value;
+    }
+
+private:
+    [[noreturn]] void fail(const std::string& what) const {
+        throw std::runtime_error("Malformed metrics JSON (" + what + " at offset " + std::to_string(pos_) + ").");
+    }
+
+    void skipSpace() {
+        while (pos_ < text_.size() && std::isspace(static_cast<unsigned char>(text_[pos_]))) {
+            ++pos_;
+        }
+    }
+
+    bool consume(char c) {
+        skipSpace();
+        if (pos_ < text_.size() && text_[pos_] == c) {
+            ++pos_;
+            return true;
+        }
+        return false;
+    }
+
+    void expect(char c) {
+        if (!consume(c)) {
+            fail(std::string("expected '") + c + "'");
+        }
+    }
+
+    JsonValue parseValue() {
+        skipSpace();
+        if (pos_ >= text_.size()) {
+            fail("unexpected end");
+        }
+        JsonValue value;
+        const char c = text_[pos_];
+        if (c == '{') {
+            value.type = JsonValue::Type::Object;
+            ++pos_;
+            if (!consume('}')) {
+                do {
+                    skipSpace();
+                    std::string key = parseString();
+                    expect(':');
+                    value.members[key] = parseValue();
+                } while (consume(','));
+                expect('}');
+            }
+        } else if (c == '[') {
+            value.type = JsonValue::Type::Array;
+            ++pos_;
+            if (!consume(']')) {
+                do {
+                    value.items.push_back(parseValue());
+                } while (consume(','));
+                expect(']');
+            }
+        } else if (c == '"') {
+            value.type = JsonValue::Type::String;
+            value.text = parseString();
+        } else if (text_.compare(pos_, 4, "true") == 0 || text_.compare(pos_, 5, "false") == 0) {
+            value.type = JsonValue::Type::Bool;
+            value.number = text_[pos_] == 't' ? 1.0 : 0.0;
+            pos_ += text_[pos_] == 't' ? 4 : 5;
+        } else if (text_.compare(pos_, 4, "null") == 0) {
+            pos_ += 4;
+        } else {
+            value.type = JsonValue::Type::Number;
+            const std::string rest(text_.substr(pos_, 64));
+            std::size_t used = 0;
+            try {
+                value.number = std::stod(rest, &used);
+            } catch (const std::exception&) {
+                fail("bad number");
+            }
+            pos_ += used;
+        }
+        return value;
+    }
+
+    std::string parseString() {
+        if (pos_ >= text_.size() || text_[pos_] != '"') {
+            fail("expected a string");
+        }
+        ++pos_;
+        std::string out;
+        while (pos_ < text_.size() && text_[pos_] != '"') {
+            char c = text_[pos_++];
+            if (c == '\\' && pos_ < text_.size()) {
+                c = text_[pos_++];
+                switch (c) {
+                    case 'n':
+                        c = '\n';
+                        break;
+                    case 't':
+                        c = '\t';
+                        break;
+                    case 'u':
+                        // Only control characters are escaped this way; they do not matter for the report.
+                        pos_ += 4;
+                        c = '?';
+                        break;
+                    default:
+                        break;
+                }
+            }
+            out.push_back(c);
+        }
+        if (pos_ >= text_.size()) {
+            fail("unterminated string");
+        }
+        ++pos_;
+        return out;
+    }
+
+    std::string_view text_;
+    std::size_t pos_ = 0;
+};
+
+struct ClipSpec {
+    int width{};
+    int height{};
+    double seconds{};
+
+    std::string label() const {
+        std::ostringstream out;
+        out << width << "x" << height << "_" << seconds << "s";
+        return out.str();
+    }
+};
+
+// Extra icecale arguments that select each pipeline mode.
+const std::map<std::string, std::vector<std::string>>& benchModes() {
+    static const std::map<std::string, std::vector<std::string>> modes = {
+        {"disk", {"--external"}},
+        {"stream", {"--stream"}},
+        {"segments", {"--external", "--segments", "4"}},
+        {"hwaccel", {"--external", "--hwaccel"}},
+    };
+    return modes;
+}
+
+struct BenchConfig {
+    fs::path icecale;
+    fs::path ffmpeg;
+    fs::path workDir;
+    std::vector<ClipSpec> clips;
+    std::vector<std::string> modes = {"disk"};
+    int iterations = 3;
+    double fps = 24.0;
+    fs::path csvFile;
+    fs::path jsonFile;
+    // Passed to every icecale run, e.g. --frame-format bmp or --gpus 0.
+    std::vector<std::string> extraArgs;
+};
+
+struct RunResult {
+    std::string clip;
+    std::string mode;
+    int iteration{};
+    bool ok = false;
+    std::string error;
+    double seconds{};
+    double frames{};
+    double fps{};
+    std::map<std::string, double> stageFps;
+    std::uintmax_t peakMemory{};
+    std::uintmax_t peakDisk{};
+};
+
+const std::vector<std::string> kStages = {"decode", "upscale", "encode"};
+
+void printUsage(std::ostream& out) {
+    out << "Usage: icecale_bench [options] [-- icecale options...]\n"
+           "\n"
+           "Runs icecale over synthetic clips and reports throughput as CSV (stdout unless --csv) and JSON.\n"
+           "\n"
+           "Options:\n"
+           "  --icecale PATH       icecale binary (default: next to icecale_bench)\n"
+           "  --ffmpeg PATH        ffmpeg used to generate the clips (default: next to icecale, else PATH)\n"
+           "  --sizes LIST         Comma-separated WxH clip sizes (default: 640x360,1280x720)\n"
+           "  --lengths LIST       Comma-separated clip lengths in seconds (default: 2,10)\n"
+           "  --modes LIST         disk, stream, segments and/or hwaccel (default: disk)\n"
+           "  --iterations N       Runs per clip and mode (default: 3)\n"
+           "  --fps N              Frame rate of the generated clips (default: 24)\n"
+           "  --work-dir DIR       Clips, outputs and workspaces (default: <temp>/icecale-bench)\n"
+           "  --csv FILE           Write the per-run CSV to FILE instead of stdout\n"
+           "  --json FILE          Also write runs and per-configuration medians as JSON\n"
+           "  -h, --help           Show this help\n";
+}
+
+std::vector<std::string> splitList(const std::string& value) {
+    std::vector<std::string> items;
+    std::stringstream in(value);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+double parsePositive(const std::string& value, std::string_view what) {
+    std::size_t used = 0;
+    double parsed = 0.0;
+    try {
+        parsed = std::stod(value, &used);
+    } catch (const std::exception&) {
+        used = 0;
+    }
+    if (used != value.size() || parsed <= 0.0) {
+        throw std::runtime_error("Invalid " + std::string(what) + ": " + value);
+    }
+    return parsed;
+}
+
+std::string requireValue(int argc, char** argv, int& i, std::string_view what) {
+    if (i + 1 >= argc) {
+        throw std::runtime_error(std::string(argv[i]) + " expects " + std::string(what) + ".");
+    }
+    return argv[++i];
+}
+
+fs::path siblingTool(const fs::path& dir, const std::string& name) {
+#ifdef _WIN32
+    const std::string file = name + ".exe";
+#else
+    const std::string file = name;
+#endif
+    for (const fs::path& candidate : {dir / file, dir / "bin" / file, dir.parent_path() / "bin" / file,
+                                      dir / "third_party" / name / file}) {
+        std::error_code ec;
+        if (fs::is_regular_file(candidate, ec)) {
+            return candidate;
+        }
+    }
+    // Left to the PATH search when starting the process.
+    return file;
+}
+
+BenchConfig parseArgs(int argc, char** argv) {
+    BenchConfig cfg;
+    fs::path self = fs::absolute(fs::path(argv[0]));
+    std::error_code ec;
+    if (auto canonical = fs::weakly_canonical(self, ec); !ec) {
+        self = canonical;
+    }
+    cfg.workDir = fs::temp_directory_path() / "icecale-bench";
+
+    std::vector<std::string> sizes = {"640x360", "1280x720"};
+    std::vector<std::string> lengths = {"2", "10"};
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            printUsage(std::cout);
+            std::exit(0);
+        } else if (arg == "--") {
+            cfg.extraArgs.assign(argv + i + 1, argv + argc);
+            break;
+        } else if (arg == "--icecale") {
+            cfg.icecale = fs::absolute(requireValue(argc, argv, i, "a path"));
+        } else if (arg == "--ffmpeg") {
+            cfg.ffmpeg = requireValue(argc, argv, i, "a path");
+        } else if (arg == "--sizes") {
+            sizes = splitList(requireValue(argc, argv, i, "a list of sizes"));
+        } else if (arg == "--lengths") {
+            lengths = splitList(requireValue(argc, argv, i, "a list of lengths"));
+        } else if (arg == "--modes") {
+            cfg.modes = splitList(requireValue(argc, argv, i, "a list of modes"));
+        } else if (arg == "--iterations") {
+            cfg.iterations = static_cast<int>(parsePositive(requireValue(argc, argv, i, "a count"), "iteration count"));
+        } else if (arg == "--fps") {
+            cfg.fps = parsePositive(requireValue(argc, argv, i, "a frame rate"), "frame rate");
+        } else if (arg == "--work-dir") {
+            cfg.workDir = fs::absolute(requireValue(argc, argv, i, "a directory"));
+        } else if (arg == "--csv") {
+            cfg.csvFile = fs::absolute(requireValue(argc, argv, i, "a file path"));
+        } else if (arg == "--json") {
+            cfg.jsonFile = fs::absolute(requireValue(argc, argv, i, "a file path"));
+        } else {
+            throw std::runtime_error("Unknown option: " + std::string(arg) + " (see --help)");
+        }
+    }
+
+    if (cfg.icecale.empty()) {
+        cfg.icecale = siblingTool(self.parent_path(), "icecale");
+    }
+    if (cfg.ffmpeg.empty()) {
+        cfg.ffmpeg = siblingTool(cfg.icecale.has_parent_path() ? cfg.icecale.parent_path() : self.parent_path(),
+                                 "ffmpeg");
+    }
+    for (const auto& mode : cfg.modes) {
+        if (!benchModes().count(mode)) {
+            throw std::runtime_error("Unknown mode '" + mode + "' (expected disk, stream, segments or hwaccel).");
+        }
+    }
+    for (const auto& size : sizes) {
+        ClipSpec clip;
+        const auto x = size.find('x');
+        if (x == std::string::npos) {
+            throw std::runtime_error("Invalid size '" + size + "' (expected WxH).");
+        }
+        clip.width = static_cast<int>(parsePositive(size.substr(0, x), "width"));
+        clip.height = static_cast<int>(parsePositive(size.substr(x + 1), "height"));
+        // Even sizes keep yuv420p and the encoders happy.
+        if (clip.width % 2 != 0 || clip.height % 2 != 0) {
+            throw std::runtime_error("Clip sizes must be even: " + size);
+        }
+        for (const auto& length : lengths) {
+            clip.seconds = parsePositive(length, "length");
+            cfg.clips.push_back(clip);
+        }
+    }
+    if (cfg.clips.empty() || cfg.modes.empty()) {
+        throw std::runtime_error("Nothing to run: give at least one size, length and mode.");
+    }
+    return cfg;
+}
+
+// A moving test pattern with a tone, so every frame differs (no repeated-frame shortcuts) and audio is extracted and
+// muxed like in a real job. Clips are kept between runs and regenerated only when missing.
+fs::path generateClip(const BenchConfig& config, const ClipSpec& clip) {
+    const fs::path path = config.workDir / "clips" / (clip.label() + ".mp4");
+    if (fs::exists(path)) {
+        return path;
+    }
+    fs::create_directories(path.parent_path());
+    std::ostringstream video;
+    video << "testsrc2=size=" << clip.width << "x" << clip.height << ":rate=" << config.fps;
+    std::ostringstream duration;
+    duration << clip.seconds;
+    const fs::path partial = path.string() + ".part.mp4";
+    auto res = runCommand({config.ffmpeg.string(), "-y", "-v", "error", "-f", "lavfi", "-i", video.str(), "-f",
+                           "lavfi", "-i", "sine=frequency=440", "-t", duration.str(), "-c:v", "libx264", "-preset",
+                           "veryfast", "-g", "48", "-pix_fmt", "yuv420p", "-c:a", "aac", "-shortest",
+                           partial.string()});
+    if (res.exitCode != 0) {
+        throw std::runtime_error("Failed to generate " + path.string() + ":\n" + res.output);
+    }
+    fs::rename(partial, path);
+    return path;
+}
+
+std::uintmax_t directorySize(const fs::path& dir) {
+    std::uintmax_t total = 0;
+    std::error_code ec;
+    // Files come and go while icecale runs; whatever cannot be read this time is skipped.
+    for (fs::recursive_directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec), end;
+         !ec && it != end; it.increment(ec)) {
+        std::error_code sizeError;
+        if (it->is_regular_file(sizeError)) {
+            const auto size = it->file_size(sizeError);
+            total += sizeError ? 0 : size;
+        }
+    }
+    return total;
+}
+
+RunResult runOnce(const BenchConfig& config, const ClipSpec& clip, const fs::path& input, const std::string& mode,
+                  int iteration) {
+    RunResult result;
+    result.clip = clip.label();
+    result.mode = mode;
+    result.iteration = iteration;
+
+    const fs::path runDir = config.workDir / "runs";
+    const fs::path workspaceRoot = runDir / "workspace";
+    const fs::path metrics = runDir / "metrics.json";
+    fs::remove_all(runDir);
+    fs::create_directories(workspaceRoot);
+
+    std::vector<std::string> args = {config.icecale.string(), input.string(),         "-o",
+                                     (runDir / "out.mp4").string(), "--workspace-root", workspaceRoot.string(),
+                                     "--metrics-json",              metrics.string()};
+    const auto& modeArgs = benchModes().at(mode);
+    args.insert(args.end(), modeArgs.begin(), modeArgs.end());
+    args.insert(args.end(), config.extraArgs.begin(), config.extraArgs.end());
+
+    // The workspace is sampled while the job runs; the peak is a little low if it spikes between two samples.
+    ProcessOptions options;
+    options.keepBytes = 16 * 1024;
+    Process job(args, options);
+    while (!job.finished()) {
+        result.peakDisk = std::max(result.peakDisk, directorySize(workspaceRoot));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    const int exitCode = job.wait();
+    result.peakMemory = job.peakMemory();
+
+    JsonValue document;
+    if (fs::exists(metrics)) {
+        std::ifstream in(metrics, std::ios::binary);
+        std::ostringstream text;
+        text << in.rdbuf();
+        // A job killed while writing leaves a truncated file; that is a failed run, not a failed benchmark.
+        try {
+            document = JsonParser(text.str()).parse();
+        } catch (const std::exception& ex) {
+            result.error = "exit code " + std::to_string(exitCode) + ", unreadable metrics: " + ex.what();
+            return result;
+        }
+    }
+    const JsonValue& jobs = document["jobs"];
+    if (jobs.items.empty()) {
+        std::string output = job.capturedOutput();
+        result.error = "exit code " + std::to_string(exitCode) + ", no metrics: " +
+                       output.substr(output.size() > 300 ? output.size() - 300 : 0);
+        return result;
+    }
+    const JsonValue& report = jobs.items.front();
+    result.ok = exitCode == 0 && report["status"].text == "ok";
+    result.error = report["error"].text;
+    result.seconds = report["seconds"].number;
+    for (const auto& stage : report["stages"].items) {
+        result.stageFps[stage["name"].text] = stage["fps"].number;
+        result.frames = std::max(result.frames, stage["frames"].number);
+    }
+    result.fps = result.seconds > 0.0 ? result.frames / result.seconds : 0.0;
+    return result;
+}
+
+std::string csvField(const std::string& text) {
+    if (text.find_first_of(",\"\n") == std::string::npos) {
+        return text;
+    }
+    std::string quoted = "\"";
+    for (char c : text) {
+        quoted += c == '"' ? std::string("\"\"") : std::string(1, c == '\n' ? ' ' : c);
+    }
+    return quoted + "\"";
+}
+
+void writeCsv(std::ostream& out, const std::vector<RunResult>& runs) {
+    out << "clip,mode,iteration,status,frames,seconds,fps";
+    for (const auto& stage : kStages) {
+        out << "," << stage << "_fps";
+    }
+    out << ",peak_rss_bytes,peak_disk_bytes,error\n";
+    out << std::fixed << std::setprecision(3);
+    for (const auto& run : runs) {
+        out << run.clip << "," << run.mode << "," << run.iteration << "," << (run.ok ? "ok" : "failed") << ","
+            << static_cast<long long>(run.frames) << "," << run.seconds << "," << run.fps;
+        for (const auto& stage : kStages) {
+            auto it = run.stageFps.find(stage);
+            out << "," << (it == run.stageFps.end() ? 0.0 : it->second);
+        }
+        out << "," << run.peakMemory << "," << run.peakDisk << "," << csvField(run.error) << "\n";
+    }
+}
+
+double median(std::vector<double> values) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    const std::size_t mid = values.size() / 2;
+    return values.size() % 2 != 0 ? values[mid] : (values[mid - 1] + values[mid]) / 2.0;
+}
+
+struct Summary {
+    std::string clip;
+    std::string mode;
+    int succeeded{};
+    int runs{};
+    double seconds{};
+    double fps{};
+    std::map<std::string, double> stageFps;
+    std::uintmax_t peakMemory{};
+    std::uintmax_t peakDisk{};
+};
+
+// Medians over the successful iterations of each clip and mode, so one noisy run does not skew the comparison.
+// Peaks are the largest seen in any iteration.
+std::vector<Summary> summarize(const std::vector<RunResult>& runs) {
+    std::vector<Summary> summaries;
+    std::map<std::pair<std::string, std::string>, std::vector<const RunResult*>> groups;
+    std::vector<std::pair<std::string, std::string>> order;
+    for (const auto& run : runs) {
+        auto key = std::make_pair(run.clip, run.mode);
+        if (!groups.count(key)) {
+            order.push_back(key);
+        }
+        groups[key].push_back(&run);
+    }
+    for (const auto& key : order) {
+        Summary summary;
+        summary.clip = key.first;
+        summary.mode = key.second;
+        std::vector<double> seconds;
+        std::vector<double> fps;
+        std::map<std::string, std::vector<double>> stageFps;
+        for (const RunResult* run : groups[key]) {
+            ++summary.runs;
+            if (!run->ok) {
+                continue;
+            }
+            ++summary.succeeded;
+            seconds.push_back(run->seconds);
+            fps.push_back(run->fps);
+            for (const auto& [stage, value] : run->stageFps) {
+                stageFps[stage].push_back(value);
+            }
+            summary.peakMemory = std::max(summary.peakMemory, run->peakMemory);
+            summary.peakDisk = std::max(summary.peakDisk, run->peakDisk);
+        }
+        summary.seconds = median(seconds);
+        summary.fps = median(fps);
+        for (auto& [stage, values] : stageFps) {
+            summary.stageFps[stage] = median(values);
+        }
+        summaries.push_back(summary);
+    }
+    return summaries;
+}
+
+std::string jsonString(const std::string& text) {
+    std::string out = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            out += ' ';
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+void writeJson(const fs::path& path, const BenchConfig& config, const std::vector<RunResult>& runs,
+               const std::vector<Summary>& summaries) {
+    std::ofstream out(path, std::ios::trunc);
+    out << std::fixed << std::setprecision(3);
+    out << "{\n  \"version\": 1,\n  \"icecale\": " << jsonString(config.icecale.string())
+        << ",\n  \"iterations\": " << config.iterations << ",\n  \"runs\": [";
+    for (std::size_t i = 0; i < runs.size(); ++i) {
+        const RunResult& run = runs[i];
+        out << (i == 0 ? "" : ",") << "\n    {\"clip\": " << jsonString(run.clip) << ", \"mode\": "
+            << jsonString(run.mode) << ", \"iteration\": " << run.iteration << ", \"status\": "
+            << jsonString(run.ok ? "ok" : "failed") << ", \"frames\": " << static_cast<long long>(run.frames)
+            << ", \"seconds\": " << run.seconds << ", \"fps\": " << run.fps << ", \"stage_fps\": {";
+        bool first = true;
+        for (const auto& [stage, value] : run.stageFps) {
+            out << (first ? "" : ", ") << jsonString(stage) << ": " << value;
+            first = false;
+        }
+        out << "}, \"peak_rss_bytes\": " << run.peakMemory << ", \"peak_disk_bytes\": " << run.peakDisk
+            << ", \"error\": " << jsonString(run.error) << "}";
+    }
+    out << (runs.empty() ? "" : "\n  ") << "],\n  \"summary\": [";
+    for (std::size_t i = 0; i < summaries.size(); ++i) {
+        const Summary& summary = summaries[i];
+        out << (i == 0 ? "" : ",") << "\n    {\"clip\": " << jsonString(summary.clip) << ", \"mode\": "
+            << jsonString(summary.mode) << ", \"succeeded\": " << summary.succeeded << ", \"runs\": " << summary.runs
+            << ", \"median_seconds\": " << summary.seconds << ", \"median_fps\": " << summary.fps
+            << ", \"median_stage_fps\": {";
+        bool first = true;
+        for (const auto& [stage, value] : summary.stageFps) {
+            out << (first ? "" : ", ") << jsonString(stage) << ": " << value;
+            first = false;
+        }
+        out << "}, \"peak_rss_bytes\": " << summary.peakMemory << ", \"peak_disk_bytes\": " << summary.peakDisk
+            << "}";
+    }
+    out << (summaries.empty() ? "" : "\n  ") << "]\n}\n";
+    if (!out) {
+        throw std::runtime_error("Failed to write " + path.string());
+    }
+}
+
+void printSummary(const std::vector<Summary>& summaries) {
+    std::cerr << "\n" << std::left << std::setw(20) << "clip" << std::setw(10) << "mode" << std::right
+              << std::setw(8) << "ok" << std::setw(10) << "fps";
+    for (const auto& stage : kStages) {
+        std::cerr << std::setw(10) << stage;
+    }
+    std::cerr << std::setw(12) << "rss MiB" << std::setw(12) << "disk MiB" << "\n";
+    std::cerr << std::fixed << std::setprecision(1);
+    for (const auto& summary : summaries) {
+        std::cerr << std::left << std::setw(20) << summary.clip << std::setw(10) << summary.mode << std::right
+                  << std::setw(8) << (std::to_string(summary.succeeded) + "/" + std::to_string(summary.runs))
+                  << std::setw(10) << summary.fps;
+        for (const auto& stage : kStages) {
+            auto it = summary.stageFps.find(stage);
+            std::cerr << std::setw(10) << (it == summary.stageFps.end() ? 0.0 : it->second);
+        }
+        std::cerr << std::setw(12) << static_cast<double>(summary.peakMemory) / (1 << 20) << std::setw(12)
+                  << static_cast<double>(summary.peakDisk) / (1 << 20) << "\n";
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    try {
+        const BenchConfig config = parseArgs(argc, argv);
+        fs::create_directories(config.workDir);
+
+        std::vector<RunResult> runs;
+        for (const auto& clip : config.clips) {
+            std::cerr << "Generating " << clip.label() << "...\n";
+            const fs::path input = generateClip(config, clip);
+            for (const auto& mode : config.modes) {
+                for (int iteration = 1; iteration <= config.iterations; ++iteration) {
+                    std::cerr << clip.label() << " " << mode << " #" << iteration << ": " << std::flush;
+                    RunResult run = runOnce(config, clip, input, mode, iteration);
+                    if (run.ok) {
+                        std::cerr << std::fixed << std::setprecision(1) << run.fps << " fps in " << run.seconds
+                                  << " s\n";
+                    } else {
+                        std::cerr << "failed: " << run.error << "\n";
+                    }
+                    runs.push_back(std::move(run));
+                }
+            }
+        }
+        fs::remove_all(config.workDir / "runs");
+
+        if (config.csvFile.empty()) {
+            writeCsv(std::cout, runs);
+        } else {
+            std::ofstream csv(config.csvFile, std::ios::trunc);
+            writeCsv(csv, runs);
+            if (!csv) {
+                throw std::runtime_error("Failed to write " + config.csvFile.string());
+            }
+        }
+        const auto summaries = summarize(runs);
+        if (!config.jsonFile.empty()) {
+            writeJson(config.jsonFile, config, runs, summaries);
+        }
+        printSummary(summaries);
+
+        const bool allOk = std::all_of(runs.begin(), runs.end(), [](const RunResult& run) { return run.ok; });
+        return allOk ? 0 : 1;
+    } catch (const std::exception& ex) {
+        std::cerr << "Error: " << ex.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,87 @@
+#include "frame_pool.hpp"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace icecale {
+
+namespace {
+
+bool lockMemory(void* data, std::size_t size) {
+#ifdef _WIN32
+    return VirtualLock(data, size) != 0;
+#else
+    return ::mlock(data, size) == 0;
+#endif
+}
+
+void unlockMemory(void* data, std::size_t size) {
+#ifdef _WIN32
+    VirtualUnlock(data, size);
+#else
+    ::munlock(data, size);
+#endif
+}
+
+}  // namespace
+
+FramePool::FramePool(std::size_t count, int width, int height) {
+    const std::size_t size = static_cast<std::size_t>(width) * height * 3;
+    frames_.reserve(count);
+    free_.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        // Value-initialising the pixels touches every page, so the memory is committed before the first frame.
+        frames_.push_back(std::make_unique<RgbFrame>(RgbFrame{width, height, std::vector<std::uint8_t>(size)}));
+        free_.push_back(frames_.back().get());
+        if (pinned_ && !lockMemory(frames_.back()->pixels.data(), size)) {
+            // All or nothing, so the destructor knows what to unlock.
+            pinned_ = false;
+            for (std::size_t locked = 0; locked < i; ++locked) {
+                unlockMemory(frames_[locked]->pixels.data(), size);
+            }
+        }
+    }
+}
+
+FramePool::~FramePool() {
+    if (pinned_) {
+        for (const auto& frame : frames_) {
+            unlockMemory(frame->pixels.data(), frame->pixels.size());
+        }
+    }
+}
+
+FramePool::Handle FramePool::acquire() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    available_.wait(lock, [&] { return closed_ || !free_.empty(); });
+    if (closed_) {
+        return nullptr;
+    }
+    RgbFrame* frame = free_.back();
+    free_.pop_back();
+    return Handle(frame, [this](RgbFrame* returned) { release(returned); });
+}
+
+void FramePool::close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    available_.notify_all();
+}
+
+std::uintmax_t FramePool::bytes() const {
+    return frames_.empty() ? 0 : static_cast<std::uintmax_t>(frames_.size()) * frames_.front()->pixels.size();
+}
+
+void FramePool::release(RgbFrame* frame) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.push_back(frame);
+    available_.notify_one();
+}
+
+}  // namespace icecale
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "upscaler.hpp"
+
+namespace icecale {
+
+// A fixed set of equally sized frames, allocated once and locked into RAM where the OS allows, that the streaming
+// stages pass to each other by handle. A frame returns to the pool when its last handle goes away, so pixels are
+// read from a pipe, upscaled and written out in place instead of through a fresh allocation per frame. Sized for
+// everything the stages can hold at once, acquire() only waits while the consumers are behind.
+class FramePool {
+public:
+    using Handle = std::shared_ptr<RgbFrame>;
+
+    FramePool(std::size_t count, int width, int height);
+    ~FramePool();
+
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
+
+    // Waits for a free frame. Returns null once the pool is closed, so a stage stuck here can give up after a failure.
+    Handle acquire();
+    void close();
+
+    std::size_t count() const { return frames_.size(); }
+    std::uintmax_t bytes() const;
+    // True when every frame could be locked into RAM; RLIMIT_MEMLOCK and the Windows working set cap how much can be.
+    bool pinned() const { return pinned_; }
+
+private:
+    void release(RgbFrame* frame);
+
+    std::vector<std::unique_ptr<RgbFrame>> frames_;
+    std::vector<RgbFrame*> free_;
+    bool pinned_ = true;
+    bool closed_ = false;
+    std::mutex mutex_;
+    std::condition_variable available_;
+};
+
+}  // namespace icecale
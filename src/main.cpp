@@ -1,71 +1,79 @@
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 
-namespace fs = std::filesystem;
-
-namespace {
-
-struct CommandResult {
-    int exitCode{};
-    std::string output;
-};
-
-bool isWindows() {
 #ifdef _WIN32
-    return true;
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
 #else
-    return false;
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <unistd.h>
 #endif
-}
 
-std::string shellEscape(const std::string& value) {
-    std::string escaped = "'";
-    for (char c : value) {
-        if (c == '\'') {
-            escaped += "'\"'\"'";
-        } else {
-            escaped.push_back(c);
-        }
-    }
-    escaped.push_back('\'');
-    return escaped;
-}
+#include "frame_pool.hpp"
+#include "net.hpp"
+#include "process.hpp"
+#include "upscaler.hpp"
+#ifdef ICECALE_WITH_NCNN
+#include "ncnn_upscaler.hpp"
+#endif
 
-CommandResult runCommand(const std::string& command) {
-    std::array<char, 256> buffer{};
-    std::string result;
+namespace fs = std::filesystem;
 
-#ifdef _WIN32
-    FILE* pipe = _popen((command + " 2>&1").c_str(), "r");
-#else
-    FILE* pipe = popen((command + " 2>&1").c_str(), "r");
-#endif
-    if (!pipe) {
-        throw std::runtime_error("Failed to open pipe for command: " + command);
-    }
+namespace {
 
-    while (fgets(buffer.data(), buffer.size(), pipe) != nullptr) {
-        result += buffer.data();
-    }
+using icecale::FramePool;
+using icecale::FrameUpscaler;
+using icecale::Precision;
+using icecale::Process;
+using icecale::ProcessOptions;
+using icecale::RgbFrame;
+using icecale::Socket;
+using icecale::StreamMode;
+using icecale::runCommand;
 
+bool isWindows() {
 #ifdef _WIN32
-    int exitCode = _pclose(pipe);
+    return true;
 #else
-    int exitCode = pclose(pipe);
+    return false;
 #endif
-    return {exitCode, result};
 }
 
 fs::path executableDir(const char* argv0) {
@@ -126,6 +134,34 @@ fs::path findTool(const fs::path& baseDir, const std::string& name) {
     throw std::runtime_error(message.str());
 }
 
+struct ModelFiles {
+    fs::path param;
+    fs::path bin;
+};
+
+// Looks for <model>.param/.bin in the same project-local places findTool() uses, plus the models/ folder that
+// realesrgan-ncnn-vulkan releases ship with.
+std::optional<ModelFiles> findModel(const fs::path& baseDir, const std::string& model) {
+    std::vector<fs::path> dirs;
+    for (const fs::path& root : {baseDir, baseDir.parent_path(), baseDir.parent_path().parent_path()}) {
+        dirs.push_back(root);
+        dirs.push_back(root / "models");
+        dirs.push_back(root / "bin");
+        dirs.push_back(root / "bin" / "models");
+        dirs.push_back(root / "third_party" / "realesrgan-ncnn-vulkan");
+        dirs.push_back(root / "third_party" / "realesrgan-ncnn-vulkan" / "models");
+    }
+
+    for (const auto& dir : dirs) {
+        ModelFiles files{dir / (model + ".param"), dir / (model + ".bin")};
+        std::error_code ec;
+        if (fs::is_regular_file(files.param, ec) && fs::is_regular_file(files.bin, ec)) {
+            return files;
+        }
+    }
+    return std::nullopt;
+}
+
 fs::path downloadsDirectory() {
     const char* homeEnv = std::getenv("HOME");
     const char* userProfileEnv = std::getenv("USERPROFILE");
@@ -147,23 +183,117 @@ fs::path downloadsDirectory() {
 }
 
 void requireCommand(const fs::path& commandPath, const std::string& versionFlag = "-version") {
-    auto res = runCommand(shellEscape(commandPath.string()) + " " + versionFlag);
+    auto res = runCommand({commandPath.string(), versionFlag});
     if (res.exitCode != 0) {
         throw std::runtime_error("Required command '" + commandPath.string() + "' is not available.\nOutput:\n" +
                                  res.output);
     }
 }
 
-void requireNvidiaGpu() {
-    auto res = runCommand("nvidia-smi --query-gpu=name --format=csv,noheader");
+struct GpuInfo {
+    int index{};
+    std::string name;
+    // Total VRAM; 0 when nvidia-smi did not report it.
+    long long memoryMiB = 0;
+};
+
+// Lists every NVIDIA GPU nvidia-smi reports. The indices are passed straight to realesrgan-ncnn-vulkan -g and ncnn,
+// which enumerate Vulkan devices in the same order on hosts whose only GPUs are NVIDIA cards.
+std::vector<GpuInfo> requireNvidiaGpu() {
+    auto res = runCommand({"nvidia-smi", "--query-gpu=index,name,memory.total", "--format=csv,noheader,nounits"});
     if (res.exitCode != 0 || res.output.empty()) {
         throw std::runtime_error("No NVIDIA GPU detected. The application requires an NVIDIA GPU to run.");
     }
 
+    std::vector<GpuInfo> gpus;
     std::istringstream stream(res.output);
-    std::string gpuName;
-    std::getline(stream, gpuName);
-    std::cout << "Detected NVIDIA GPU: " << gpuName << "\n";
+    std::string line;
+    while (std::getline(stream, line)) {
+        auto comma = line.find(',');
+        if (comma == std::string::npos) {
+            continue;
+        }
+        GpuInfo gpu;
+        try {
+            gpu.index = std::stoi(line.substr(0, comma));
+        } catch (const std::exception&) {
+            continue;
+        }
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        // The memory column comes last, so a name with a comma in it still parses.
+        std::string name = line.substr(comma + 1);
+        const auto lastComma = name.rfind(',');
+        if (lastComma != std::string::npos) {
+            try {
+                gpu.memoryMiB = std::stoll(name.substr(lastComma + 1));
+                name.erase(lastComma);
+            } catch (const std::exception&) {
+                gpu.memoryMiB = 0;
+            }
+        }
+        const auto first = name.find_first_not_of(' ');
+        const auto last = name.find_last_not_of(' ');
+        gpu.name = first == std::string::npos ? std::string() : name.substr(first, last - first + 1);
+        gpus.push_back(gpu);
+    }
+
+    if (gpus.empty()) {
+        throw std::runtime_error("No NVIDIA GPU detected. The application requires an NVIDIA GPU to run.");
+    }
+    for (const auto& gpu : gpus) {
+        std::cout << "Detected NVIDIA GPU " << gpu.index << ": " << gpu.name;
+        if (gpu.memoryMiB > 0) {
+            std::cout << " (" << gpu.memoryMiB << " MiB)";
+        }
+        std::cout << "\n";
+    }
+    return gpus;
+}
+
+// Restricts the detected GPUs to the --gpus selection (all of them when nothing was requested).
+std::vector<int> selectGpus(const std::vector<GpuInfo>& detected, const std::vector<int>& requested) {
+    std::vector<int> selected;
+    if (requested.empty()) {
+        for (const auto& gpu : detected) {
+            selected.push_back(gpu.index);
+        }
+        return selected;
+    }
+
+    for (int index : requested) {
+        bool found = std::any_of(detected.begin(), detected.end(), [&](const GpuInfo& gpu) { return gpu.index == index; });
+        if (!found) {
+            throw std::runtime_error("Requested GPU " + std::to_string(index) + " was not reported by nvidia-smi.");
+        }
+        if (std::find(selected.begin(), selected.end(), index) == selected.end()) {
+            selected.push_back(index);
+        }
+    }
+    return selected;
+}
+
+std::vector<int> parseGpuList(const std::string& value) {
+    std::vector<int> gpus;
+    std::stringstream ss(value);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        try {
+            std::size_t used = 0;
+            int index = std::stoi(item, &used);
+            if (used != item.size() || index < 0) {
+                throw std::invalid_argument(item);
+            }
+            gpus.push_back(index);
+        } catch (const std::exception&) {
+            throw std::runtime_error("Invalid --gpus list: " + value);
+        }
+    }
+    if (gpus.empty()) {
+        throw std::runtime_error("Invalid --gpus list: " + value);
+    }
+    return gpus;
 }
 
 struct VideoMetadata {
@@ -173,6 +303,12 @@ struct VideoMetadata {
     std::string fpsRaw;
     double duration{};
     long long totalFrames{};
+    std::string frameCountSource;
+    // The container's start_time. Packet timestamps are absolute, but input -ss counts from this point.
+    double startTime{};
+    // Set when this describes one segment of a longer input: where its first frame is and how many frames it has.
+    double seekTo{};
+    long long frameLimit{};
 };
 
 double parseFrameRate(const std::string& value) {
@@ -207,242 +343,6117 @@ double safeParseDouble(const std::string& token) {
     return std::stod(token);
 }
 
-std::vector<std::string> splitCsvLine(const std::string& line) {
-    std::vector<std::string> tokens;
-    std::stringstream ss(line);
-    std::string item;
-    while (std::getline(ss, item, ',')) {
-        tokens.push_back(item);
-    }
-    return tokens;
-}
-
-VideoMetadata probeVideo(const fs::path& ffprobe, const fs::path& input) {
-    std::ostringstream cmd;
-    cmd << shellEscape(ffprobe.string())
-        << " -v error -select_streams v:0 -count_frames "
-        << "-show_entries stream=nb_read_frames,nb_frames,width,height,avg_frame_rate,duration "
-        << "-of csv=p=0 " << shellEscape(input.string());
+// Runs ffprobe on the first video stream with flat output and returns its fields keyed by name. Stream fields keep
+// their bare name ("width") and format fields are prefixed ("format.duration"), whatever order ffprobe prints them.
+std::map<std::string, std::string> probeFields(const fs::path& ffprobe, const fs::path& input,
+                                               const std::vector<std::string>& options) {
+    std::vector<std::string> args = {ffprobe.string(), "-v", "error", "-select_streams", "v:0"};
+    args.insert(args.end(), options.begin(), options.end());
+    args.insert(args.end(), {"-of", "flat", input.string()});
 
-    auto res = runCommand(cmd.str());
+    auto res = runCommand(args);
     if (res.exitCode != 0) {
         throw std::runtime_error("Failed to probe video metadata:\n" + res.output);
     }
 
+    std::map<std::string, std::string> fields;
     std::istringstream output(res.output);
     std::string line;
-    std::getline(output, line);
-    auto tokens = splitCsvLine(line);
-    if (tokens.size() < 6) {
-        throw std::runtime_error("Unexpected ffprobe output:\n" + res.output);
+    while (std::getline(output, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        auto eq = line.find('=');
+        if (eq == std::string::npos) {
+            continue;
+        }
+        std::string key = line.substr(0, eq);
+        std::string value = line.substr(eq + 1);
+        if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+            value = value.substr(1, value.size() - 2);
+        }
+        const std::string streamPrefix = "streams.stream.0.";
+        if (key.compare(0, streamPrefix.size(), streamPrefix) == 0) {
+            key = key.substr(streamPrefix.size());
+        }
+        fields[key] = value;
     }
+    return fields;
+}
+
+std::string fieldOr(const std::map<std::string, std::string>& fields, const std::string& key) {
+    auto it = fields.find(key);
+    return it != fields.end() ? it->second : std::string();
+}
+
+// The frame count only has to be good enough for progress display and resume bookkeeping, so the cheapest source
+// that has one wins: the container's nb_frames, then duration x frame rate, then counting packets (demux only), and
+// as a last resort decoding every frame. The total is corrected from the real frames once decoding finishes.
+VideoMetadata probeVideo(const fs::path& ffprobe, const fs::path& input) {
+    auto fields = probeFields(ffprobe, input,
+                              {"-show_entries",
+                               "stream=width,height,avg_frame_rate,nb_frames,duration:format=duration,start_time"});
 
     VideoMetadata meta{};
-    meta.width = static_cast<int>(safeParseLong(tokens[0]));
-    meta.height = static_cast<int>(safeParseLong(tokens[1]));
-    auto nbReadFrames = safeParseLong(tokens[2]);
-    auto nbFrames = safeParseLong(tokens[3]);
-    meta.fpsRaw = tokens[4];
+    meta.width = static_cast<int>(safeParseLong(fieldOr(fields, "width")));
+    meta.height = static_cast<int>(safeParseLong(fieldOr(fields, "height")));
+    meta.fpsRaw = fieldOr(fields, "avg_frame_rate");
+    if (meta.fpsRaw == "0/0") {
+        meta.fpsRaw.clear();
+    }
     meta.fps = parseFrameRate(meta.fpsRaw);
-    meta.duration = safeParseDouble(tokens[5]);
+    meta.duration = safeParseDouble(fieldOr(fields, "duration"));
+    if (meta.duration <= 0.0) {
+        meta.duration = safeParseDouble(fieldOr(fields, "format.duration"));
+    }
+    meta.startTime = safeParseDouble(fieldOr(fields, "format.start_time"));
+    if (meta.width <= 0 || meta.height <= 0) {
+        throw std::runtime_error("ffprobe reported no video stream in " + input.string());
+    }
 
-    if (nbReadFrames > 0) {
-        meta.totalFrames = nbReadFrames;
-    } else if (nbFrames > 0) {
+    if (auto nbFrames = safeParseLong(fieldOr(fields, "nb_frames")); nbFrames > 0) {
         meta.totalFrames = nbFrames;
+        meta.frameCountSource = "container";
     } else if (meta.duration > 0.0 && meta.fps > 0.0) {
         meta.totalFrames = static_cast<long long>(meta.duration * meta.fps + 0.5);
+        meta.frameCountSource = "duration x fps";
+    } else if (auto packets = safeParseLong(fieldOr(
+                   probeFields(ffprobe, input, {"-count_packets", "-show_entries", "stream=nb_read_packets"}),
+                   "nb_read_packets"));
+               packets > 0) {
+        meta.totalFrames = packets;
+        meta.frameCountSource = "packets";
     } else {
-        meta.totalFrames = 0;
+        std::cout << "Container has no frame count; counting frames (this decodes the whole video)...\n";
+        meta.totalFrames = std::max<long long>(
+            0, safeParseLong(fieldOr(
+                   probeFields(ffprobe, input, {"-count_frames", "-show_entries", "stream=nb_read_frames"}),
+                   "nb_read_frames")));
+        meta.frameCountSource = "decoded";
     }
 
     return meta;
 }
 
-void ensureDirectory(const fs::path& path) {
-    fs::create_directories(path);
+// Presentation time of one video packet and whether it starts a keyframe.
+struct PacketTime {
+    double pts{};
+    bool keyframe = false;
+};
+
+// Reads every packet's timestamp and flags from the demuxer, without decoding, sorted into presentation order. The
+// listing has one line per frame, so it is read from a pipe rather than through runCommand's bounded capture.
+std::vector<PacketTime> probePackets(const fs::path& ffprobe, const fs::path& input) {
+    ProcessOptions options;
+    options.out = StreamMode::Pipe;
+    Process probe({ffprobe.string(), "-v", "error", "-select_streams", "v:0", "-show_entries", "packet=pts_time,flags",
+                   "-of", "csv=p=0", input.string()},
+                  options);
+    std::vector<PacketTime> packets;
+    char buffer[256];
+    while (std::fgets(buffer, sizeof(buffer), probe.output())) {
+        std::string line = buffer;
+        while (!line.empty() && std::isspace(static_cast<unsigned char>(line.back()))) {
+            line.pop_back();
+        }
+        const auto comma = line.find(',');
+        if (comma == std::string::npos || line.compare(0, comma, "N/A") == 0) {
+            continue;
+        }
+        try {
+            packets.push_back({std::stod(line.substr(0, comma)), line.find('K', comma) != std::string::npos});
+        } catch (const std::exception&) {
+            // Not a packet line.
+        }
+    }
+    if (probe.wait() != 0) {
+        throw std::runtime_error("Failed to list the packets of " + input.string() + ":\n" + probe.capturedOutput());
+    }
+    std::stable_sort(packets.begin(), packets.end(), [](const auto& a, const auto& b) { return a.pts < b.pts; });
+    return packets;
 }
 
-void extractAudio(const fs::path& ffmpeg, const fs::path& input, const fs::path& output) {
-    std::ostringstream cmd;
-    cmd << shellEscape(ffmpeg.string()) << " -y -i " << shellEscape(input.string()) << " -vn -acodec copy "
-        << shellEscape(output.string());
-    auto res = runCommand(cmd.str());
-    if (res.exitCode != 0) {
-        std::cout << "No audio track was extracted (audio will be omitted in the final render).\n";
-    } else {
-        std::cout << "Audio extracted to " << output << "\n";
+// A run of frames that starts on a keyframe and can be decoded, upscaled and encoded on its own.
+struct Segment {
+    std::size_t index{};
+    double start{};      // Presentation time of the first frame as ffprobe lists it; 0 for the first segment.
+    long long frames{};
+};
+
+// Splits the input into up to count segments of about the same number of frames, each cut on the keyframe nearest to
+// its ideal boundary. Short inputs or sparse keyframes give fewer segments.
+std::vector<Segment> planSegments(const std::vector<PacketTime>& packets, std::size_t count) {
+    std::vector<std::size_t> cuts = {0};
+    for (std::size_t s = 1; s < count; ++s) {
+        const std::size_t target = s * packets.size() / count;
+        auto distance = [target](std::size_t i) { return i > target ? i - target : target - i; };
+        std::optional<std::size_t> best;
+        for (std::size_t i = cuts.back() + 1; i < packets.size(); ++i) {
+            if (packets[i].keyframe && (!best || distance(i) < distance(*best))) {
+                best = i;
+            }
+        }
+        if (best) {
+            cuts.push_back(*best);
+        }
+    }
+
+    std::vector<Segment> segments;
+    for (std::size_t i = 0; i < cuts.size(); ++i) {
+        const std::size_t end = i + 1 < cuts.size() ? cuts[i + 1] : packets.size();
+        segments.push_back({i, i == 0 ? 0.0 : packets[cuts[i]].pts, static_cast<long long>(end - cuts[i])});
     }
+    return segments;
 }
 
-void extractFrames(const fs::path& ffmpeg, const fs::path& input, const fs::path& outputDir) {
-    ensureDirectory(outputDir);
-    std::ostringstream cmd;
-    cmd << shellEscape(ffmpeg.string()) << " -y -i " << shellEscape(input.string()) << " -vsync 0 "
-        << outputDir.string() << "/frame_%08d.png";
-    auto res = runCommand(cmd.str());
-    if (res.exitCode != 0) {
-        throw std::runtime_error("Failed to extract frames:\n" + res.output);
+constexpr int kMaxOutputWidth = 2560;
+constexpr int kMaxOutputHeight = 1440;
+// Largest tile handed to Real-ESRGAN; realesrgan-ncnn-vulkan uses the same value on cards with ~2 GB of heap or more.
+constexpr int kDefaultMaxTile = 200;
+
+struct UpscaleModel {
+    std::string name;  // realesrgan-ncnn-vulkan's -n.
+    int scale;
+    std::string files;  // Stem of the .param/.bin pair.
+    // Used by the in-process engine; realesrgan-ncnn-vulkan picks its own.
+    Precision precision = Precision::Mixed;
+    // Where a custom model's files were found (realesrgan-ncnn-vulkan's -m); empty for the models it ships with.
+    fs::path dir;
+};
+
+// Models realesrgan-ncnn-vulkan ships with. realesr-animevideov3 is a far smaller network than the x4plus models and
+// comes in three scales.
+const std::vector<UpscaleModel>& knownModels() {
+    static const std::vector<UpscaleModel> models = {
+        {"realesrgan-x4plus", 4, "realesrgan-x4plus", Precision::Mixed, {}},
+        {"realesrgan-x4plus-anime", 4, "realesrgan-x4plus-anime", Precision::Mixed, {}},
+        {"realesr-animevideov3", 2, "realesr-animevideov3-x2", Precision::Mixed, {}},
+        {"realesr-animevideov3", 3, "realesr-animevideov3-x3", Precision::Mixed, {}},
+        {"realesr-animevideov3", 4, "realesr-animevideov3-x4", Precision::Mixed, {}},
+    };
+    return models;
+}
+
+const std::vector<std::pair<std::string, Precision>>& precisionNames() {
+    static const std::vector<std::pair<std::string, Precision>> names = {
+        {"fp32", Precision::Fp32}, {"mixed", Precision::Mixed}, {"fp16", Precision::Fp16}, {"int8", Precision::Int8}};
+    return names;
+}
+
+std::string precisionName(Precision precision) {
+    for (const auto& [name, value] : precisionNames()) {
+        if (value == precision) {
+            return name;
+        }
     }
+    return "mixed";
 }
 
-void printProgress(const std::string& label, std::size_t completed, std::size_t total) {
-    double percent = total > 0 ? (static_cast<double>(completed) / static_cast<double>(total)) * 100.0 : 0.0;
-    std::cout << "\r" << label << " " << completed << "/" << total << " (" << std::fixed << std::setprecision(1)
-              << percent << "%)" << std::flush;
+Precision findPrecision(const std::string& name) {
+    std::string known;
+    for (const auto& [candidate, value] : precisionNames()) {
+        if (candidate == name) {
+            return value;
+        }
+        known += (known.empty() ? "" : ", ") + candidate;
+    }
+    throw std::runtime_error("Unknown precision '" + name + "' (expected one of: " + known + ").");
 }
 
-void upscaleFrames(const fs::path& realesrgan, const fs::path& inputDir, const fs::path& outputDir, std::size_t totalFrames) {
-    ensureDirectory(outputDir);
+// Speed / quality trade-off: the models the scale planner chooses from, and the precision they run at.
+struct ModelPreset {
+    std::string name;
+    std::string models;  // Model name in knownModels(); every scale of it is a candidate.
+    Precision precision;
+};
+
+const std::vector<ModelPreset>& modelPresets() {
+    static const std::vector<ModelPreset> presets = {
+        {"preview", "realesr-animevideov3", Precision::Fp16},
+        {"standard", "realesrgan-x4plus", Precision::Mixed},
+        {"max", "realesrgan-x4plus", Precision::Fp32},
+    };
+    return presets;
+}
 
-    std::vector<fs::path> frames;
-    for (const auto& entry : fs::directory_iterator(inputDir)) {
-        if (entry.is_regular_file()) {
-            frames.push_back(entry.path());
+ModelPreset findModelPreset(const std::string& name) {
+    std::string known;
+    for (const auto& preset : modelPresets()) {
+        if (preset.name == name) {
+            return preset;
         }
+        known += (known.empty() ? "" : ", ") + preset.name;
     }
+    throw std::runtime_error("Unknown preset '" + name + "' (expected one of: " + known + ").");
+}
 
-    std::sort(frames.begin(), frames.end());
-    if (frames.empty()) {
-        throw std::runtime_error("No frames found to upscale.");
+struct FrameSize {
+    int width{};
+    int height{};
+};
+
+// Same rule as the final ffmpeg scale filter: shrink to fit the box keeping aspect ratio, then force even sizes.
+FrameSize fitWithin(FrameSize size, int maxWidth, int maxHeight) {
+    if (size.width > maxWidth || size.height > maxHeight) {
+        double factor = std::min(static_cast<double>(maxWidth) / size.width, static_cast<double>(maxHeight) / size.height);
+        size.width = std::max(1, static_cast<int>(size.width * factor + 0.5));
+        size.height = std::max(1, static_cast<int>(size.height * factor + 0.5));
+    }
+    size.width = std::max(2, size.width / 2 * 2);
+    size.height = std::max(2, size.height / 2 * 2);
+    return size;
+}
+
+int ceilDiv(int value, int divisor) {
+    return (value + divisor - 1) / divisor;
+}
+
+// Picks the smallest tile (up to maxTile) that still covers the frame with the same number of tiles, so the last
+// row and column are not thin leftovers that cost a full inference pass each.
+int balancedTileSize(FrameSize size, int maxTile) {
+    int across = ceilDiv(size.width, maxTile);
+    int down = ceilDiv(size.height, maxTile);
+    return std::max(ceilDiv(size.width, across), ceilDiv(size.height, down));
+}
+
+struct ScalePlan {
+    bool upscale = true;     // False when the source already meets the output cap and is only re-encoded.
+    UpscaleModel model;
+    FrameSize source;
+    FrameSize inference;     // Frame size fed to the model, after an optional downscale during extraction.
+    FrameSize output;        // Final encoded size.
+    int tileSize = 0;
+
+    bool preScale() const { return upscale && (inference.width != source.width || inference.height != source.height); }
+};
+
+// Chooses the cheapest way to reach the capped output with the given models (those of the preset, or of --model):
+// skip inference when the source is already large enough, otherwise take the lowest model scale that reaches the
+// target and shrink the input so the model produces (close to) exactly the target size instead of a far larger frame
+// that is thrown away by the final scale.
+ScalePlan planScale(const VideoMetadata& metadata, const std::vector<UpscaleModel>& models) {
+    if (models.empty()) {
+        throw std::runtime_error("No upscaling model is available.");
+    }
+
+    ScalePlan plan;
+    plan.source = {metadata.width, metadata.height};
+    if (plan.source.width <= 0 || plan.source.height <= 0) {
+        // Without a resolution there is nothing to plan against; keep the plain full-scale pass.
+        plan.model = *std::max_element(models.begin(), models.end(),
+                                       [](const auto& a, const auto& b) { return a.scale < b.scale; });
+        plan.inference = plan.source;
+        return plan;
+    }
+
+    if (plan.source.width >= kMaxOutputWidth || plan.source.height >= kMaxOutputHeight) {
+        plan.upscale = false;
+        plan.inference = plan.source;
+        plan.output = fitWithin(plan.source, kMaxOutputWidth, kMaxOutputHeight);
+        return plan;
     }
 
-    const std::size_t total = totalFrames > 0 ? totalFrames : frames.size();
-    std::size_t processed = 0;
+    std::vector<UpscaleModel> byScale = models;
+    std::sort(byScale.begin(), byScale.end(), [](const auto& a, const auto& b) { return a.scale < b.scale; });
+    const int maxScale = byScale.back().scale;
+    const FrameSize target =
+        fitWithin({plan.source.width * maxScale, plan.source.height * maxScale}, kMaxOutputWidth, kMaxOutputHeight);
 
-    for (const auto& frame : frames) {
-        fs::path outputFrame = outputDir / frame.filename();
-        std::ostringstream cmd;
-        cmd << shellEscape(realesrgan.string()) << " -i " << shellEscape(frame.string()) << " -o "
-            << shellEscape(outputFrame.string()) << " -n realesrgan-x4plus -s 4 -g 0";
-        auto res = runCommand(cmd.str());
-        if (res.exitCode != 0) {
-            throw std::runtime_error("Real-ESRGAN failed on frame " + frame.string() + ":\n" + res.output);
+    plan.model = byScale.back();
+    for (const auto& model : byScale) {
+        if (plan.source.width * model.scale >= target.width && plan.source.height * model.scale >= target.height) {
+            plan.model = model;
+            break;
         }
+    }
+
+    const int scale = plan.model.scale;
+    plan.inference = plan.source;
+    if (plan.source.width * scale > target.width && plan.source.height * scale > target.height) {
+        plan.inference = {std::max(1, ceilDiv(target.width, scale)), std::max(1, ceilDiv(target.height, scale))};
+    }
+    plan.output = fitWithin({plan.inference.width * scale, plan.inference.height * scale}, kMaxOutputWidth,
+                            kMaxOutputHeight);
+    plan.tileSize = balancedTileSize(plan.inference, kDefaultMaxTile);
+    return plan;
+}
 
-        ++processed;
-        printProgress("Upscaling frames:", processed, total);
+void printPlan(const ScalePlan& plan) {
+    std::cout << "Scale plan: source " << plan.source.width << "x" << plan.source.height;
+    if (!plan.upscale) {
+        std::cout << " already meets the 1440p cap; skipping upscaling, output " << plan.output.width << "x"
+                  << plan.output.height << "\n";
+        return;
+    }
+    if (plan.preScale()) {
+        std::cout << " -> pre-scale " << plan.inference.width << "x" << plan.inference.height;
+    }
+    const double inferred = static_cast<double>(plan.inference.width) * plan.inference.height * plan.model.scale *
+                            plan.model.scale;
+    std::cout << " -> " << plan.model.name << " x" << plan.model.scale << " (tile " << plan.tileSize;
+    if (plan.model.precision != Precision::Mixed) {
+        std::cout << ", " << precisionName(plan.model.precision);
+    }
+    std::cout << ") -> output " << plan.output.width << "x" << plan.output.height;
+    const double naive = static_cast<double>(plan.source.width) * plan.source.height * 16.0;
+    if (inferred > 0.0 && naive > inferred * 1.01) {
+        std::cout << ", " << std::fixed << std::setprecision(1) << naive / inferred
+                  << "x fewer upscaled pixels than a plain x4 pass";
     }
     std::cout << "\n";
 }
 
-std::string buildScaleFilter() {
-    std::ostringstream filter;
-    filter << "scale='min(2560,iw)':'min(1440,ih)':force_original_aspect_ratio=decrease";
-    filter << ",scale=trunc(iw/2)*2:trunc(ih/2)*2";
-    return filter.str();
+void ensureDirectory(const fs::path& path) {
+    fs::create_directories(path);
 }
 
-void assembleVideo(const fs::path& framesDir,
-                   const fs::path& audioFile,
-                   const fs::path& outputFile,
-                   const std::string& fpsRaw,
-                   bool hasAudio,
-                   const fs::path& ffmpeg) {
-    std::ostringstream cmd;
-    cmd << shellEscape(ffmpeg.string()) << " -y -framerate " << (fpsRaw.empty() ? "30" : fpsRaw)
-        << " -i " << shellEscape((framesDir / "frame_%08d.png").string()) << " ";
-
-    if (hasAudio) {
-        cmd << "-i " << shellEscape(audioFile.string()) << " -map 0:v:0 -map 1:a:0 ";
-    } else {
-        cmd << "-map 0:v:0 ";
+// What the output carries over from the source besides the upscaled video. Every audio track and the chapters are
+// copied; subtitles are kept where the output container can hold them. An empty source means video only, as for
+// segments, which get the rest when they are joined.
+struct Passthrough {
+    fs::path source;
+    // Positions among the source's subtitle streams, and the codec they are written with.
+    std::vector<int> subtitles;
+    std::string subtitleCodec;
+};
+
+// Codec names of the source's subtitle streams, in order. A probe failure just means no subtitles are carried over.
+std::vector<std::string> probeSubtitleCodecs(const fs::path& ffprobe, const fs::path& input) {
+    auto res = runCommand({ffprobe.string(), "-v", "error", "-select_streams", "s", "-show_entries",
+                           "stream=codec_name", "-of", "csv=p=0", input.string()});
+    std::vector<std::string> codecs;
+    if (res.exitCode != 0) {
+        return codecs;
+    }
+    std::istringstream output(res.output);
+    for (std::string line; std::getline(output, line);) {
+        while (!line.empty() && std::isspace(static_cast<unsigned char>(line.back()))) {
+            line.pop_back();
+        }
+        if (!line.empty()) {
+            codecs.push_back(line);
+        }
     }
+    return codecs;
+}
 
-    cmd << "-vf \"" << buildScaleFilter() << "\" "
-        << "-c:v h264_nvenc -preset p3 -pix_fmt yuv420p ";
+// Matroska takes any subtitle as it is. MP4 and QuickTime only hold mov_text, which text subtitles convert to; bitmap
+// subtitles (PGS, DVD, DVB) cannot be converted and are left out, as they are for any other container.
+Passthrough planPassthrough(const fs::path& source, const std::vector<std::string>& subtitleCodecs,
+                            const fs::path& output) {
+    static const std::set<std::string> textCodecs = {"subrip", "srt", "ass", "ssa", "mov_text", "webvtt", "text"};
+    std::string extension = output.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    const bool matroska = extension == ".mkv";
+    const bool mp4 = extension == ".mp4" || extension == ".m4v" || extension == ".mov";
 
-    if (hasAudio) {
-        cmd << "-c:a copy ";
+    Passthrough passthrough{source, {}, matroska ? "copy" : "mov_text"};
+    for (std::size_t i = 0; i < subtitleCodecs.size(); ++i) {
+        if (matroska || (mp4 && textCodecs.count(subtitleCodecs[i]))) {
+            passthrough.subtitles.push_back(static_cast<int>(i));
+        }
+    }
+    if (passthrough.subtitles.size() < subtitleCodecs.size()) {
+        std::cout << "Leaving out " << subtitleCodecs.size() - passthrough.subtitles.size()
+                  << " subtitle stream(s) that " << (extension.empty() ? "the output" : extension)
+                  << " files cannot hold.\n";
     }
+    return passthrough;
+}
 
-    cmd << shellEscape(outputFile.string());
+// Maps the source, given to ffmpeg as input number `input`, for everything but the video. "a?" makes a source without
+// audio map nothing instead of failing.
+std::vector<std::string> buildPassthroughArgs(const Passthrough& passthrough, int input) {
+    if (passthrough.source.empty()) {
+        return {};
+    }
+    const std::string index = std::to_string(input);
+    std::vector<std::string> args = {"-map", index + ":a?"};
+    for (int subtitle : passthrough.subtitles) {
+        args.insert(args.end(), {"-map", index + ":s:" + std::to_string(subtitle)});
+    }
+    args.insert(args.end(), {"-map_chapters", index, "-c:a", "copy"});
+    if (!passthrough.subtitles.empty()) {
+        args.insert(args.end(), {"-c:s", passthrough.subtitleCodec});
+    }
+    return args;
+}
 
-    auto res = runCommand(cmd.str());
-    if (res.exitCode != 0) {
-        throw std::runtime_error("Failed to assemble video:\n" + res.output);
+// The source as a second ffmpeg input, after the one carrying the new video.
+std::vector<std::string> buildSourceInputArgs(const Passthrough& passthrough) {
+    if (passthrough.source.empty()) {
+        return {};
     }
+    return {"-i", passthrough.source.string()};
 }
 
-struct UpscaleConfig {
-    fs::path input;
-    fs::path output;
-    fs::path workspace;
-    fs::path execDir;
-    fs::path ffmpeg;
-    fs::path ffprobe;
-    fs::path realesrgan;
+std::string buildScaleFilter() {
+    std::ostringstream filter;
+    filter << "scale='min(" << kMaxOutputWidth << ",iw)':'min(" << kMaxOutputHeight
+           << ",ih)':force_original_aspect_ratio=decrease";
+    filter << ",scale=trunc(iw/2)*2:trunc(ih/2)*2";
+    return filter.str();
+}
+
+// NVDEC decode and CUDA resizing, enabled with --hwaccel once the ffmpeg build is known to support them.
+struct HwAccel {
+    bool enabled = false;
+    // scale_cuda, or scale_npp for builds with libnpp but without the CUDA filters.
+    std::string scaler;
 };
 
-UpscaleConfig parseArgs(int /*argc*/, char** argv) {
-    UpscaleConfig cfg;
-    cfg.execDir = executableDir(argv[0]);
-    cfg.workspace = fs::temp_directory_path() / "icecale-work";
+HwAccel detectHwAccel(const fs::path& ffmpeg) {
+    const auto filters = runCommand({ffmpeg.string(), "-hide_banner", "-filters"});
+    const auto hwaccels = runCommand({ffmpeg.string(), "-hide_banner", "-hwaccels"});
+    auto listed = [](const std::string& text, const std::string& name) {
+        std::istringstream lines(text);
+        std::string token;
+        while (lines >> token) {
+            if (token == name) {
+                return true;
+            }
+        }
+        return false;
+    };
+    if (hwaccels.exitCode != 0 || !listed(hwaccels.output, "cuda")) {
+        throw std::runtime_error("--hwaccel needs an ffmpeg build with CUDA hardware decoding (ffmpeg -hwaccels).");
+    }
+    if (filters.exitCode != 0 || !listed(filters.output, "hwupload_cuda")) {
+        throw std::runtime_error("--hwaccel needs an ffmpeg build with the hwupload_cuda filter.");
+    }
+    for (const char* scaler : {"scale_cuda", "scale_npp"}) {
+        if (listed(filters.output, scaler)) {
+            return {true, scaler};
+        }
+    }
+    throw std::runtime_error("--hwaccel needs an ffmpeg build with the scale_cuda or scale_npp filter.");
+}
+
+// Resize of CUDA frames to an exact size, converting to pixelFormat (nv12, or p010le for 10-bit encodes) on the way.
+std::string buildCudaScaleFilter(const HwAccel& hw, FrameSize size, const std::string& pixelFormat = "nv12") {
+    std::ostringstream filter;
+    filter << hw.scaler << "=" << size.width << ":" << size.height << ":format=" << pixelFormat << ":interp_algo="
+           << (hw.scaler == "scale_npp" ? "super" : "lanczos");
+    return filter.str();
+}
 
-    std::cout << "Enter the path to the input video: " << std::flush;
-    std::string inputLine;
-    std::getline(std::cin, inputLine);
-    if (inputLine.empty()) {
-        throw std::runtime_error("No input path provided.");
+// Downscale to the inference size during extraction. With --hwaccel it runs on the decoded CUDA frames and only the
+// small result is copied back to system memory.
+std::string buildPreScaleFilter(const ScalePlan& plan, const HwAccel& hw) {
+    if (hw.enabled) {
+        return buildCudaScaleFilter(hw, plan.inference) + ",hwdownload,format=nv12";
     }
+    std::ostringstream filter;
+    filter << "scale=" << plan.inference.width << ":" << plan.inference.height << ":flags=area";
+    return filter.str();
+}
 
-    cfg.input = fs::absolute(fs::path(inputLine)).lexically_normal();
-    fs::path downloads = downloadsDirectory();
-    fs::path outputName = cfg.input.stem();
-    if (outputName.empty()) {
-        outputName = "upscaled_video";
+// Decoder input options. Frames only stay in device memory when a GPU resize follows; otherwise NVDEC output is
+// copied back to system memory for the CPU filters and encoders downstream.
+std::vector<std::string> buildDecodeArgs(const HwAccel& hw, bool deviceFrames) {
+    if (!hw.enabled) {
+        return {};
     }
-    outputName += "_upscaled.mp4";
-    cfg.output = downloads / outputName;
+    if (deviceFrames) {
+        return {"-hwaccel", "cuda", "-hwaccel_output_format", "cuda"};
+    }
+    return {"-hwaccel", "cuda"};
+}
 
-    return cfg;
+// Input -ss position of a presentation time from the demuxer. MPEG-TS, many Matroska files and trimmed MP4s start
+// at a nonzero start_time, which -ss counts from.
+double inputSeekOffset(const VideoMetadata& metadata, double pts) {
+    return std::max(0.0, pts - metadata.startTime);
 }
 
-}  // namespace
+// Input seek for a segment. It aims half a frame before the segment's keyframe: accurate seeking then decodes from
+// that keyframe and drops nothing, even when the printed timestamp is rounded slightly past the real one.
+std::vector<std::string> buildSeekArgs(const VideoMetadata& metadata) {
+    if (metadata.seekTo <= 0.0) {
+        return {};
+    }
+    const double halfFrame = metadata.fps > 0.0 ? 0.5 / metadata.fps : 0.001;
+    std::ostringstream position;
+    position << std::fixed << std::setprecision(6) << std::max(0.0, metadata.seekTo - halfFrame);
+    return {"-ss", position.str()};
+}
 
-int main(int argc, char** argv) {
-    try {
-        auto config = parseArgs(argc, argv);
+// NVENC settings for the final encode. A named profile fills in everything but the codec and bit depth, which are
+// chosen separately.
+struct EncoderProfile {
+    std::string name;
+    std::string preset;       // p1 (fastest) ... p7 (best).
+    int cq{};                 // Constant-quality target for -rc vbr; lower is better.
+    int bframes{};
+    int lookahead{};          // Frames of rate-control lookahead; 0 disables it.
+    std::string multipass;    // disabled, qres or fullres.
+    bool spatialAq = false;
+    bool temporalAq = false;  // H.264 and HEVC only.
+    // Split one frame across the card's NVENC engines at 1440p and above (HEVC and AV1, on cards with several).
+    bool splitFrame = false;
+
+    std::string codec = "h264";
+    bool tenBit = false;
+
+    std::string encoder() const { return codec + "_nvenc"; }
+};
 
-        if (!fs::exists(config.input)) {
-            throw std::runtime_error("Input file does not exist: " + config.input.string());
+const std::vector<EncoderProfile>& encoderProfiles() {
+    static const std::vector<EncoderProfile> profiles = {
+        {"fast", "p2", 25, 0, 0, "disabled", false, false, true},
+        {"balanced", "p4", 23, 2, 16, "qres", true, false, false},
+        {"archive", "p7", 19, 4, 32, "fullres", true, true, false},
+    };
+    return profiles;
+}
+
+EncoderProfile findEncoderProfile(const std::string& name) {
+    std::string known;
+    for (const auto& profile : encoderProfiles()) {
+        if (profile.name == name) {
+            return profile;
         }
+        known += (known.empty() ? "" : ", ") + profile.name;
+    }
+    throw std::runtime_error("Unknown encoder profile '" + name + "' (expected one of: " + known + ").");
+}
 
-        std::cout << "Verifying environment...\n";
-        requireNvidiaGpu();
-        config.ffmpeg = findTool(config.execDir, "ffmpeg");
-        config.ffprobe = findTool(config.execDir, "ffprobe");
-        config.realesrgan = findTool(config.execDir, "realesrgan-ncnn-vulkan");
+// Checked once at startup next to requireCommand: the encoder must be in this ffmpeg build, and options newer than
+// the build are dropped with a note instead of failing every job.
+void requireEncoder(const fs::path& ffmpeg, EncoderProfile& profile) {
+    const auto encoders = runCommand({ffmpeg.string(), "-hide_banner", "-encoders"});
+    std::istringstream lines(encoders.output);
+    bool listed = false;
+    for (std::string token; !listed && lines >> token;) {
+        listed = token == profile.encoder();
+    }
+    if (encoders.exitCode != 0 || !listed) {
+        throw std::runtime_error("This ffmpeg build has no " + profile.encoder() + " encoder (ffmpeg -encoders).");
+    }
+    if (profile.splitFrame) {
+        const auto help = runCommand({ffmpeg.string(), "-hide_banner", "-h", "encoder=" + profile.encoder()});
+        if (help.output.find("split_encode_mode") == std::string::npos) {
+            profile.splitFrame = false;
+            if (profile.codec != "h264") {
+                std::cout << "This ffmpeg build cannot split frames across NVENC engines; encoding on one.\n";
+            }
+        }
+    }
+}
 
-        requireCommand(config.ffmpeg);
-        requireCommand(config.ffprobe);
-        requireCommand(config.realesrgan, "-h");
+std::vector<std::string> buildEncoderOptions(const EncoderProfile& profile, FrameSize output) {
+    std::vector<std::string> args = {"-c:v", profile.encoder(), "-preset", profile.preset, "-rc", "vbr",
+                                     "-cq", std::to_string(profile.cq), "-b:v", "0",
+                                     "-bf", std::to_string(profile.bframes), "-multipass", profile.multipass};
+    if (profile.lookahead > 0) {
+        args.insert(args.end(), {"-rc-lookahead", std::to_string(profile.lookahead)});
+    }
+    if (profile.spatialAq) {
+        args.insert(args.end(), {"-spatial-aq", "1"});
+    }
+    if (profile.temporalAq && profile.codec != "av1") {
+        args.insert(args.end(), {"-temporal-aq", "1"});
+    }
+    const long long pixels = static_cast<long long>(output.width) * output.height;
+    if (profile.splitFrame && profile.codec != "h264" &&
+        pixels >= static_cast<long long>(kMaxOutputWidth) * kMaxOutputHeight) {
+        args.insert(args.end(), {"-split_encode_mode", "forced"});
+    }
+    if (profile.tenBit) {
+        args.insert(args.end(), {"-profile:v", profile.codec == "hevc" ? "main10" : "main"});
+    }
+    if (profile.codec == "hevc") {
+        // Lets Apple players recognise HEVC in MP4.
+        args.insert(args.end(), {"-tag:v", "hvc1"});
+    }
+    return args;
+}
 
-        std::cout << "Probing input video...\n";
-        auto metadata = probeVideo(config.ffprobe, config.input);
-        std::cout << "Resolution: " << metadata.width << "x" << metadata.height << ", FPS: "
-                  << (metadata.fpsRaw.empty() ? std::to_string(metadata.fps) : metadata.fpsRaw)
-                  << ", Frames: " << metadata.totalFrames << "\n";
+// Video filter and NVENC options for the final encode to plan.output. On the CPU this is the generic 1440p cap; with
+// --hwaccel the frames are resized on the GPU to the size the plan computed, which the CUDA scalers need explicitly.
+// deviceFrames says the input already arrives as CUDA frames from NVDEC; frames read from a pipe are uploaded first.
+std::vector<std::string> buildEncodeArgs(const ScalePlan& plan,
+                                         const HwAccel& hw,
+                                         const EncoderProfile& encoder,
+                                         FrameSize input,
+                                         bool deviceFrames) {
+    std::vector<std::string> args;
+    const std::string gpuFormat = encoder.tenBit ? "p010le" : "nv12";
+    const bool gpuScale = hw.enabled && plan.output.width > 0 && plan.output.height > 0;
+    if (!gpuScale) {
+        args = {"-vf", buildScaleFilter(), "-pix_fmt", encoder.tenBit ? "p010le" : "yuv420p"};
+    } else if (deviceFrames) {
+        // Decoded CUDA frames always pass the scaler, which also sets the bit depth the encoder expects.
+        args = {"-vf", buildCudaScaleFilter(hw, plan.output, gpuFormat)};
+    } else if (input.width != plan.output.width || input.height != plan.output.height) {
+        args = {"-vf", "format=" + gpuFormat + ",hwupload_cuda," + buildCudaScaleFilter(hw, plan.output, gpuFormat)};
+    } else {
+        // Piped frames that are already the right size go to NVENC as they are; it uploads them itself.
+        args = {"-vf", "format=" + gpuFormat};
+    }
+    const auto options = buildEncoderOptions(encoder, plan.output);
+    args.insert(args.end(), options.begin(), options.end());
+    return args;
+}
 
-        const fs::path framesDir = config.workspace / "frames_raw";
-        const fs::path upscaledDir = config.workspace / "frames_upscaled";
-        const fs::path audioFile = config.workspace / "audio.mka";
+std::string formatDuration(double seconds) {
+    const long long total = static_cast<long long>(seconds + 0.5);
+    std::ostringstream text;
+    text << total / 3600 << ":" << std::setw(2) << std::setfill('0') << total / 60 % 60 << ":" << std::setw(2)
+         << total % 60;
+    return text.str();
+}
 
-        std::cout << "Extracting audio (if present)...\n";
-        extractAudio(config.ffmpeg, config.input, audioFile);
-        bool hasAudio = fs::exists(audioFile) && fs::file_size(audioFile) > 0;
+// Remaining time at the current rate, or empty while there is nothing to extrapolate from.
+std::string formatEta(std::size_t completed, std::size_t total, double fps) {
+    if (total == 0 || fps <= 0.0 || completed >= total) {
+        return {};
+    }
+    return "ETA " + formatDuration(static_cast<double>(total - completed) / fps);
+}
 
-        std::cout << "Extracting frames...\n";
-        extractFrames(config.ffmpeg, config.input, framesDir);
+void printProgress(const std::string& label, std::size_t completed, std::size_t total, double fps, double speed) {
+    double percent = total > 0 ? (static_cast<double>(completed) / static_cast<double>(total)) * 100.0 : 0.0;
+    std::cout << "\r" << label << " " << completed << "/" << total << " (" << std::fixed << std::setprecision(1)
+              << percent << "%, " << fps << " fps";
+    if (speed > 0.0) {
+        std::cout << ", " << std::setprecision(2) << speed << "x";
+    }
+    std::cout << ")";
+    const std::string eta = formatEta(completed, total, fps);
+    if (!eta.empty()) {
+        std::cout << " " << eta;
+    }
+    std::cout << "   " << std::flush;
+}
 
-        std::cout << "Upscaling with Real-ESRGAN (x4, capped to 1440p output)...\n";
-        upscaleFrames(config.realesrgan, framesDir, upscaledDir, static_cast<std::size_t>(metadata.totalFrames));
+// Image format of the frames the disk pipeline keeps in the workspace. Extracted frames can use any format ffmpeg
+// writes and realesrgan-ncnn-vulkan reads; upscaled frames are limited to what realesrgan writes with -f, which is
+// also the codec name ffmpeg decodes them with. The trade is CPU time spent on compression against scratch space.
+struct FrameFormat {
+    std::string name;
+    std::string rawExtension;
+    // ffmpeg encoder and options for extracted frames.
+    std::string rawEncoder;
+    std::vector<std::string> rawEncoderOptions;
+    std::string upscaled;
+};
 
-        std::cout << "Assembling final video with resolution capped at 1440p...\n";
-        assembleVideo(upscaledDir, audioFile, config.output, metadata.fpsRaw, hasAudio, config.ffmpeg);
+const std::vector<FrameFormat>& frameFormats() {
+    static const std::vector<FrameFormat> formats = {
+        {"png", "png", "png", {}, "png"},
+        {"png-fast", "png", "png", {"-compression_level", "0", "-pred", "none"}, "png"},
+        {"bmp", "bmp", "bmp", {}, "png"},
+        {"webp", "webp", "libwebp", {"-lossless", "1", "-compression_level", "0"}, "webp"},
+    };
+    return formats;
+}
 
-        std::cout << "Upscaled video saved to: " << config.output << "\n";
-        return 0;
+const FrameFormat& findFrameFormat(const std::string& name) {
+    for (const auto& format : frameFormats()) {
+        if (format.name == name) {
+            return format;
+        }
+    }
+    std::string known;
+    for (const auto& format : frameFormats()) {
+        known += (known.empty() ? "" : ", ") + format.name;
+    }
+    throw std::runtime_error("Unknown frame format '" + name + "' (expected one of: " + known + ").");
+}
+
+fs::path framePath(const fs::path& dir, std::size_t number, const std::string& extension) {
+    std::ostringstream name;
+    name << "frame_" << std::setw(8) << std::setfill('0') << number << "." << extension;
+    return dir / name.str();
+}
+
+// Inverse of framePath; nothing for files it did not name.
+std::optional<std::size_t> parseFrameNumber(const fs::path& file) {
+    const std::string stem = file.stem().string();
+    const std::string prefix = "frame_";
+    if (stem.size() <= prefix.size() || stem.compare(0, prefix.size(), prefix) != 0 ||
+        !std::all_of(stem.begin() + prefix.size(), stem.end(), [](unsigned char c) { return std::isdigit(c); })) {
+        return std::nullopt;
+    }
+    return static_cast<std::size_t>(std::stoull(stem.substr(prefix.size())));
+}
+
+// Frames are identified by the 1-based numbers framePath() names their files with, so a job's frames follow from its
+// frame count and are never found by listing a directory. 32 bits cover over two years of 60 fps video.
+using FrameId = std::uint32_t;
+
+// Per-frame state of a job indexed by frame id: whether an earlier run upscaled the frame, and which earlier frame's
+// upscaled image stands for a repeat. Two flat arrays, about 4 bytes a frame, in place of path sets and node maps.
+// Not synchronized.
+class FrameIndex {
+public:
+    bool completed(FrameId frame) const { return frame < completed_.size() && completed_[frame]; }
+    std::size_t completedCount() const { return completedCount_; }
+
+    // False when the frame was already marked.
+    bool markCompleted(FrameId frame) {
+        if (frame == 0 || completed(frame)) {
+            return false;
+        }
+        if (frame >= completed_.size()) {
+            completed_.resize(frame + 1, false);
+        }
+        completed_[frame] = true;
+        ++completedCount_;
+        return true;
+    }
+
+    std::vector<FrameId> completedFrames() const {
+        std::vector<FrameId> frames;
+        frames.reserve(completedCount_);
+        for (FrameId frame = 1; frame < completed_.size(); ++frame) {
+            if (completed_[frame]) {
+                frames.push_back(frame);
+            }
+        }
+        return frames;
+    }
+
+    // First frame that is not completed; everything before it is.
+    FrameId firstPending() const {
+        FrameId frame = 1;
+        while (completed(frame)) {
+            ++frame;
+        }
+        return frame;
+    }
+
+    // False when the frame already has a source; the first one recorded is kept.
+    bool setDuplicate(FrameId frame, FrameId source) {
+        if (frame == 0 || source == 0 || duplicateOf(frame)) {
+            return false;
+        }
+        if (frame >= sources_.size()) {
+            sources_.resize(frame + 1, 0);
+        }
+        sources_[frame] = source;
+        return true;
+    }
+
+    std::optional<FrameId> duplicateOf(FrameId frame) const {
+        if (frame >= sources_.size() || sources_[frame] == 0) {
+            return std::nullopt;
+        }
+        return sources_[frame];
+    }
+
+    // Frame whose upscaled image stands for this one. Sources can be duplicates themselves (a repeat of a reused
+    // frame, or a source a resumed run reused), so the chain is followed; it always leads to earlier frames.
+    FrameId sourceOf(FrameId frame) const {
+        while (auto source = duplicateOf(frame)) {
+            frame = *source;
+        }
+        return frame;
+    }
+
+private:
+    std::vector<bool> completed_;
+    std::vector<FrameId> sources_;  // 0 where the frame is its own source.
+    std::size_t completedCount_ = 0;
+};
+
+void linkOrCopy(const fs::path& from, const fs::path& to) {
+    std::error_code ec;
+    fs::create_hard_link(from, to, ec);
+    if (ec) {
+        fs::copy_file(from, to, fs::copy_options::overwrite_existing);
+    }
+}
+
+// Fixed-capacity queue used as the frame ring between pipeline stages; push blocks while the ring is full, so
+// memory stays bounded no matter how far the decoder runs ahead of the GPU.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(std::size_t capacity) : capacity_(capacity) {}
+
+    bool push(T value) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        notFull_.wait(lock, [&] { return closed_ || items_.size() < capacity_; });
+        if (closed_) {
+            return false;
+        }
+        items_.push_back(std::move(value));
+        notEmpty_.notify_one();
+        return true;
+    }
+
+    std::optional<T> pop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        notEmpty_.wait(lock, [&] { return closed_ || !items_.empty(); });
+        if (items_.empty()) {
+            return std::nullopt;
+        }
+        T value = std::move(items_.front());
+        items_.pop_front();
+        notFull_.notify_one();
+        return value;
+    }
+
+    // Wakes every waiter; remaining items can still be popped, further pushes are rejected.
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        notEmpty_.notify_all();
+        notFull_.notify_all();
+    }
+
+private:
+    std::size_t capacity_;
+    std::deque<T> items_;
+    bool closed_ = false;
+    std::mutex mutex_;
+    std::condition_variable notEmpty_;
+    std::condition_variable notFull_;
+};
+
+// Hands frames to a single consumer strictly in sequence order while several producers finish out of order. A
+// producer may only run ahead of the consumer by the ring capacity, which bounds memory; the frame the consumer is
+// waiting for is always admitted, so a slow producer cannot deadlock the others.
+template <typename T>
+class ReorderRing {
+public:
+    explicit ReorderRing(std::size_t capacity) : capacity_(capacity) {}
+
+    bool put(std::size_t sequence, T value) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        admitted_.wait(lock, [&] { return closed_ || sequence < next_ + capacity_; });
+        if (closed_) {
+            return false;
+        }
+        items_.emplace(sequence, std::move(value));
+        ready_.notify_all();
+        return true;
+    }
+
+    std::optional<T> take() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_.wait(lock, [&] { return closed_ || finished_ || items_.count(next_) > 0; });
+        auto it = items_.find(next_);
+        if (it == items_.end()) {
+            return std::nullopt;
+        }
+        T value = std::move(it->second);
+        items_.erase(it);
+        ++next_;
+        admitted_.notify_all();
+        return value;
+    }
+
+    // Called once every producer is done; take() drains what is left in order and then reports the end.
+    void finish() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        finished_ = true;
+        ready_.notify_all();
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        ready_.notify_all();
+        admitted_.notify_all();
+    }
+
+private:
+    std::size_t capacity_;
+    std::size_t next_ = 0;
+    std::map<std::size_t, T> items_;
+    bool finished_ = false;
+    bool closed_ = false;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::condition_variable admitted_;
+};
+
+std::string readLog(const fs::path& logFile) {
+    std::ifstream in(logFile);
+    std::ostringstream text;
+    text << in.rdbuf();
+    return text.str();
+}
+
+// Keeps the first failure raised by any pipeline thread; later ones are usually knock-on effects of the first.
+class FirstError {
+public:
+    void record(std::exception_ptr error) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!error_) {
+            error_ = error;
+        }
+    }
+
+    void rethrowIfAny() {
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::exception_ptr error_;
+};
+
+// Per-frame latencies in log-scale buckets, eight per doubling from 1 us, so a percentile is read to within about 9%
+// without keeping every sample. Safe to record into from several threads.
+class LatencyHistogram {
+public:
+    void record(double seconds) {
+        const double micros = std::max(1.0, seconds * 1e6);
+        const auto bucket = std::min(kBuckets - 1, static_cast<std::size_t>(std::log2(micros) * kPerDoubling));
+        ++counts_[bucket];
+        ++count_;
+    }
+
+    std::size_t count() const { return count_; }
+
+    // Upper edge, in seconds, of the bucket holding quantile q (0 < q <= 1); 0 without samples.
+    double percentile(double q) const {
+        const std::size_t samples = count_;
+        if (samples == 0) {
+            return 0.0;
+        }
+        const auto rank = std::max<std::size_t>(1, static_cast<std::size_t>(std::ceil(q * samples)));
+        std::size_t seen = 0;
+        for (std::size_t bucket = 0; bucket < kBuckets; ++bucket) {
+            seen += counts_[bucket];
+            if (seen >= rank) {
+                return std::exp2(static_cast<double>(bucket + 1) / kPerDoubling) / 1e6;
+            }
+        }
+        return std::exp2(static_cast<double>(kBuckets) / kPerDoubling) / 1e6;
+    }
+
+private:
+    static constexpr std::size_t kPerDoubling = 8;
+    // 2^32 us is over an hour per frame, far beyond anything a stalled GPU would still be counted for.
+    static constexpr std::size_t kBuckets = 32 * kPerDoubling;
+
+    std::array<std::atomic<std::size_t>, kBuckets> counts_{};
+    std::atomic<std::size_t> count_{0};
+};
+
+// Frame counter for one pipeline stage, shown on the live status line and in the end-of-run throughput summary.
+class StageMeter {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit StageMeter(std::string name) : name_(std::move(name)), start_(Clock::now()) {}
+
+    void add(std::size_t frames = 1) { frames_ += frames; }
+    // Bytes the stage wrote to the workspace.
+    void addBytes(std::uintmax_t bytes) { bytes_ += bytes; }
+    // Time spent producing one frame, for stages that do per-frame work worth tracking.
+    void recordLatency(double seconds) { latency_.record(seconds); }
+    // Realtime factor reported by the stage's ffmpeg process, if it reports one.
+    void setSpeed(double speed) { speed_ = speed; }
+
+    // A meter shared by the pipelines of several segments stops its clock when the last of them finishes.
+    void shareBetween(std::size_t users) { users_ = static_cast<long>(std::max<std::size_t>(1, users)); }
+
+    void finish() {
+        if (users_.fetch_sub(1) > 1) {
+            return;
+        }
+        std::int64_t expected = 0;
+        elapsedNanos_.compare_exchange_strong(expected, nanosSinceStart());
+    }
+
+    const std::string& name() const { return name_; }
+    std::size_t frames() const { return frames_; }
+    double speed() const { return speed_; }
+    std::uintmax_t bytes() const { return bytes_; }
+    const LatencyHistogram& latency() const { return latency_; }
+
+    double seconds() const {
+        std::int64_t elapsed = elapsedNanos_;
+        return static_cast<double>(elapsed != 0 ? elapsed : nanosSinceStart()) / 1e9;
+    }
+
+    double fps() const {
+        double elapsed = seconds();
+        return elapsed > 0.0 ? static_cast<double>(frames()) / elapsed : 0.0;
+    }
+
+private:
+    std::int64_t nanosSinceStart() const {
+        return std::max<std::int64_t>(
+            1, std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start_).count());
+    }
+
+    std::string name_;
+    Clock::time_point start_;
+    std::atomic<std::size_t> frames_{0};
+    std::atomic<std::int64_t> elapsedNanos_{0};
+    std::atomic<double> speed_{0.0};
+    std::atomic<std::uintmax_t> bytes_{0};
+    std::atomic<long> users_{1};
+    LatencyHistogram latency_;
+};
+
+// Latest values from an ffmpeg "-progress pipe:1" stream: blocks of key=value lines, each closed by a progress= line.
+class FfmpegProgress {
+public:
+    void parse(std::string_view line) {
+        const auto eq = line.find('=');
+        if (eq == std::string_view::npos) {
+            return;
+        }
+        const std::string_view key = line.substr(0, eq);
+        const std::string value(line.substr(eq + 1));
+        try {
+            if (key == "frame") {
+                frames_ = static_cast<std::size_t>(std::max(0LL, std::stoll(value)));
+            } else if (key == "fps") {
+                fps_ = std::stod(value);
+            } else if (key == "speed" && value != "N/A") {
+                speed_ = std::stod(value);  // "1.23x"; stod stops at the 'x'.
+            } else if (key == "progress") {
+                ended_ = value == "end";
+            }
+        } catch (const std::exception&) {
+            // Fields can read N/A before the first frame is out.
+        }
+    }
+
+    std::size_t frames() const { return frames_; }
+    double fps() const { return fps_; }
+    double speed() const { return speed_; }
+    bool ended() const { return ended_; }
+
+private:
+    std::atomic<std::size_t> frames_{0};
+    std::atomic<double> fps_{0.0};
+    std::atomic<double> speed_{0.0};
+    std::atomic<bool> ended_{false};
+};
+
+// Arguments that make ffmpeg report machine-readable progress on stdout instead of its stderr status line.
+const std::vector<std::string> kProgressArgs = {"-progress", "pipe:1", "-nostats"};
+
+// Options for an ffmpeg stage that streams frames through one pipe and logs its stderr to a file. An encoder's stdout
+// is free, so with a meter it carries -progress output whose realtime factor is shown on the meter.
+ProcessOptions pipeOptions(bool writeToChild, const fs::path& logFile, StageMeter* meter = nullptr) {
+    ProcessOptions options;
+    options.in = writeToChild ? StreamMode::Pipe : StreamMode::Null;
+    options.out = writeToChild ? StreamMode::Null : StreamMode::Pipe;
+    options.err = StreamMode::File;
+    options.errFile = logFile;
+    if (writeToChild && meter) {
+        auto progress = std::make_shared<FfmpegProgress>();
+        options.out = StreamMode::Capture;
+        options.keepBytes = 4096;
+        options.onLine = [meter, progress](std::string_view line) {
+            progress->parse(line);
+            meter->setSpeed(progress->speed());
+        };
+    }
+    return options;
+}
+
+// Frame total shown in the status line. It starts from the probe's estimate, grows if the decoder passes it and is
+// replaced by the decoder's real count once the last frame has been read.
+class FrameTotal {
+public:
+    explicit FrameTotal(long long estimate) : value_(estimate > 0 ? static_cast<std::size_t>(estimate) : 0) {}
+
+    void observe(std::size_t frameNumber) {
+        std::size_t current = value_;
+        while (frameNumber > current && !value_.compare_exchange_weak(current, frameNumber)) {
+        }
+    }
+
+    void settle(std::size_t frames) {
+        value_ = frames;
+        exact_ = true;
+    }
+
+    std::size_t value() const { return value_; }
+    bool exact() const { return exact_; }
+
+private:
+    std::atomic<std::size_t> value_;
+    std::atomic<bool> exact_{false};
+};
+
+void printStages(const std::vector<const StageMeter*>& stages, const FrameTotal& frameTotal) {
+    const std::size_t total = frameTotal.value();
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(1);
+    for (std::size_t i = 0; i < stages.size(); ++i) {
+        line << (i == 0 ? "" : " | ") << stages[i]->name() << " " << stages[i]->frames();
+        if (total > 0) {
+            line << "/" << (frameTotal.exact() ? "" : "~") << total;
+        }
+        line << " (" << stages[i]->fps() << " fps";
+        if (stages[i]->speed() > 0.0) {
+            line << ", " << std::setprecision(2) << stages[i]->speed() << "x" << std::setprecision(1);
+        }
+        line << ")";
+    }
+    // The job is done when the last stage is, so its rate sets the ETA.
+    if (!stages.empty()) {
+        const std::string eta = formatEta(stages.back()->frames(), total, stages.back()->fps());
+        if (!eta.empty()) {
+            line << " | " << eta;
+        }
+    }
+    std::cout << "\r" << line.str() << "   " << std::flush;
+}
+
+std::string formatBytes(std::uintmax_t bytes) {
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(1);
+    if (bytes >= (std::uintmax_t{1} << 30)) {
+        text << static_cast<double>(bytes) / (1 << 30) << " GiB";
+    } else if (bytes >= (std::uintmax_t{1} << 20)) {
+        text << static_cast<double>(bytes) / (1 << 20) << " MiB";
+    } else {
+        text << static_cast<double>(bytes) / (1 << 10) << " KiB";
+    }
+    return text.str();
+}
+
+void printStageSummary(const std::vector<const StageMeter*>& stages) {
+    for (const auto* stage : stages) {
+        std::cout << "  " << stage->name() << ": " << stage->frames() << " frames in " << std::fixed
+                  << std::setprecision(1) << stage->seconds() << " s (" << stage->fps() << " fps)";
+        if (stage->bytes() > 0) {
+            std::cout << ", " << formatBytes(stage->bytes()) << " written";
+        }
+        const LatencyHistogram& latency = stage->latency();
+        if (latency.count() > 0) {
+            std::cout << ", per-frame p50/p95/p99 " << std::setprecision(0) << latency.percentile(0.50) * 1e3 << "/"
+                      << latency.percentile(0.95) * 1e3 << "/" << latency.percentile(0.99) * 1e3 << " ms";
+        }
+        std::cout << "\n";
+    }
+}
+
+// What one job measured, for the end-of-job summary and the --metrics-json report.
+struct StageReport {
+    std::string name;
+    std::size_t frames{};
+    double seconds{};
+    double fps{};
+    std::uintmax_t bytes{};
+    std::size_t latencySamples{};
+    double p50{};
+    double p95{};
+    double p99{};
+};
+
+struct JobMetrics {
+    using Clock = std::chrono::steady_clock;
+
+    fs::path input;
+    fs::path output;
+    std::string mode;
+    std::string encoder;
+    std::string error;
+    bool succeeded = false;
+    std::int64_t startedAt = std::chrono::duration_cast<std::chrono::seconds>(
+                                 std::chrono::system_clock::now().time_since_epoch()).count();
+    // Sequential phases in the order they ran; the concurrent stages are timed by their meters.
+    std::vector<std::pair<std::string, double>> phases;
+    std::vector<StageReport> stages;
+    std::uintmax_t otherBytes = 0;
+    std::size_t repeatedFrames = 0;
+    // Near-identical frames that reused the previous upscaled result (--reuse-similar).
+    std::size_t reusedFrames = 0;
+    // Grid cells of upscaled frames that were compared, and those that changed and went through inference
+    // (--changed-tiles).
+    std::size_t tilesChecked = 0;
+    std::size_t tilesUpscaled = 0;
+    std::size_t cacheHits = 0;
+    // Keyframe segments the job was split into; 0 for a single pass.
+    std::size_t segments = 0;
+    // Most frame data held in workspaces at once; only tracked with --disk-budget.
+    std::uintmax_t peakScratchBytes = 0;
+    // Frames the streaming pipeline allocated up front, and the peak resident memory of icecale during the job.
+    std::uintmax_t framePoolBytes = 0;
+    std::uintmax_t peakMemoryBytes = 0;
+    // The peak covers the whole process, because other jobs ran in it at the same time.
+    bool peakMemoryProcessWide = false;
+
+    // Ends the phase that started at the previous lap (or when the job started).
+    void lap(const std::string& name) {
+        const Clock::time_point now = Clock::now();
+        phases.emplace_back(name, std::chrono::duration<double>(now - lapStart_).count());
+        lapStart_ = now;
+    }
+
+    void addStages(const std::vector<const StageMeter*>& meters) {
+        for (const auto* meter : meters) {
+            const LatencyHistogram& latency = meter->latency();
+            stages.push_back({meter->name(), meter->frames(), meter->seconds(), meter->fps(), meter->bytes(),
+                              latency.count(), latency.percentile(0.50), latency.percentile(0.95),
+                              latency.percentile(0.99)});
+        }
+    }
+
+    double seconds() const {
+        double total = 0.0;
+        for (const auto& phase : phases) {
+            total += phase.second;
+        }
+        return total;
+    }
+
+    std::uintmax_t bytesWritten() const {
+        std::uintmax_t total = otherBytes;
+        for (const auto& stage : stages) {
+            total += stage.bytes;
+        }
+        return total;
+    }
+
+private:
+    Clock::time_point lapStart_ = Clock::now();
+};
+
+// How much inference the repeat detection, near-identical reuse and frame cache avoided out of the frames upscaled.
+void printInferenceSkipped(const JobMetrics& metrics, std::size_t frames) {
+    if (metrics.repeatedFrames > 0) {
+        std::cout << "Skipped inference on " << metrics.repeatedFrames << " repeated frame(s).\n";
+    }
+    if (metrics.reusedFrames > 0) {
+        std::cout << "Reused the previous result for " << metrics.reusedFrames << " near-identical frame(s).\n";
+    }
+    const std::size_t skipped = metrics.repeatedFrames + metrics.reusedFrames + metrics.cacheHits;
+    if (metrics.reusedFrames > 0 && frames > 0) {
+        std::cout << "Inference avoided on " << skipped << " of " << frames << " frame(s) (" << std::fixed
+                  << std::setprecision(1) << 100.0 * skipped / frames << "%).\n";
+    }
+    if (metrics.tilesChecked > 0) {
+        std::cout << "Changed tiles: upscaled " << metrics.tilesUpscaled << " of " << metrics.tilesChecked
+                  << " tile(s) (" << std::fixed << std::setprecision(1)
+                  << 100.0 * metrics.tilesUpscaled / metrics.tilesChecked << "%).\n";
+    }
+}
+
+void printPhaseSummary(const JobMetrics& metrics) {
+    std::cout << "Phase times:" << std::fixed << std::setprecision(1);
+    for (const auto& [name, seconds] : metrics.phases) {
+        std::cout << " " << name << " " << seconds << " s,";
+    }
+    std::cout << " total " << metrics.seconds() << " s; " << formatBytes(metrics.bytesWritten())
+              << " written to the workspace";
+    if (metrics.peakMemoryBytes > 0) {
+        std::cout << (metrics.peakMemoryProcessWide ? ", process peak memory " : ", peak memory ")
+                  << formatBytes(metrics.peakMemoryBytes);
+    }
+    std::cout << ".\n";
+}
+
+// Runs every stage body on its own thread and refreshes the status line until all of them have returned. Bodies
+// are expected to catch their own exceptions and close the queues they share, so no thread is left waiting. Without
+// display the bodies just run; the segments of a job leave the status line to the segment runner. Once canceled is
+// set, cancel is called once to stop the bodies the way a failing stage would.
+void runStages(std::vector<std::function<void()>> bodies,
+               const std::vector<const StageMeter*>& meters,
+               const FrameTotal& total,
+               bool display = true,
+               const std::atomic<bool>* canceled = nullptr,
+               const std::function<void()>& cancel = {}) {
+    std::atomic<std::size_t> running{bodies.size()};
+    std::vector<std::thread> threads;
+    for (auto& body : bodies) {
+        threads.emplace_back([&running, body = std::move(body)] {
+            body();
+            --running;
+        });
+    }
+    bool stopped = false;
+    while ((display || canceled) && running > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        if (canceled && *canceled && !stopped) {
+            stopped = true;
+            cancel();
+        }
+        if (display) {
+            printStages(meters, total);
+        }
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (display) {
+        printStages(meters, total);
+        std::cout << "\n";
+        printStageSummary(meters);
+    }
+}
+
+// Meters of the three pipeline stages. A pipeline normally owns its set; the segments of a job share one, so the
+// status line and the summary describe the whole job.
+struct PipelineMeters {
+    StageMeter decode{"decode"};
+    StageMeter upscale{"upscale"};
+    StageMeter encode{"encode"};
+    // Frames the job is expected to produce (estimated until decoding ends), for whoever watches a job that runs
+    // without its own status line.
+    std::atomic<std::size_t> expectedFrames{0};
+    // Set by the watcher to stop the job early; the pipeline then ends as if a stage had failed.
+    std::atomic<bool> canceled{false};
+
+    std::vector<const StageMeter*> all() const { return {&decode, &upscale, &encode}; }
+
+    void shareBetween(std::size_t pipelines) {
+        decode.shareBetween(pipelines);
+        upscale.shareBetween(pipelines);
+        encode.shareBetween(pipelines);
+    }
+};
+
+// Bounded queue of frame numbers split into per-worker deques. The producer deals out runs of blockSize frames in
+// turn; each upscale worker takes batches from the front of its own deque and, once that is empty, steals from the
+// back of the fullest other deque, so a slower card only ever holds up the batch it is working on.
+class WorkStealingQueue {
+public:
+    WorkStealingQueue(std::size_t workers, std::size_t capacity, std::size_t blockSize)
+        : queues_(std::max<std::size_t>(1, workers)), capacity_(capacity), blockSize_(std::max<std::size_t>(1, blockSize)) {}
+
+    bool push(FrameId item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        notFull_.wait(lock, [&] { return closed_ || aborted_ || size_ < capacity_; });
+        if (closed_ || aborted_) {
+            return false;
+        }
+        queues_[(pushed_++ / blockSize_) % queues_.size()].push_back(item);
+        ++size_;
+        available_.notify_all();
+        return true;
+    }
+
+    // Returns up to maxItems frame numbers for the worker, in ascending order. Waits until at least minItems are
+    // queued so every process launch has a worthwhile batch, unless the producer is done. Empty means no more work.
+    std::vector<FrameId> nextBatch(std::size_t worker, std::size_t maxItems, std::size_t minItems) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        available_.wait(lock, [&] {
+            return aborted_ || closed_ || (stalled_ && size_ > 0) || size_ >= std::min(minItems, capacity_);
+        });
+        std::vector<FrameId> batch;
+        if (aborted_ || size_ == 0) {
+            return batch;
+        }
+
+        auto* source = &queues_[worker];
+        const bool stealing = source->empty();
+        if (stealing) {
+            source = &*std::max_element(queues_.begin(), queues_.end(),
+                                        [](const auto& a, const auto& b) { return a.size() < b.size(); });
+        }
+        while (!source->empty() && batch.size() < maxItems) {
+            if (stealing) {
+                batch.push_back(source->back());
+                source->pop_back();
+            } else {
+                batch.push_back(source->front());
+                source->pop_front();
+            }
+        }
+        size_ -= batch.size();
+        notFull_.notify_all();
+        std::sort(batch.begin(), batch.end());
+        return batch;
+    }
+
+    // The producer is done; workers drain what is left, including batches smaller than minItems.
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        available_.notify_all();
+        notFull_.notify_all();
+    }
+
+    // Something failed; drop all queued work and release every waiter.
+    void abort() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        aborted_ = true;
+        available_.notify_all();
+        notFull_.notify_all();
+    }
+
+    bool aborted() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return aborted_;
+    }
+
+    // The producer is paused for a while; workers take whatever is queued instead of waiting for minItems.
+    void setStalled(bool stalled) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stalled_ = stalled;
+        available_.notify_all();
+    }
+
+private:
+    std::vector<std::deque<FrameId>> queues_;
+    std::size_t capacity_;
+    std::size_t blockSize_;
+    std::size_t size_ = 0;
+    std::size_t pushed_ = 0;
+    bool closed_ = false;
+    bool aborted_ = false;
+    bool stalled_ = false;
+    mutable std::mutex mutex_;
+    std::condition_variable available_;
+    std::condition_variable notFull_;
+};
+
+// High-water mark on the frame files held in workspaces (--disk-budget). One budget is shared by every pipeline of
+// the process, so parallel segments stay within it together; each pipeline books its files through a ScratchSpace.
+class DiskBudget {
+public:
+    explicit DiskBudget(std::uintmax_t limitBytes) : limitBytes_(limitBytes) {}
+
+    std::uintmax_t limit() const { return limitBytes_; }
+
+    // Most held at once since the last resetPeak().
+    std::uintmax_t peak() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return peak_;
+    }
+
+    void resetPeak() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        peak_ = used_;
+    }
+
+    // Leftovers are files an earlier run left behind. They count as used but not against the limit: a resumed
+    // pipeline may only reach them after many new frames, so pausing for them could stall it for the whole run.
+    void add(std::uintmax_t bytes, bool leftover = false) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        used_ += bytes;
+        leftover_ += leftover ? bytes : 0;
+        peak_ = std::max(peak_, used_);
+    }
+
+    void release(std::uintmax_t bytes, std::uintmax_t leftover = 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        used_ -= std::min(bytes, used_);
+        leftover_ -= std::min(leftover, leftover_);
+        room_.notify_all();
+    }
+
+    bool overLimit() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return used_ - std::min(leftover_, used_) > limitBytes_;
+    }
+
+    // Returns once usage is back under the limit or the timeout has passed.
+    void waitForRoom(std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        room_.wait_for(lock, timeout, [&] { return used_ - std::min(leftover_, used_) <= limitBytes_; });
+    }
+
+private:
+    std::uintmax_t limitBytes_;
+    std::uintmax_t used_ = 0;
+    std::uintmax_t leftover_ = 0;
+    std::uintmax_t peak_ = 0;
+    mutable std::mutex mutex_;
+    std::condition_variable room_;
+};
+
+// One pipeline's share of a DiskBudget. Whatever it still holds when it goes away (a failed stage leaves frames
+// behind) is handed back, so later jobs of the process are not throttled by files they will never consume.
+class ScratchSpace {
+public:
+    explicit ScratchSpace(DiskBudget& budget) : budget_(budget) {}
+    ~ScratchSpace() { budget_.release(held_, leftoverBytes_); }
+
+    ScratchSpace(const ScratchSpace&) = delete;
+    ScratchSpace& operator=(const ScratchSpace&) = delete;
+
+    void add(std::uintmax_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        held_ += bytes;
+        budget_.add(bytes);
+    }
+
+    // A file an earlier run left behind (see DiskBudget::add).
+    void addLeftover(const fs::path& frame, std::uintmax_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (leftovers_.emplace(frame, bytes).second) {
+            held_ += bytes;
+            leftoverBytes_ += bytes;
+            budget_.add(bytes, true);
+        }
+    }
+
+    // Deletes a frame the next stage has consumed and gives its space back.
+    void remove(const fs::path& frame) {
+        std::error_code ec;
+        std::uintmax_t size = fs::file_size(frame, ec);
+        if (ec || !fs::remove(frame, ec)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::uintmax_t leftover = 0;
+        if (auto it = leftovers_.find(frame); it != leftovers_.end()) {
+            size = leftover = it->second;
+            leftoverBytes_ -= leftover;
+            leftovers_.erase(it);
+        }
+        const std::uintmax_t released = std::min(size, held_);
+        held_ -= released;
+        budget_.release(released, leftover);
+    }
+
+    // A pipeline with no new frames in flight is always let through: only its own frames could drain for it, so
+    // waiting on the other pipelines' files could wait forever.
+    bool hasRoom() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return held_ == leftoverBytes_ || !budget_.overLimit();
+    }
+
+    void waitForRoom(std::chrono::milliseconds timeout) { budget_.waitForRoom(timeout); }
+
+private:
+    DiskBudget& budget_;
+    std::uintmax_t held_ = 0;
+    std::uintmax_t leftoverBytes_ = 0;
+    std::map<fs::path, std::uintmax_t> leftovers_;
+    mutable std::mutex mutex_;
+};
+
+// Frames that barely differ from the last upscaled one reuse its result instead of being upscaled (--reuse-similar).
+struct ReuseOptions {
+    bool enabled = false;
+    // Mean absolute difference of downscaled luma (0-255) up to which a frame counts as unchanged.
+    double threshold = 1.5;
+    // Consecutive frames that may reuse one result before the next is upscaled regardless, so a change too slow to
+    // cross the threshold still shows up.
+    std::size_t maxRun = 12;
+};
+
+// Tile size cap and -j thread counts for realesrgan-ncnn-vulkan on one GPU, as found by calibrateUpscaler().
+struct UpscaleTuning {
+    int maxTile = kDefaultMaxTile;
+    std::string threads = "2:2:2";
+    // Throughput on the calibration sample, kept in the profile file for reference.
+    double fps = 0.0;
+};
+
+struct UpscaleOptions {
+    // Upper bound on frames handed to one realesrgan-ncnn-vulkan process.
+    std::size_t batchFrames = 256;
+    // Smallest batch worth a process launch (model load + Vulkan init) while the decoder is still running.
+    std::size_t minBatchFrames = 32;
+    // Extracted frames allowed to wait for the upscaler before the decoder is paused.
+    std::size_t queueFrames = 512;
+    // load:proc:save thread counts forwarded to -j.
+    std::string threads = "2:2:2";
+    FrameFormat frames = frameFormats().front();
+    // Upscale each distinct frame once and re-emit it for exact repeats.
+    bool dedup = true;
+    ReuseOptions reuse;
+    // Persistent cache of upscaled frames shared between runs; disabled when empty.
+    fs::path cacheDir;
+    std::uintmax_t cacheBytes = std::uintmax_t{20} << 30;
+    // When set, each frame file is deleted as soon as the next stage has consumed it and extraction pauses while
+    // the workspaces hold more than the budget (--disk-budget).
+    std::shared_ptr<DiskBudget> diskBudget;
+    // Calibrated settings per GPU index; GPUs without an entry use the plan's tile size and threads.
+    std::map<int, UpscaleTuning> tuning;
+};
+
+const unsigned char kPngSignature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+std::uint32_t readBigEndian32(const unsigned char* bytes) {
+    return (static_cast<std::uint32_t>(bytes[0]) << 24) | (static_cast<std::uint32_t>(bytes[1]) << 16) |
+           (static_cast<std::uint32_t>(bytes[2]) << 8) | static_cast<std::uint32_t>(bytes[3]);
+}
+
+std::uint32_t readLittleEndian32(const unsigned char* bytes) {
+    return static_cast<std::uint32_t>(bytes[0]) | (static_cast<std::uint32_t>(bytes[1]) << 8) |
+           (static_cast<std::uint32_t>(bytes[2]) << 16) | (static_cast<std::uint32_t>(bytes[3]) << 24);
+}
+
+void readExactly(FILE* pipe, std::vector<unsigned char>& data, std::size_t bytes) {
+    const std::size_t offset = data.size();
+    data.resize(offset + bytes);
+    if (std::fread(data.data() + offset, 1, bytes, pipe) != bytes) {
+        throw std::runtime_error("Truncated image in the ffmpeg frame stream.");
+    }
+}
+
+// Reads one image from an image2pipe stream. PNGs are walked chunk by chunk up to IEND; BMP and WebP (RIFF) carry
+// their total size in the header. Returns false at a clean end of stream.
+bool readImageFrame(FILE* pipe, std::vector<unsigned char>& data) {
+    data.resize(sizeof(kPngSignature));
+    std::size_t got = std::fread(data.data(), 1, data.size(), pipe);
+    if (got == 0) {
+        return false;
+    }
+    if (got != data.size()) {
+        throw std::runtime_error("Truncated image in the ffmpeg frame stream.");
+    }
+
+    if (data[0] == 'B' && data[1] == 'M') {
+        const std::uint32_t size = readLittleEndian32(data.data() + 2);
+        if (size < data.size()) {
+            throw std::runtime_error("Corrupt BMP header in the ffmpeg frame stream.");
+        }
+        readExactly(pipe, data, size - data.size());
+        return true;
+    }
+    if (std::memcmp(data.data(), "RIFF", 4) == 0) {
+        // The RIFF size excludes the 8-byte header; odd-sized payloads are padded to an even length.
+        const std::uint32_t size = readLittleEndian32(data.data() + 4);
+        readExactly(pipe, data, size + (size & 1));
+        return true;
+    }
+    if (std::memcmp(data.data(), kPngSignature, sizeof(kPngSignature)) != 0) {
+        throw std::runtime_error("Unexpected data in the ffmpeg frame stream.");
+    }
+
+    while (true) {
+        const std::size_t header = data.size();
+        readExactly(pipe, data, 8);
+        const std::uint32_t length = readBigEndian32(data.data() + header);
+        const bool last = std::memcmp(data.data() + header + 4, "IEND", 4) == 0;
+        readExactly(pipe, data, std::size_t{length} + 4);  // Chunk data followed by its CRC.
+        if (last) {
+            return true;
+        }
+    }
+}
+
+void writeFile(const fs::path& path, const std::vector<unsigned char>& data) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+    if (!out) {
+        throw std::runtime_error("Failed to write " + path.string());
+    }
+}
+
+void readFile(const fs::path& path, std::vector<unsigned char>& data) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Failed to read " + path.string());
+    }
+    in.seekg(0, std::ios::end);
+    data.resize(static_cast<std::size_t>(in.tellg()));
+    in.seekg(0, std::ios::beg);
+    in.read(reinterpret_cast<char*>(data.data()), static_cast<std::streamsize>(data.size()));
+    if (!in) {
+        throw std::runtime_error("Failed to read " + path.string());
+    }
+}
+
+std::uint64_t fnv1a(std::uint64_t hash, const void* data, std::size_t size) {
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    for (std::size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Cheap identity for the input file: size, modification time and a handful of sampled 64 KiB blocks. Hashing the
+// whole file would cost a full read of multi-GB sources just to decide whether a workspace can be reused.
+std::string fingerprintInput(const fs::path& input) {
+    constexpr std::size_t kSampleBytes = 64 * 1024;
+    constexpr int kSamples = 16;
+
+    const std::uintmax_t size = fs::file_size(input);
+    const auto mtime = fs::last_write_time(input).time_since_epoch().count();
+    std::uint64_t hash = 14695981039346656037ull;
+    hash = fnv1a(hash, &size, sizeof(size));
+    hash = fnv1a(hash, &mtime, sizeof(mtime));
+
+    std::ifstream in(input, std::ios::binary);
+    std::vector<char> block(kSampleBytes);
+    for (int i = 0; i < kSamples && size > 0; ++i) {
+        const std::uintmax_t offset = size > kSampleBytes ? (size - kSampleBytes) / (kSamples - 1) * i : 0;
+        in.seekg(static_cast<std::streamoff>(offset));
+        in.read(block.data(), static_cast<std::streamsize>(block.size()));
+        hash = fnv1a(hash, block.data(), static_cast<std::size_t>(in.gcount()));
+        in.clear();
+    }
+
+    std::ostringstream text;
+    text << std::hex << std::setw(16) << std::setfill('0') << hash;
+    return text.str();
+}
+
+// A frame counts as complete when its file is as long as its own header says (BMP, WebP) or, for PNG, starts with
+// the signature and ends with the IEND chunk. This catches files a crashed writer left half-written.
+bool isCompleteImage(const fs::path& path) {
+    static const unsigned char kPngTrailer[12] = {0, 0, 0, 0, 'I', 'E', 'N', 'D', 0xae, 0x42, 0x60, 0x82};
+
+    std::ifstream in(path, std::ios::binary);
+    unsigned char head[12];
+    if (!in.read(reinterpret_cast<char*>(head), sizeof(head))) {
+        return false;
+    }
+    std::error_code ec;
+    const std::uintmax_t size = fs::file_size(path, ec);
+    if (ec) {
+        return false;
+    }
+    if (head[0] == 'B' && head[1] == 'M') {
+        return readLittleEndian32(head + 2) == size;
+    }
+    if (std::memcmp(head, "RIFF", 4) == 0 && std::memcmp(head + 8, "WEBP", 4) == 0) {
+        const std::uint32_t payload = readLittleEndian32(head + 4);
+        return std::uintmax_t{payload} + (payload & 1) + 8 == size;
+    }
+
+    unsigned char tail[12];
+    in.seekg(-static_cast<std::streamoff>(sizeof(tail)), std::ios::end);
+    if (!in.read(reinterpret_cast<char*>(tail), sizeof(tail))) {
+        return false;
+    }
+    return std::memcmp(head, kPngSignature, sizeof(kPngSignature)) == 0 &&
+           std::memcmp(tail, kPngTrailer, sizeof(tail)) == 0;
+}
+
+// Fast 64-bit hash of a whole frame. Four independent lanes keep the multiply chains apart so the loop runs close
+// to memory speed and vectorises; it only has to nominate candidates, equality is always confirmed byte by byte.
+std::uint64_t hashFrame(const unsigned char* data, std::size_t size, std::uint64_t seed = 0) {
+    constexpr std::uint64_t kPrime1 = 0x9e3779b185ebca87ull;
+    constexpr std::uint64_t kPrime2 = 0xc2b2ae3d27d4eb4full;
+    auto round = [](std::uint64_t acc, std::uint64_t word) {
+        acc += word * kPrime2;
+        acc = (acc << 31) | (acc >> 33);
+        return acc * kPrime1;
+    };
+
+    std::uint64_t lanes[4] = {seed + kPrime1 + kPrime2, seed + kPrime2, seed, seed - kPrime1};
+    std::size_t offset = 0;
+    for (; offset + 32 <= size; offset += 32) {
+        std::uint64_t words[4];
+        std::memcpy(words, data + offset, sizeof(words));
+        for (int lane = 0; lane < 4; ++lane) {
+            lanes[lane] = round(lanes[lane], words[lane]);
+        }
+    }
+    std::uint64_t hash = lanes[0] ^ ((lanes[1] << 7) | (lanes[1] >> 57)) ^ ((lanes[2] << 12) | (lanes[2] >> 52)) ^
+                         ((lanes[3] << 18) | (lanes[3] >> 46));
+    hash = fnv1a(hash ^ size, data + offset, size - offset);
+    hash ^= hash >> 33;
+    hash *= kPrime2;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+// Finds exact repeats among extracted frames so each distinct image is upscaled only once. A hash nominates the
+// earlier frame and its bytes confirm the match: the last distinct frame is kept in memory, which covers held frames
+// in animation and screen recordings, and older ones are read back from the workspace.
+class FrameDeduplicator {
+public:
+    // With recentOnly only back-to-back repeats are matched: when consumed frames are deleted, the last distinct
+    // frame is the only one whose upscaled image the encoder still has.
+    FrameDeduplicator(fs::path framesDir, std::string extension, bool recentOnly = false)
+        : framesDir_(std::move(framesDir)), extension_(std::move(extension)), recentOnly_(recentOnly) {}
+
+    // Returns the earlier frame this one repeats, or registers it as a new distinct frame.
+    std::optional<std::size_t> find(std::size_t number, const std::vector<unsigned char>& image) {
+        if (recentOnly_) {
+            if (previousNumber_ != 0 && previous_ == image) {
+                return previousNumber_;
+            }
+            previousNumber_ = number;
+            previous_ = image;
+            return std::nullopt;
+        }
+        const std::uint64_t hash = hashFrame(image.data(), image.size());
+        auto it = seen_.find(hash);
+        if (it != seen_.end() && sameAs(it->second, image)) {
+            return it->second;
+        }
+        if (it == seen_.end()) {
+            seen_.emplace(hash, static_cast<FrameId>(number));
+        }
+        previousNumber_ = number;
+        previous_ = image;
+        return std::nullopt;
+    }
+
+private:
+    bool sameAs(std::size_t number, const std::vector<unsigned char>& image) {
+        if (number == previousNumber_) {
+            return previous_ == image;
+        }
+        const fs::path path = framePath(framesDir_, number, extension_);
+        std::error_code ec;
+        if (fs::file_size(path, ec) != image.size() || ec) {
+            return false;
+        }
+        readFile(path, scratch_);
+        return scratch_ == image;
+    }
+
+    fs::path framesDir_;
+    std::string extension_;
+    bool recentOnly_;
+    std::unordered_map<std::uint64_t, FrameId> seen_;
+    std::size_t previousNumber_ = 0;
+    std::vector<unsigned char> previous_;
+    std::vector<unsigned char> scratch_;
+};
+
+// Width of the luma thumbnails frames are compared on: small enough that sensor noise and compression grain average
+// out, large enough that a moving mouth or a new slide line still moves the mean.
+constexpr int kThumbnailWidth = 64;
+
+FrameSize thumbnailSize(FrameSize frame) {
+    if (frame.width <= kThumbnailWidth) {
+        return {std::max(1, frame.width), std::max(1, frame.height)};
+    }
+    const int height = static_cast<int>(std::lround(static_cast<double>(frame.height) * kThumbnailWidth / frame.width));
+    return {kThumbnailWidth, std::max(1, height)};
+}
+
+// Box-filtered BT.601 luma of an rgb24 frame, the same reduction ffmpeg's scale=flags=area,format=gray gives the disk
+// pipeline (up to rounding, which the threshold absorbs).
+std::vector<std::uint8_t> lumaThumbnail(const RgbFrame& frame, FrameSize size) {
+    std::vector<std::uint32_t> sums(static_cast<std::size_t>(size.width) * size.height, 0);
+    std::vector<std::uint32_t> counts(sums.size(), 0);
+    for (int y = 0; y < frame.height; ++y) {
+        const std::uint8_t* row = frame.pixels.data() + static_cast<std::size_t>(y) * frame.width * 3;
+        const std::size_t cellRow = static_cast<std::size_t>(y) * size.height / frame.height * size.width;
+        for (int x = 0; x < frame.width; ++x) {
+            const std::uint32_t luma = (77u * row[x * 3] + 150u * row[x * 3 + 1] + 29u * row[x * 3 + 2]) >> 8;
+            const std::size_t cell = cellRow + static_cast<std::size_t>(x) * size.width / frame.width;
+            sums[cell] += luma;
+            ++counts[cell];
+        }
+    }
+    std::vector<std::uint8_t> thumbnail(sums.size());
+    for (std::size_t i = 0; i < sums.size(); ++i) {
+        thumbnail[i] = static_cast<std::uint8_t>(counts[i] ? (sums[i] + counts[i] / 2) / counts[i] : 0);
+    }
+    return thumbnail;
+}
+
+// Mean absolute difference between two thumbnails of equal size. Widening to int keeps the loop a plain abs-diff
+// and add, which compilers vectorise (psadbw on x86).
+double meanAbsoluteDifference(const std::vector<std::uint8_t>& a, const std::vector<std::uint8_t>& b) {
+    const std::size_t size = std::min(a.size(), b.size());
+    std::uint64_t total = 0;
+    for (std::size_t i = 0; i < size; ++i) {
+        total += static_cast<std::uint64_t>(std::abs(static_cast<int>(a[i]) - static_cast<int>(b[i])));
+    }
+    return size ? static_cast<double>(total) / size : 0.0;
+}
+
+// Decides which frames may reuse the last upscaled one. Frames are compared with that reference rather than with
+// their predecessor, so a slow pan cannot creep through the threshold one small step at a time.
+class SimilarityGate {
+public:
+    explicit SimilarityGate(ReuseOptions options) : options_(options) {}
+
+    // The reference frame number when this frame may reuse its result; otherwise the frame becomes the reference.
+    std::optional<std::size_t> check(std::size_t number, std::vector<std::uint8_t> thumbnail) {
+        if (reference_ != 0 && run_ < options_.maxRun &&
+            meanAbsoluteDifference(thumbnail, thumbnail_) <= options_.threshold) {
+            ++run_;
+            return reference_;
+        }
+        reference_ = number;
+        thumbnail_ = std::move(thumbnail);
+        run_ = 0;
+        return std::nullopt;
+    }
+
+    // Forgets the reference, so the next frame checked becomes one.
+    void reset() { reference_ = 0; }
+
+private:
+    ReuseOptions options_;
+    std::size_t reference_ = 0;
+    std::vector<std::uint8_t> thumbnail_;
+    std::size_t run_ = 0;
+};
+
+std::string toHex(std::uint64_t value) {
+    std::ostringstream text;
+    text << std::hex << std::setw(16) << std::setfill('0') << value;
+    return text.str();
+}
+
+// Upscaled frames kept across runs, addressed by the content of the extracted frame and by everything else that
+// shapes the result (the variant: model, scale, inference size, tiling and formats). Entries are copies, in both
+// directions, never hard links: a workspace frame rewritten in place (a resumed or budgeted run writing it again)
+// must not change the cached one, nor the other way round. Past the size limit the least recently used entries (by
+// modification time, refreshed on every hit) are evicted.
+class FrameCache {
+public:
+    FrameCache(const fs::path& root, const std::string& variant, std::uintmax_t limitBytes, fs::path upscaledDir,
+               std::string extension)
+        : root_(root),
+          dir_(root / toHex(fnv1a(14695981039346656037ull, variant.data(), variant.size()))),
+          limitBytes_(limitBytes),
+          upscaledDir_(std::move(upscaledDir)),
+          extension_(std::move(extension)) {
+        ensureDirectory(dir_);
+        std::ofstream(dir_ / "variant.txt", std::ios::trunc) << variant << "\n";
+        sizeBytes_ = scan().second;
+        if (sizeBytes_ > limitBytes_) {
+            evicting_ = true;
+            evict();
+        }
+    }
+
+    // Decoder side. On a hit the cached result is placed in the upscaled directory and true is returned; on a miss
+    // the frame's key is kept until store() files the freshly upscaled image under it.
+    bool fetch(std::size_t number, const std::vector<unsigned char>& image) {
+        // Two differently seeded hashes make a 128-bit key, wide enough to trust without comparing source frames.
+        const std::string key = toHex(hashFrame(image.data(), image.size())) +
+                                toHex(hashFrame(image.data(), image.size(), 0x6a09e667f3bcc909ull));
+        const fs::path entry = dir_ / (key + "." + extension_);
+        // An entry evicted between these two steps is a miss like any other.
+        if (isCompleteImage(entry) && copyReplacing(entry, framePath(upscaledDir_, number, extension_))) {
+            std::error_code ec;
+            fs::last_write_time(entry, fs::file_time_type::clock::now(), ec);
+            std::lock_guard<std::mutex> lock(mutex_);
+            hits_.insert(number);
+            return true;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_[number] = entry;
+        return false;
+    }
+
+    bool hit(std::size_t number) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return hits_.count(number) != 0;
+    }
+
+    // Upscaler side, once the frame's upscaled image is complete.
+    void store(std::size_t number) {
+        fs::path entry;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = pending_.find(number);
+            if (it == pending_.end()) {
+                return;
+            }
+            entry = it->second;
+            pending_.erase(it);
+        }
+
+        std::error_code ec;
+        if (!copyReplacing(framePath(upscaledDir_, number, extension_), entry)) {
+            return;
+        }
+        const std::uintmax_t bytes = fs::file_size(entry, ec);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++stored_;
+            sizeBytes_ += bytes;
+            // One thread evicts at a time, and without the lock, so the directory walk stalls no other frame.
+            if (sizeBytes_ <= limitBytes_ || evicting_) {
+                return;
+            }
+            evicting_ = true;
+        }
+        evict();
+    }
+
+    std::size_t hits() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return hits_.size();
+    }
+
+    std::size_t stored() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stored_;
+    }
+
+private:
+    struct Entry {
+        fs::file_time_type used;
+        std::uintmax_t bytes;
+        fs::path path;
+    };
+
+    std::pair<std::vector<Entry>, std::uintmax_t> scan() const {
+        std::vector<Entry> entries;
+        std::uintmax_t total = 0;
+        std::error_code ec;
+        for (auto it = fs::recursive_directory_iterator(root_, ec); !ec && it != fs::recursive_directory_iterator();
+             it.increment(ec)) {
+            if (!it->is_regular_file(ec) || it->path().filename() == "variant.txt") {
+                continue;
+            }
+            Entry entry{it->last_write_time(ec), it->file_size(ec), it->path()};
+            total += entry.bytes;
+            entries.push_back(std::move(entry));
+        }
+        return {std::move(entries), total};
+    }
+
+    // Copies under a temporary name and renames, so readers never see a partial file.
+    static bool copyReplacing(const fs::path& from, const fs::path& to) {
+        const fs::path temp = to.string() + ".tmp";
+        std::error_code ec;
+        fs::copy_file(from, temp, fs::copy_options::overwrite_existing, ec);
+        if (!ec) {
+            fs::rename(temp, to, ec);
+        }
+        if (ec) {
+            std::error_code ignored;
+            fs::remove(temp, ignored);
+            return false;
+        }
+        return true;
+    }
+
+    // Trims the whole cache, across variants, to 90% of the limit so eviction does not rerun on every store. Runs
+    // without the lock by the one caller that set evicting_; entries stored meanwhile are added to the result.
+    void evict() {
+        std::uintmax_t sizeBefore = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            sizeBefore = sizeBytes_;
+        }
+        auto [entries, total] = scan();
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.used < b.used; });
+        const std::uintmax_t target = limitBytes_ / 10 * 9;
+        std::error_code ec;
+        for (const auto& entry : entries) {
+            if (total <= target) {
+                break;
+            }
+            if (fs::remove(entry.path, ec)) {
+                total -= entry.bytes;
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        sizeBytes_ = total + (sizeBytes_ > sizeBefore ? sizeBytes_ - sizeBefore : 0);
+        evicting_ = false;
+    }
+
+    fs::path root_;
+    fs::path dir_;
+    std::uintmax_t limitBytes_;
+    fs::path upscaledDir_;
+    std::string extension_;
+    mutable std::mutex mutex_;
+    std::uintmax_t sizeBytes_ = 0;
+    bool evicting_ = false;
+    std::size_t stored_ = 0;
+    std::unordered_map<std::size_t, fs::path> pending_;
+    std::set<std::size_t> hits_;
+};
+
+// Describes the job a workspace belongs to (manifest.txt) and which frames have been upscaled (completed.log). The
+// log is append-only and flushed after every batch, so a crash loses at most the batches that were in flight.
+class JobManifest {
+public:
+    JobManifest(fs::path workspace, std::map<std::string, std::string> identity)
+        : workspace_(std::move(workspace)), identity_(std::move(identity)) {}
+
+    // Without resume the workspace is reset for a fresh run. With resume the manifest must describe the same input
+    // and plan, and every logged frame whose upscaled image still validates is kept.
+    void open(bool resume, const fs::path& upscaledDir, const std::string& upscaledExtension) {
+        ensureDirectory(workspace_);
+        if (resume) {
+            auto stored = readKeyValues(manifestPath());
+            if (stored.empty()) {
+                std::cout << "No resumable job found in " << workspace_ << "; starting from the beginning.\n";
+            } else {
+                for (const auto& [key, value] : identity_) {
+                    auto it = stored.find(key);
+                    if (it == stored.end() || it->second != value) {
+                        throw std::runtime_error("Cannot resume: the workspace " + workspace_.string() +
+                                                 " belongs to a different job (" + key + " differs).");
+                    }
+                }
+                values_ = stored;
+                resumed_ = true;
+                loadDuplicates();
+                loadCompleted(upscaledDir, upscaledExtension);
+                std::cout << "Resuming: " << completedCount() << " frame(s) already upscaled.\n";
+                log_.open(completedPath(), std::ios::app);
+                duplicateLog_.open(duplicatesPath(), std::ios::app);
+                return;
+            }
+        }
+
+        for (const auto& dir : {"frames_raw", "frames_upscaled", "batches"}) {
+            fs::remove_all(workspace_ / dir);
+        }
+        fs::remove(completedPath());
+        values_ = identity_;
+        save();
+        log_.open(completedPath(), std::ios::trunc);
+        duplicateLog_.open(duplicatesPath(), std::ios::trunc);
+    }
+
+    void set(const std::string& key, const std::string& value) {
+        values_[key] = value;
+        save();
+    }
+
+    std::optional<std::string> get(const std::string& key) const {
+        auto it = values_.find(key);
+        if (it == values_.end()) {
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
+    bool resumed() const { return resumed_; }
+    // Completion only covers what an earlier run finished; it is settled in open() and read without a lock.
+    bool isCompleted(std::size_t frame) const { return index_.completed(static_cast<FrameId>(frame)); }
+    std::size_t completedCount() const { return index_.completedCount(); }
+    std::vector<FrameId> completedFrames() const { return index_.completedFrames(); }
+    // First frame that still has to be produced; everything before it is already upscaled.
+    std::size_t firstPending() const { return index_.firstPending(); }
+
+    void markCompleted(const std::vector<FrameId>& frames) {
+        std::lock_guard<std::mutex> lock(logMutex_);
+        for (FrameId frame : frames) {
+            log_ << frame << "\n";
+        }
+        log_.flush();
+        if (!log_) {
+            throw std::runtime_error("Failed to update " + completedPath().string());
+        }
+    }
+
+    // Duplicates are logged before they are queued, so a completed duplicate always has its source on record.
+    void recordDuplicate(std::size_t frame, std::size_t source) {
+        std::lock_guard<std::mutex> lock(duplicateMutex_);
+        if (!index_.setDuplicate(static_cast<FrameId>(frame), static_cast<FrameId>(source))) {
+            return;
+        }
+        duplicateLog_ << frame << " " << source << "\n";
+        duplicateLog_.flush();
+        if (!duplicateLog_) {
+            throw std::runtime_error("Failed to update " + duplicatesPath().string());
+        }
+    }
+
+    std::optional<std::size_t> duplicateOf(std::size_t frame) const {
+        std::lock_guard<std::mutex> lock(duplicateMutex_);
+        if (auto source = index_.duplicateOf(static_cast<FrameId>(frame))) {
+            return *source;
+        }
+        return std::nullopt;
+    }
+
+    // Frame whose upscaled image stands for this one (see FrameIndex::sourceOf).
+    std::size_t sourceOf(std::size_t frame) const {
+        std::lock_guard<std::mutex> lock(duplicateMutex_);
+        return index_.sourceOf(static_cast<FrameId>(frame));
+    }
+
+private:
+    fs::path manifestPath() const { return workspace_ / "manifest.txt"; }
+    fs::path completedPath() const { return workspace_ / "completed.log"; }
+    fs::path duplicatesPath() const { return workspace_ / "duplicates.log"; }
+
+    static std::map<std::string, std::string> readKeyValues(const fs::path& path) {
+        std::map<std::string, std::string> values;
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line)) {
+            auto eq = line.find('=');
+            if (eq != std::string::npos) {
+                values[line.substr(0, eq)] = line.substr(eq + 1);
+            }
+        }
+        return values;
+    }
+
+    // Written to a temporary file and renamed, so the manifest is never seen half-written.
+    void save() {
+        const fs::path temp = manifestPath().string() + ".tmp";
+        {
+            std::ofstream out(temp, std::ios::trunc);
+            for (const auto& [key, value] : values_) {
+                out << key << "=" << value << "\n";
+            }
+            if (!out) {
+                throw std::runtime_error("Failed to write " + temp.string());
+            }
+        }
+        fs::rename(temp, manifestPath());
+    }
+
+    void loadDuplicates() {
+        std::ifstream in(duplicatesPath());
+        FrameId frame = 0;
+        FrameId source = 0;
+        while (in >> frame >> source) {
+            index_.setDuplicate(frame, source);
+        }
+    }
+
+    void loadCompleted(const fs::path& upscaledDir, const std::string& extension) {
+        std::ifstream in(completedPath());
+        FrameId frame = 0;
+        while (in >> frame) {
+            if (frame != 0 && !isCompleted(frame) &&
+                isCompleteImage(framePath(upscaledDir, sourceOf(frame), extension))) {
+                index_.markCompleted(frame);
+            }
+        }
+    }
+
+    fs::path workspace_;
+    std::map<std::string, std::string> identity_;
+    std::map<std::string, std::string> values_;
+    bool resumed_ = false;
+    std::mutex logMutex_;
+    std::ofstream log_;
+    // Guards the index's duplicates, which the decoder adds while the other stages read them.
+    mutable std::mutex duplicateMutex_;
+    FrameIndex index_;
+    std::ofstream duplicateLog_;
+};
+
+// Everything that, if changed, makes previously upscaled frames unusable for this run.
+std::map<std::string, std::string> jobIdentity(const fs::path& input,
+                                               const VideoMetadata& metadata,
+                                               const ScalePlan& plan,
+                                               const UpscaleOptions& options,
+                                               const HwAccel& hw) {
+    std::ostringstream planKey;
+    planKey << plan.model.name << " x" << plan.model.scale << " " << plan.inference.width << "x"
+            << plan.inference.height;
+    std::map<std::string, std::string> identity = {
+        {"input", input.string()},
+        {"input_hash", fingerprintInput(input)},
+        {"metadata", std::to_string(metadata.width) + "x" + std::to_string(metadata.height) + " " + metadata.fpsRaw +
+                         " " + std::to_string(metadata.totalFrames)},
+        {"plan", planKey.str()},
+        {"frames", options.frames.name},
+    };
+    // Precision changes the upscaled pixels slightly; the default is left out so older workspaces still resume.
+    if (plan.model.precision != Precision::Mixed) {
+        identity.emplace("precision", precisionName(plan.model.precision));
+    }
+    // GPU and CPU pre-scaling give slightly different pixels, so their extracted frames are not mixed on resume.
+    if (hw.enabled) {
+        identity.emplace("decode", "cuda");
+    }
+    // Eager deletion matches only back-to-back repeats, so its duplicate log must not meet a workspace that kept
+    // every frame.
+    if (options.diskBudget) {
+        identity.emplace("frames_kept", "until consumed");
+    }
+    // Reused frames are logged as duplicates, which a run with other reuse settings must not inherit.
+    if (options.reuse.enabled) {
+        std::ostringstream reuse;
+        reuse << options.reuse.threshold << " " << options.reuse.maxRun;
+        identity.emplace("reuse", reuse.str());
+    }
+    return identity;
+}
+
+// Workspace directory name for a job: stable across runs of the same job, so --resume finds it again, and distinct
+// for different inputs or plans, so concurrent jobs on one host never share frame files.
+fs::path jobWorkspace(const fs::path& root, const std::map<std::string, std::string>& identity) {
+    std::uint64_t hash = 14695981039346656037ull;
+    for (const auto& [key, value] : identity) {
+        hash = fnv1a(hash, key.data(), key.size());
+        hash = fnv1a(hash, value.data(), value.size());
+    }
+    std::ostringstream name;
+    name << "job-" << std::hex << std::setw(16) << std::setfill('0') << hash;
+    return root / name.str();
+}
+
+long currentProcessId() {
+#ifdef _WIN32
+    return static_cast<long>(GetCurrentProcessId());
+#else
+    return static_cast<long>(getpid());
+#endif
+}
+
+// Exclusive ownership of a job workspace: an advisory lock on its job.lock file (flock / LockFileEx), held for the
+// object's lifetime. The system drops the lock however its holder exits, so a crashed run leaves nothing to clean up,
+// and the lock file is never deleted out from under another process. The owner's process id is written into the file
+// only for the message a second run gets. Not every network filesystem forwards these locks, so a workspace root
+// shared between machines needs one subdirectory per host.
+class WorkspaceLock {
+public:
+    explicit WorkspaceLock(const fs::path& workspace) : path_(workspace / "job.lock") {
+        ensureDirectory(workspace);
+        const std::string pid = std::to_string(currentProcessId()) + "\n";
+#ifdef _WIN32
+        handle_ = CreateFileW(path_.wstring().c_str(), GENERIC_READ | GENERIC_WRITE,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (handle_ == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Could not open " + path_.string() + ".");
+        }
+        // The locked byte lies past the process id, so a second run can still read who holds the workspace.
+        OVERLAPPED range{};
+        range.OffsetHigh = 1;
+        if (!LockFileEx(handle_, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &range)) {
+            release();
+            throw inUse(workspace);
+        }
+        DWORD written = 0;
+        SetFilePointer(handle_, 0, nullptr, FILE_BEGIN);
+        SetEndOfFile(handle_);
+        WriteFile(handle_, pid.data(), static_cast<DWORD>(pid.size()), &written, nullptr);
+#else
+        // Close-on-exec, so the lock is not kept alive by the ffmpeg and upscaler processes the job starts.
+        fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            throw std::runtime_error("Could not open " + path_.string() + ": " + std::strerror(errno));
+        }
+        if (::flock(fd_, LOCK_EX | LOCK_NB) != 0) {
+            const int error = errno;
+            release();
+            if (error == EWOULDBLOCK) {
+                throw inUse(workspace);
+            }
+            throw std::runtime_error("Could not lock workspace " + workspace.string() + ": " + std::strerror(error));
+        }
+        if (::ftruncate(fd_, 0) == 0) {
+            ssize_t written = ::pwrite(fd_, pid.data(), pid.size(), 0);
+            (void)written;
+        }
+#endif
+    }
+
+    ~WorkspaceLock() { release(); }
+
+    WorkspaceLock(const WorkspaceLock&) = delete;
+    WorkspaceLock& operator=(const WorkspaceLock&) = delete;
+
+    // Gives up the workspace early; closing the file drops the lock.
+    void release() {
+#ifdef _WIN32
+        if (handle_ != INVALID_HANDLE_VALUE) {
+            CloseHandle(handle_);
+            handle_ = INVALID_HANDLE_VALUE;
+        }
+#else
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+#endif
+    }
+
+private:
+    std::runtime_error inUse(const fs::path& workspace) const {
+        long owner = 0;
+        std::ifstream(path_) >> owner;
+        return std::runtime_error("Workspace " + workspace.string() + " is in use by " +
+                                  (owner > 0 ? "process " + std::to_string(owner) : std::string("another process")) +
+                                  ".");
+    }
+
+    fs::path path_;
+#ifdef _WIN32
+    HANDLE handle_ = INVALID_HANDLE_VALUE;
+#else
+    int fd_ = -1;
+#endif
+};
+
+// Frames of this run that the decoder gave a source instead of queueing them for inference.
+struct ExtractionCounts {
+    std::size_t repeated = 0;
+    std::size_t reused = 0;
+};
+
+// Decode stage: ffmpeg streams PNG frames over a pipe and they are written to outputDir here, so the decoder is
+// paused (by not reading its pipe) whenever the upscaler falls behind by more than the queue capacity. On resume,
+// frames before the first pending one are dropped inside ffmpeg, and already upscaled or intact extracted frames are
+// not written again. With a scratch budget the decoder also pauses while the workspaces hold more than it allows.
+// With reuse a second ffmpeg decodes the same frames as small grey thumbnails, read in step with the images, and a
+// frame close enough to the last upscaled one is recorded as its duplicate.
+void extractFrames(const fs::path& ffmpeg,
+                   const fs::path& input,
+                   const fs::path& outputDir,
+                   const fs::path& logFile,
+                   const VideoMetadata& metadata,
+                   const ScalePlan& plan,
+                   const HwAccel& hw,
+                   const FrameFormat& format,
+                   bool dedup,
+                   const ReuseOptions& reuse,
+                   ExtractionCounts& counts,
+                   FrameCache* cache,
+                   ScratchSpace* scratch,
+                   const fs::path& upscaledDir,
+                   JobManifest& manifest,
+                   WorkStealingQueue& extracted,
+                   FrameTotal& total,
+                   StageMeter& meter) {
+    ensureDirectory(outputDir);
+    const std::size_t firstFrame = manifest.firstPending();
+
+    std::vector<std::string> filters;
+    if (firstFrame > 1) {
+        filters.push_back("select=gte(n\\," + std::to_string(firstFrame - 1) + ")");
+    }
+    if (plan.preScale()) {
+        filters.push_back(buildPreScaleFilter(plan, hw));
+    }
+
+    std::vector<std::string> args = {ffmpeg.string(), "-v", "error"};
+    const auto decodeArgs = buildDecodeArgs(hw, plan.preScale());
+    args.insert(args.end(), decodeArgs.begin(), decodeArgs.end());
+    const auto seekArgs = buildSeekArgs(metadata);
+    args.insert(args.end(), seekArgs.begin(), seekArgs.end());
+    args.insert(args.end(), {"-i", input.string(), "-map", "0:v:0", "-vsync", "0"});
+    if (metadata.frameLimit > 0) {
+        // Counted after the resume select, so only the frames still pending in this segment.
+        const long long pending = metadata.frameLimit - static_cast<long long>(firstFrame - 1);
+        args.insert(args.end(), {"-frames:v", std::to_string(std::max(0LL, pending))});
+    }
+    if (!filters.empty()) {
+        std::string chain;
+        for (const auto& filter : filters) {
+            chain += (chain.empty() ? "" : ",") + filter;
+        }
+        args.insert(args.end(), {"-vf", chain});
+    }
+    args.insert(args.end(), {"-f", "image2pipe", "-c:v", format.rawEncoder});
+    args.insert(args.end(), format.rawEncoderOptions.begin(), format.rawEncoderOptions.end());
+    args.push_back("pipe:1");
+
+    std::optional<FrameDeduplicator> deduplicator;
+    if (dedup) {
+        deduplicator.emplace(outputDir, format.rawExtension, scratch != nullptr);
+    }
+
+    // The thumbnails need no pre-scale or GPU decode; they are scaled straight from the source.
+    const FrameSize thumbnail = thumbnailSize(plan.inference);
+    const std::size_t thumbnailBytes = static_cast<std::size_t>(thumbnail.width) * thumbnail.height;
+    std::optional<Process> lumaProbe;
+    std::optional<SimilarityGate> gate;
+    const fs::path lumaLog = logFile.parent_path() / "luma.log";
+    if (reuse.enabled) {
+        std::vector<std::string> lumaArgs = {ffmpeg.string(), "-v", "error"};
+        lumaArgs.insert(lumaArgs.end(), seekArgs.begin(), seekArgs.end());
+        lumaArgs.insert(lumaArgs.end(), {"-i", input.string(), "-map", "0:v:0", "-vsync", "0"});
+        if (metadata.frameLimit > 0) {
+            const long long pending = metadata.frameLimit - static_cast<long long>(firstFrame - 1);
+            lumaArgs.insert(lumaArgs.end(), {"-frames:v", std::to_string(std::max(0LL, pending))});
+        }
+        std::string chain = firstFrame > 1 ? filters.front() + "," : "";
+        chain += "scale=" + std::to_string(thumbnail.width) + ":" + std::to_string(thumbnail.height) +
+                 ":flags=area,format=gray";
+        lumaArgs.insert(lumaArgs.end(), {"-vf", chain, "-f", "rawvideo", "-pix_fmt", "gray", "pipe:1"});
+        lumaProbe.emplace(lumaArgs, pipeOptions(false, lumaLog));
+        gate.emplace(reuse);
+    }
+
+    Process decoder(args, pipeOptions(false, logFile));
+    std::vector<unsigned char> image;
+    std::vector<std::uint8_t> luma(thumbnailBytes);
+    std::size_t number = firstFrame - 1;
+    {
+        while (readImageFrame(decoder.output(), image)) {
+            ++number;
+            total.observe(number);
+            if (lumaProbe && std::fread(luma.data(), 1, luma.size(), lumaProbe->output()) != luma.size()) {
+                throw std::runtime_error("The luma thumbnails ended before frame " + std::to_string(number) + ":\n" +
+                                         readLog(lumaLog));
+            }
+            if (manifest.isCompleted(number)) {
+                // A frame after the completed run must not reuse a reference from before it, which a budgeted run
+                // may already have encoded and deleted.
+                if (gate) {
+                    gate->reset();
+                }
+                continue;
+            }
+            // The upscalers take whatever is queued meanwhile, so the frames already on disk can drain.
+            if (scratch && !scratch->hasRoom()) {
+                extracted.setStalled(true);
+                while (!scratch->hasRoom() && !extracted.aborted()) {
+                    scratch->waitForRoom(std::chrono::milliseconds(250));
+                }
+                extracted.setStalled(false);
+            }
+            // A repeat is queued like any other frame but never written; its upscaled image is the source's.
+            std::optional<std::size_t> source = manifest.duplicateOf(number);
+            if (!source && deduplicator) {
+                source = deduplicator->find(number, image);
+                if (source) {
+                    manifest.recordDuplicate(number, *source);
+                }
+            }
+            if (!source && gate) {
+                source = gate->check(number, luma);
+                if (source) {
+                    manifest.recordDuplicate(number, *source);
+                    ++counts.reused;
+                }
+            } else if (source) {
+                // Duplicates an interrupted run logged are counted here whatever found them.
+                ++counts.repeated;
+            }
+            const fs::path frame = framePath(outputDir, number, format.rawExtension);
+            const bool cached = !source && cache && cache->fetch(number, image);
+            if (!source && !cached && (!manifest.resumed() || !isCompleteImage(frame))) {
+                writeFile(frame, image);
+                meter.addBytes(image.size());
+                if (scratch) {
+                    scratch->add(image.size());
+                }
+            } else if (cached && scratch) {
+                std::error_code ec;
+                scratch->add(fs::file_size(framePath(upscaledDir, number, format.upscaled), ec));
+            }
+            meter.add();
+            if (!extracted.push(number)) {
+                break;
+            }
+        }
+    }
+
+    int exitCode = decoder.wait();
+    if (exitCode != 0) {
+        throw std::runtime_error("Failed to extract frames:\n" + readLog(logFile));
+    }
+    if (lumaProbe && lumaProbe->wait() != 0) {
+        throw std::runtime_error("Failed to decode luma thumbnails:\n" + readLog(lumaLog));
+    }
+    if (number == 0) {
+        throw std::runtime_error("No frames found to upscale.");
+    }
+    total.settle(number);
+}
+
+std::vector<std::string> buildRealesrganArgs(const fs::path& realesrgan,
+                                             const fs::path& inputDir,
+                                             const fs::path& outputDir,
+                                             const ScalePlan& plan,
+                                             const std::string& upscaledExtension,
+                                             int gpuIndex,
+                                             int tileSize,
+                                             const std::string& threads) {
+    std::vector<std::string> args = {realesrgan.string(), "-i", inputDir.string(), "-o", outputDir.string(),
+                                     "-n", plan.model.name, "-s", std::to_string(plan.model.scale),
+                                     "-g", std::to_string(gpuIndex), "-j", threads, "-f", upscaledExtension};
+    if (!plan.model.dir.empty()) {
+        args.insert(args.end(), {"-m", plan.model.dir.string()});
+    }
+    if (tileSize > 0) {
+        args.insert(args.end(), {"-t", std::to_string(tileSize)});
+    }
+    return args;
+}
+
+// Runs one realesrgan-ncnn-vulkan process over a directory of frames on the given Vulkan device, counting upscaled
+// frames on the meter as they appear in outputDir so progress stays per-frame while the work is batched.
+void upscaleBatch(const fs::path& realesrgan,
+                  const fs::path& batchDir,
+                  const fs::path& outputDir,
+                  const std::vector<FrameId>& batch,
+                  const ScalePlan& plan,
+                  const UpscaleOptions& options,
+                  int gpuIndex,
+                  StageMeter& meter) {
+    int tileSize = plan.tileSize;
+    std::string threads = options.threads;
+    if (auto tuned = options.tuning.find(gpuIndex); tuned != options.tuning.end()) {
+        tileSize = balancedTileSize(plan.inference, tuned->second.maxTile);
+        threads = tuned->second.threads;
+    }
+    Process process(buildRealesrganArgs(realesrgan, batchDir, outputDir, plan, options.frames.upscaled, gpuIndex,
+                                        tileSize, threads));
+    std::size_t seen = 0;
+    // The process reports nothing per frame, so the time since the last poll that found new frames is shared among
+    // them; the first frames also carry the model load.
+    auto lastAppeared = std::chrono::steady_clock::now();
+    auto countAppeared = [&] {
+        const std::size_t before = seen;
+        while (seen < batch.size() && fs::exists(framePath(outputDir, batch[seen], options.frames.upscaled))) {
+            ++seen;
+            meter.add();
+        }
+        if (seen > before) {
+            const auto now = std::chrono::steady_clock::now();
+            const double each = std::chrono::duration<double>(now - lastAppeared).count() / (seen - before);
+            for (std::size_t i = before; i < seen; ++i) {
+                meter.recordLatency(each);
+            }
+            lastAppeared = now;
+        }
+    };
+    while (!process.finished()) {
+        countAppeared();
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    }
+
+    if (process.wait() != 0) {
+        throw std::runtime_error("Real-ESRGAN failed on batch " + batchDir.string() + " (GPU " +
+                                 std::to_string(gpuIndex) + "):\n" + process.capturedOutput());
+    }
+    countAppeared();
+    if (seen < batch.size()) {
+        throw std::runtime_error("Real-ESRGAN did not write " +
+                                 framePath(outputDir, batch[seen], options.frames.upscaled).string());
+    }
+    // Sizes are only final once the process has exited.
+    for (std::size_t number : batch) {
+        meter.addBytes(fs::file_size(framePath(outputDir, number, options.frames.upscaled)));
+    }
+}
+
+// Calibration results keyed by GPU model, VRAM and upscaling model, kept in a small text file (one tab-separated line
+// per entry) so later runs start with the measured settings straight away.
+class TuningProfiles {
+public:
+    explicit TuningProfiles(fs::path path) : path_(std::move(path)) {
+        std::ifstream in(path_);
+        std::string line;
+        while (std::getline(in, line)) {
+            std::vector<std::string> fields;
+            std::istringstream columns(line);
+            std::string field;
+            while (std::getline(columns, field, '\t')) {
+                fields.push_back(field);
+            }
+            if (line.empty() || line.front() == '#' || fields.size() != 6) {
+                continue;
+            }
+            UpscaleTuning tuning;
+            try {
+                tuning.maxTile = std::stoi(fields[3]);
+                tuning.fps = std::stod(fields[5]);
+            } catch (const std::exception&) {
+                continue;
+            }
+            tuning.threads = fields[4];
+            entries_[fields[0] + "\t" + fields[1] + "\t" + fields[2]] = tuning;
+        }
+    }
+
+    const fs::path& path() const { return path_; }
+
+    std::optional<UpscaleTuning> find(const GpuInfo& gpu, const std::string& model) const {
+        auto it = entries_.find(key(gpu, model));
+        if (it == entries_.end()) {
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
+    // Saved right away, through a temporary file, so a concurrent reader never sees half of it.
+    void store(const GpuInfo& gpu, const std::string& model, const UpscaleTuning& tuning) {
+        entries_[key(gpu, model)] = tuning;
+        if (!path_.parent_path().empty()) {
+            ensureDirectory(path_.parent_path());
+        }
+        const fs::path temp = path_.string() + ".tmp";
+        {
+            std::ofstream out(temp, std::ios::trunc);
+            out << "# gpu\tmemory_mib\tmodel\tmax_tile\tthreads\tfps\n";
+            for (const auto& [entry, value] : entries_) {
+                out << entry << "\t" << value.maxTile << "\t" << value.threads << "\t" << std::fixed
+                    << std::setprecision(2) << value.fps << "\n";
+            }
+            if (!out) {
+                throw std::runtime_error("Failed to write " + temp.string());
+            }
+        }
+        fs::rename(temp, path_);
+    }
+
+private:
+    static std::string key(const GpuInfo& gpu, const std::string& model) {
+        return gpu.name + "\t" + std::to_string(gpu.memoryMiB) + "\t" + model;
+    }
+
+    fs::path path_;
+    std::map<std::string, UpscaleTuning> entries_;
+};
+
+// Per-user location of the profile file: %APPDATA%\icecale on Windows, $XDG_CONFIG_HOME/icecale (or ~/.config)
+// elsewhere.
+fs::path defaultProfileFile() {
+#ifdef _WIN32
+    const char* appData = std::getenv("APPDATA");
+    fs::path base = appData ? fs::path(appData) : fs::current_path();
+#else
+    const char* configHome = std::getenv("XDG_CONFIG_HOME");
+    const char* homeEnv = std::getenv("HOME");
+    fs::path base = configHome && *configHome ? fs::path(configHome)
+                                              : (homeEnv ? fs::path(homeEnv) : fs::current_path()) / ".config";
+#endif
+    return base / "icecale" / "gpu-profiles.txt";
+}
+
+// Largest tile worth trying on a card. Activation memory grows with the tile area, and about 384 MiB per 128x128
+// block is a conservative estimate that leaves room for the model and the frames in flight.
+int tileLimitForMemory(long long memoryMiB) {
+    if (memoryMiB <= 0) {
+        return 512;
+    }
+    const int blocks = static_cast<int>(std::sqrt(static_cast<double>(memoryMiB) / 384.0));
+    return 128 * std::clamp(blocks, 1, 8);
+}
+
+// Decodes a few frames from about a third into the input (past most intros) at the inference size into sampleDir,
+// named like extracted frames. Returns how many were written.
+std::size_t extractCalibrationSample(const fs::path& ffmpeg,
+                                     const fs::path& input,
+                                     const VideoMetadata& metadata,
+                                     const ScalePlan& plan,
+                                     const FrameFormat& format,
+                                     const fs::path& sampleDir,
+                                     const fs::path& logFile,
+                                     std::size_t frames) {
+    fs::remove_all(sampleDir);
+    ensureDirectory(sampleDir);
+    std::vector<std::string> args = {ffmpeg.string(), "-v", "error"};
+    if (metadata.duration > 10.0) {
+        std::ostringstream seek;
+        seek << std::fixed << std::setprecision(3) << metadata.duration / 3.0;
+        args.insert(args.end(), {"-ss", seek.str()});
+    }
+    args.insert(args.end(),
+                {"-i", input.string(), "-map", "0:v:0", "-vsync", "0", "-frames:v", std::to_string(frames)});
+    if (plan.preScale()) {
+        args.insert(args.end(), {"-vf", buildPreScaleFilter(plan, HwAccel{})});
+    }
+    args.insert(args.end(), {"-f", "image2pipe", "-c:v", format.rawEncoder});
+    args.insert(args.end(), format.rawEncoderOptions.begin(), format.rawEncoderOptions.end());
+    args.push_back("pipe:1");
+
+    Process decoder(args, pipeOptions(false, logFile));
+    std::vector<unsigned char> image;
+    std::size_t written = 0;
+    while (written < frames && readImageFrame(decoder.output(), image)) {
+        writeFile(framePath(sampleDir, ++written, format.rawExtension), image);
+    }
+    if (decoder.wait() != 0 || written == 0) {
+        throw std::runtime_error("Failed to decode frames for calibration:\n" + readLog(logFile));
+    }
+    return written;
+}
+
+// Times realesrgan-ncnn-vulkan on the sample for each candidate tile (up to what the card's VRAM is likely to hold)
+// with the default threads, then for a few thread splits with the fastest tile. Settings that fail, typically by
+// running out of VRAM, are skipped. Every timing includes the model load, which costs the same for all candidates.
+UpscaleTuning calibrateUpscaler(const fs::path& realesrgan,
+                                const fs::path& sampleDir,
+                                const fs::path& outputDir,
+                                std::size_t frames,
+                                const ScalePlan& plan,
+                                const UpscaleOptions& options,
+                                const GpuInfo& gpu) {
+    auto measure = [&](int maxTile, const std::string& threads) -> std::optional<double> {
+        fs::remove_all(outputDir);
+        ensureDirectory(outputDir);
+        const auto start = std::chrono::steady_clock::now();
+        Process process(buildRealesrganArgs(realesrgan, sampleDir, outputDir, plan, options.frames.upscaled, gpu.index,
+                                            balancedTileSize(plan.inference, maxTile), threads));
+        const int exitCode = process.wait();
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "  tile " << balancedTileSize(plan.inference, maxTile) << ", -j " << threads << ": ";
+        for (std::size_t number = 1; number <= frames; ++number) {
+            if (exitCode != 0 || !isCompleteImage(framePath(outputDir, number, options.frames.upscaled))) {
+                std::cout << "failed\n";
+                return std::nullopt;
+            }
+        }
+        const double fps = frames / std::max(seconds, 1e-3);
+        std::cout << std::fixed << std::setprecision(2) << fps << " fps\n";
+        return fps;
+    };
+
+    UpscaleTuning best;
+    best.threads = options.threads;
+    std::set<int> tried;
+    for (int maxTile : {128, 200, 256, 384, 512, 768, 1024}) {
+        if (maxTile > tileLimitForMemory(gpu.memoryMiB) ||
+            !tried.insert(balancedTileSize(plan.inference, maxTile)).second) {
+            continue;
+        }
+        if (auto fps = measure(maxTile, options.threads); fps && *fps > best.fps) {
+            best.maxTile = maxTile;
+            best.fps = *fps;
+        }
+    }
+    if (best.fps == 0.0) {
+        throw std::runtime_error("realesrgan-ncnn-vulkan failed on every calibration setting on GPU " +
+                                 std::to_string(gpu.index) + ".");
+    }
+    for (const std::string threads : {"1:2:2", "2:4:2", "4:4:4"}) {
+        if (threads == best.threads) {
+            continue;
+        }
+        if (auto fps = measure(best.maxTile, threads); fps && *fps > best.fps) {
+            best.threads = threads;
+            best.fps = *fps;
+        }
+    }
+    fs::remove_all(outputDir);
+    return best;
+}
+
+// Fills options.tuning for the GPUs of this job: from the profile file when it has an entry for the GPU model and
+// upscaling model, otherwise by calibrating once per distinct GPU model and storing the result for later runs.
+void tuneUpscaler(const fs::path& ffmpeg,
+                  const fs::path& realesrgan,
+                  const fs::path& input,
+                  const VideoMetadata& metadata,
+                  const ScalePlan& plan,
+                  const std::vector<GpuInfo>& gpus,
+                  const fs::path& profileFile,
+                  bool recalibrate,
+                  const fs::path& scratchDir,
+                  UpscaleOptions& options) {
+    // Enough frames that the model load does not swamp the per-frame differences.
+    constexpr std::size_t kSampleFrames = 8;
+    options.tuning.clear();
+    TuningProfiles profiles(profileFile);
+    // GPU models measured by this call; with several cards of one model only the first is calibrated.
+    std::set<std::pair<std::string, long long>> calibrated;
+    std::size_t sampleFrames = 0;
+    for (const auto& gpu : gpus) {
+        std::optional<UpscaleTuning> tuning;
+        if (!recalibrate || calibrated.count({gpu.name, gpu.memoryMiB}) > 0) {
+            tuning = profiles.find(gpu, plan.model.files);
+        }
+        if (!tuning) {
+            if (sampleFrames == 0) {
+                ensureDirectory(scratchDir);
+                sampleFrames = extractCalibrationSample(ffmpeg, input, metadata, plan, options.frames,
+                                                        scratchDir / "sample", scratchDir / "sample.log",
+                                                        kSampleFrames);
+            }
+            std::cout << "Calibrating Real-ESRGAN on GPU " << gpu.index << " (" << gpu.name << ") with "
+                      << sampleFrames << " frame(s)...\n";
+            tuning = calibrateUpscaler(realesrgan, scratchDir / "sample", scratchDir / "upscaled", sampleFrames, plan,
+                                       options, gpu);
+            calibrated.insert({gpu.name, gpu.memoryMiB});
+            profiles.store(gpu, plan.model.files, *tuning);
+        }
+        options.tuning[gpu.index] = *tuning;
+        std::cout << "Upscaler settings for GPU " << gpu.index << ": tile "
+                  << balancedTileSize(plan.inference, tuning->maxTile) << ", -j " << tuning->threads << "\n";
+    }
+    if (sampleFrames > 0) {
+        fs::remove_all(scratchDir);
+        std::cout << "Saved calibration to " << profiles.path() << "\n";
+    }
+}
+
+// Upscale stage for one GPU: takes batches of extracted frames and hands finished frame numbers to the encoder.
+void upscaleFrames(const fs::path& realesrgan,
+                   const fs::path& inputDir,
+                   const fs::path& outputDir,
+                   const fs::path& batchRoot,
+                   const ScalePlan& plan,
+                   const UpscaleOptions& options,
+                   std::size_t worker,
+                   int gpuIndex,
+                   std::size_t maxBatch,
+                   FrameCache* cache,
+                   ScratchSpace* scratch,
+                   JobManifest& manifest,
+                   WorkStealingQueue& extracted,
+                   ReorderRing<std::size_t>& upscaled,
+                   StageMeter& meter) {
+    ensureDirectory(outputDir);
+    std::size_t batchNumber = 0;
+    while (true) {
+        auto batch = extracted.nextBatch(worker, maxBatch, options.minBatchFrames);
+        if (batch.empty()) {
+            return;
+        }
+
+        std::vector<FrameId> distinct;
+        for (FrameId number : batch) {
+            if (!manifest.duplicateOf(number) && !(cache && cache->hit(number))) {
+                distinct.push_back(number);
+            }
+        }
+        meter.add(batch.size() - distinct.size());
+
+        // Realesrgan-ncnn-vulkan only takes a file or a directory, so each batch is materialised as a directory of
+        // hard links into inputDir (falling back to copies on filesystems without link support).
+        if (!distinct.empty()) {
+            const fs::path batchDir =
+                batchRoot / ("gpu" + std::to_string(gpuIndex) + "_batch_" + std::to_string(batchNumber++));
+            fs::remove_all(batchDir);
+            ensureDirectory(batchDir);
+            for (std::size_t number : distinct) {
+                linkOrCopy(framePath(inputDir, number, options.frames.rawExtension),
+                           framePath(batchDir, number, options.frames.rawExtension));
+            }
+            upscaleBatch(realesrgan, batchDir, outputDir, distinct, plan, options, gpuIndex, meter);
+            fs::remove_all(batchDir);
+            if (scratch) {
+                for (std::size_t number : distinct) {
+                    scratch->add(fs::file_size(framePath(outputDir, number, options.frames.upscaled)));
+                    scratch->remove(framePath(inputDir, number, options.frames.rawExtension));
+                }
+            }
+            if (cache) {
+                for (std::size_t number : distinct) {
+                    cache->store(number);
+                }
+            }
+        }
+        manifest.markCompleted(batch);
+
+        for (std::size_t number : batch) {
+            if (!upscaled.put(number - 1, number)) {
+                return;
+            }
+        }
+    }
+}
+
+// Encode stage: feeds upscaled frames to ffmpeg over stdin strictly in frame order as soon as each one is ready.
+// With a scratch budget each file is deleted once it has been read.
+void assembleVideo(const fs::path& framesDir,
+                   const FrameFormat& format,
+                   const JobManifest& manifest,
+                   ScratchSpace* scratch,
+                   const Passthrough& passthrough,
+                   const fs::path& outputFile,
+                   const fs::path& logFile,
+                   const std::string& fpsRaw,
+                   const ScalePlan& plan,
+                   const HwAccel& hw,
+                   const EncoderProfile& encoding,
+                   const fs::path& ffmpeg,
+                   ReorderRing<std::size_t>& upscaled,
+                   StageMeter& meter) {
+    std::vector<std::string> args = {ffmpeg.string(), "-y", "-v", "error", "-f", "image2pipe", "-c:v", format.upscaled,
+                                     "-framerate", fpsRaw.empty() ? "30" : fpsRaw, "-i", "pipe:0"};
+    const auto sourceArgs = buildSourceInputArgs(passthrough);
+    args.insert(args.end(), sourceArgs.begin(), sourceArgs.end());
+    args.insert(args.end(), {"-map", "0:v:0"});
+    const auto passthroughArgs = buildPassthroughArgs(passthrough, 1);
+    args.insert(args.end(), passthroughArgs.begin(), passthroughArgs.end());
+
+    const auto encodeArgs = buildEncodeArgs(
+        plan, hw, encoding, {plan.inference.width * plan.model.scale, plan.inference.height * plan.model.scale}, false);
+    args.insert(args.end(), encodeArgs.begin(), encodeArgs.end());
+
+    args.insert(args.end(), kProgressArgs.begin(), kProgressArgs.end());
+    args.push_back(outputFile.string());
+
+    Process encoder(args, pipeOptions(true, logFile, &meter));
+    std::vector<unsigned char> image;
+    std::size_t loaded = 0;
+    bool writeFailed = false;
+    {
+        while (auto number = upscaled.take()) {
+            // Repeats re-emit their source's image, which is usually the one just written.
+            const std::size_t source = manifest.sourceOf(*number);
+            if (source != loaded) {
+                const fs::path frame = framePath(framesDir, source, format.upscaled);
+                readFile(frame, image);
+                loaded = source;
+                if (scratch) {
+                    scratch->remove(frame);
+                }
+            }
+            if (std::fwrite(image.data(), 1, image.size(), encoder.input()) != image.size()) {
+                writeFailed = true;
+                break;
+            }
+            meter.add();
+        }
+    }
+
+    int exitCode = encoder.wait();
+    if (exitCode != 0 || writeFailed) {
+        throw std::runtime_error("Failed to assemble video:\n" + readLog(logFile));
+    }
+}
+
+struct DiskPipelinePaths {
+    fs::path framesDir;
+    fs::path upscaledDir;
+    fs::path batchRoot;
+    fs::path logDir;
+};
+
+// Frames a resumed run left behind count against the disk budget until they are consumed like new ones. Files that
+// nothing would consume or that would be written again (raw frames already upscaled, partial images, upscaled
+// frames the log does not vouch for) are deleted first, so every booked byte is released exactly once.
+void bookLeftoverFrames(ScratchSpace& scratch,
+                        const DiskPipelinePaths& paths,
+                        const JobManifest& manifest,
+                        const FrameFormat& format) {
+    // Upscaled images of the sources completed frames resolve to.
+    std::vector<bool> keep;
+    for (FrameId number : manifest.completedFrames()) {
+        const std::size_t source = manifest.sourceOf(number);
+        keep.resize(std::max(keep.size(), source + 1), false);
+        keep[source] = true;
+    }
+    auto book = [&](const fs::path& dir, const std::function<bool(const fs::path&)>& wanted) {
+        std::error_code ec;
+        for (auto it = fs::directory_iterator(dir, ec); !ec && it != fs::directory_iterator(); it.increment(ec)) {
+            const fs::path file = it->path();
+            std::error_code fileError;
+            if (!wanted(file)) {
+                fs::remove(file, fileError);
+            } else if (const std::uintmax_t size = fs::file_size(file, fileError); !fileError) {
+                scratch.addLeftover(file, size);
+            }
+        }
+    };
+    book(paths.framesDir, [&](const fs::path& file) {
+        const auto number = parseFrameNumber(file);
+        return number && !manifest.isCompleted(*number) && isCompleteImage(file);
+    });
+    book(paths.upscaledDir, [&](const fs::path& file) {
+        const auto number = parseFrameNumber(file);
+        return number && *number < keep.size() && keep[*number] &&
+               file == framePath(paths.upscaledDir, *number, format.upscaled);
+    });
+}
+
+// Runs decode, upscale (one worker per GPU) and encode concurrently with bounded queues between them, so wall-clock
+// time approaches that of the slowest stage instead of the sum of all three.
+void runDiskPipeline(const fs::path& ffmpeg,
+                     const fs::path& realesrgan,
+                     const fs::path& input,
+                     const Passthrough& passthrough,
+                     const fs::path& outputFile,
+                     const DiskPipelinePaths& paths,
+                     const VideoMetadata& metadata,
+                     const ScalePlan& plan,
+                     const std::vector<int>& gpus,
+                     const UpscaleOptions& options,
+                     const HwAccel& hw,
+                     const EncoderProfile& encoding,
+                     JobManifest& manifest,
+                     JobMetrics& metrics,
+                     PipelineMeters* sharedMeters = nullptr) {
+#ifndef _WIN32
+    // A dying encoder must surface as a write error, not kill the whole process.
+    std::signal(SIGPIPE, SIG_IGN);
+#endif
+    ensureDirectory(paths.logDir);
+
+    const std::size_t workers = std::max<std::size_t>(1, gpus.size());
+    // Several batches per GPU fit in the queue, so an idle GPU always has something left to steal.
+    const std::size_t maxBatch = std::max<std::size_t>(
+        1, std::min(options.batchFrames, std::max(options.minBatchFrames, options.queueFrames / (workers * 4))));
+    WorkStealingQueue extracted(workers, options.queueFrames, maxBatch);
+    // In-flight batches can finish out of order; the ring must hold all of them so no worker waits on another.
+    ReorderRing<std::size_t> upscaled(options.queueFrames + workers * maxBatch);
+
+    std::optional<FrameCache> cache;
+    if (!options.cacheDir.empty()) {
+        std::ostringstream variant;
+        variant << plan.model.name << " x" << plan.model.scale << " " << plan.inference.width << "x"
+                << plan.inference.height << " tile " << plan.tileSize << " " << options.frames.name;
+        if (plan.model.precision != Precision::Mixed) {
+            variant << " " << precisionName(plan.model.precision);
+        }
+        cache.emplace(options.cacheDir, variant.str(), options.cacheBytes, paths.upscaledDir, options.frames.upscaled);
+    }
+
+    std::optional<ScratchSpace> scratch;
+    if (options.diskBudget) {
+        scratch.emplace(*options.diskBudget);
+        bookLeftoverFrames(*scratch, paths, manifest, options.frames);
+    }
+
+    PipelineMeters ownMeters;
+    PipelineMeters& meters = sharedMeters ? *sharedMeters : ownMeters;
+    StageMeter& decodeMeter = meters.decode;
+    StageMeter& upscaleMeter = meters.upscale;
+    StageMeter& encodeMeter = meters.encode;
+    FrameTotal total(metadata.totalFrames);
+    ExtractionCounts counts;
+    FirstError firstError;
+    auto fail = [&](std::exception_ptr error) {
+        firstError.record(error);
+        extracted.abort();
+        upscaled.close();
+    };
+
+    std::vector<std::function<void()>> bodies;
+    bodies.emplace_back([&] {
+        try {
+            extractFrames(ffmpeg, input, paths.framesDir, paths.logDir / "decode.log", metadata, plan, hw,
+                          options.frames, options.dedup, options.reuse, counts, cache ? &*cache : nullptr,
+                          scratch ? &*scratch : nullptr, paths.upscaledDir, manifest, extracted, total, decodeMeter);
+            extracted.close();
+        } catch (...) {
+            fail(std::current_exception());
+        }
+        decodeMeter.finish();
+    });
+
+    // The ring ends once the upscalers and the feeder of completed frames below have all put their last frame.
+    const bool resumedFrames = manifest.completedCount() > 0;
+    std::atomic<std::size_t> producersLeft{workers + (resumedFrames ? 1 : 0)};
+    auto producerDone = [&] {
+        if (--producersLeft == 0) {
+            upscaled.finish();
+        }
+    };
+
+    // Frames finished by an earlier run go straight to the encoder, in order, alongside the newly upscaled ones.
+    if (resumedFrames) {
+        bodies.emplace_back([&] {
+            for (FrameId number : manifest.completedFrames()) {
+                if (!upscaled.put(number - 1, number)) {
+                    break;
+                }
+            }
+            producerDone();
+        });
+    }
+
+    std::atomic<std::size_t> upscalersLeft{workers};
+    for (std::size_t worker = 0; worker < workers; ++worker) {
+        const int gpuIndex = gpus.empty() ? 0 : gpus[worker];
+        bodies.emplace_back([&, worker, gpuIndex] {
+            try {
+                upscaleFrames(realesrgan, paths.framesDir, paths.upscaledDir, paths.batchRoot, plan, options, worker,
+                              gpuIndex, maxBatch, cache ? &*cache : nullptr, scratch ? &*scratch : nullptr, manifest,
+                              extracted, upscaled, upscaleMeter);
+            } catch (...) {
+                fail(std::current_exception());
+            }
+            if (--upscalersLeft == 0) {
+                upscaleMeter.finish();
+            }
+            producerDone();
+        });
+    }
+
+    bodies.emplace_back([&] {
+        try {
+            assembleVideo(paths.upscaledDir, options.frames, manifest, scratch ? &*scratch : nullptr, passthrough,
+                          outputFile, paths.logDir / "encode.log", metadata.fpsRaw, plan, hw, encoding,
+                          ffmpeg, upscaled, encodeMeter);
+        } catch (...) {
+            fail(std::current_exception());
+        }
+        encodeMeter.finish();
+    });
+
+    runStages(std::move(bodies), meters.all(), total, !sharedMeters, &meters.canceled,
+              [&] { fail(std::make_exception_ptr(std::runtime_error("The job was canceled."))); });
+    metrics.addStages(meters.all());
+    metrics.repeatedFrames = counts.repeated;
+    metrics.reusedFrames = counts.reused;
+    metrics.cacheHits = cache ? cache->hits() : 0;
+    firstError.rethrowIfAny();
+    if (sharedMeters) {
+        return;
+    }
+    printInferenceSkipped(metrics, upscaleMeter.frames());
+    if (cache) {
+        std::cout << "Frame cache: " << cache->hits() << " hit(s), " << cache->stored() << " frame(s) added.\n";
+    }
+}
+
+// Used when the scale plan skips inference: the source only needs the 1440p cap and an NVENC re-encode.
+void transcodeWithoutUpscale(const fs::path& ffmpeg,
+                             const fs::path& input,
+                             const Passthrough& passthrough,
+                             const fs::path& outputFile,
+                             const fs::path& logFile,
+                             long long totalFrames,
+                             const ScalePlan& plan,
+                             const HwAccel& hw,
+                             const EncoderProfile& encoding,
+                             JobMetrics& metrics) {
+    // With --hwaccel and a known output size the frames never leave the GPU between NVDEC and NVENC.
+    const bool deviceFrames = hw.enabled && plan.output.width > 0;
+    std::vector<std::string> args = {ffmpeg.string(), "-y", "-v", "error"};
+    const auto decodeArgs = buildDecodeArgs(hw, deviceFrames);
+    args.insert(args.end(), decodeArgs.begin(), decodeArgs.end());
+    args.insert(args.end(), {"-i", input.string(), "-map", "0:v:0"});
+    // The source is already the only input, so the other streams come along from the same read.
+    const auto passthroughArgs = buildPassthroughArgs(passthrough, 0);
+    args.insert(args.end(), passthroughArgs.begin(), passthroughArgs.end());
+
+    const auto encodeArgs = buildEncodeArgs(plan, hw, encoding, plan.source, deviceFrames);
+    args.insert(args.end(), encodeArgs.begin(), encodeArgs.end());
+
+    args.insert(args.end(), kProgressArgs.begin(), kProgressArgs.end());
+    args.push_back(outputFile.string());
+
+    auto progress = std::make_shared<FfmpegProgress>();
+    ProcessOptions options;
+    options.out = StreamMode::Capture;
+    options.keepBytes = 4096;
+    options.onLine = [progress](std::string_view line) { progress->parse(line); };
+    options.err = StreamMode::File;
+    options.errFile = logFile;
+
+    const std::size_t total = totalFrames > 0 ? static_cast<std::size_t>(totalFrames) : 0;
+    StageMeter meter("transcode");
+    Process transcoder(args, options);
+    while (!transcoder.finished()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        printProgress("Transcoding", progress->frames(), std::max(total, progress->frames()), progress->fps(),
+                      progress->speed());
+    }
+    const int exitCode = transcoder.wait();
+    printProgress("Transcoding", progress->frames(), std::max(total, progress->frames()), progress->fps(),
+                  progress->speed());
+    std::cout << "\n";
+    meter.add(progress->frames());
+    meter.finish();
+    metrics.addStages({&meter});
+    if (exitCode != 0) {
+        throw std::runtime_error("Failed to transcode video:\n" + readLog(logFile));
+    }
+}
+
+// A rectangle of a frame, in pixels.
+struct FrameRect {
+    int x{};
+    int y{};
+    int width{};
+    int height{};
+};
+
+// Context the in-process engine reads around every tile. A change this close to a cell can alter the cell's upscaled
+// pixels, so cells are compared over their area grown by this margin.
+constexpr int kChangedTileMargin = 10;
+// Per-channel difference still treated as unchanged, which absorbs the flicker lossy codecs leave in static areas.
+constexpr int kChangedTileTolerance = 2;
+
+// Splits frames into a grid and finds the cells that changed since they were last upscaled (--changed-tiles). Cells
+// are compared with the pixels they were last upscaled from rather than with the previous frame, so a slow fade cannot
+// slip under the tolerance one step at a time.
+class TileChangeDetector {
+public:
+    TileChangeDetector(FrameSize frame, int tileSize)
+        : frame_(frame),
+          tileSize_(tileSize),
+          columns_((frame.width + tileSize - 1) / tileSize),
+          rows_((frame.height + tileSize - 1) / tileSize) {}
+
+    std::size_t cellCount() const { return static_cast<std::size_t>(columns_) * rows_; }
+
+    // Regions of frame to upscale, as runs of changed cells along each grid row, and the number of changed cells.
+    // The first frame, and any frame where most cells changed, comes back as one region covering the whole frame,
+    // because one pass over it costs less than many small ones.
+    std::vector<FrameRect> changedRegions(const RgbFrame& frame, std::size_t& changedCells) {
+        if (reference_.empty()) {
+            reference_ = frame.pixels;
+            changedCells = cellCount();
+            return {{0, 0, frame_.width, frame_.height}};
+        }
+        std::vector<bool> changed(cellCount());
+        changedCells = 0;
+        for (int row = 0; row < rows_; ++row) {
+            for (int column = 0; column < columns_; ++column) {
+                if (cellChanged(frame, cell(column, row))) {
+                    changed[static_cast<std::size_t>(row) * columns_ + column] = true;
+                    ++changedCells;
+                }
+            }
+        }
+        if (changedCells * 2 > cellCount()) {
+            reference_ = frame.pixels;
+            return {{0, 0, frame_.width, frame_.height}};
+        }
+
+        std::vector<FrameRect> regions;
+        for (int row = 0; row < rows_; ++row) {
+            for (int column = 0; column < columns_;) {
+                if (!changed[static_cast<std::size_t>(row) * columns_ + column]) {
+                    ++column;
+                    continue;
+                }
+                FrameRect region = cell(column, row);
+                while (++column < columns_ && changed[static_cast<std::size_t>(row) * columns_ + column]) {
+                    region.width += cell(column, row).width;
+                }
+                adopt(frame, region);
+                regions.push_back(region);
+            }
+        }
+        return regions;
+    }
+
+private:
+    FrameRect cell(int column, int row) const {
+        const int x = column * tileSize_;
+        const int y = row * tileSize_;
+        return {x, y, std::min(tileSize_, frame_.width - x), std::min(tileSize_, frame_.height - y)};
+    }
+
+    bool cellChanged(const RgbFrame& frame, const FrameRect& cell) const {
+        const int left = std::max(0, cell.x - kChangedTileMargin);
+        const int top = std::max(0, cell.y - kChangedTileMargin);
+        const int right = std::min(frame_.width, cell.x + cell.width + kChangedTileMargin);
+        const int bottom = std::min(frame_.height, cell.y + cell.height + kChangedTileMargin);
+        const std::size_t stride = static_cast<std::size_t>(frame_.width) * 3;
+        for (int y = top; y < bottom; ++y) {
+            const std::uint8_t* current = frame.pixels.data() + y * stride + static_cast<std::size_t>(left) * 3;
+            const std::uint8_t* reference = reference_.data() + y * stride + static_cast<std::size_t>(left) * 3;
+            int difference = 0;
+            for (std::size_t i = 0; i < static_cast<std::size_t>(right - left) * 3; ++i) {
+                difference = std::max(difference, std::abs(static_cast<int>(current[i]) - reference[i]));
+            }
+            if (difference > kChangedTileTolerance) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The region is about to be upscaled from frame's pixels, which become its new reference.
+    void adopt(const RgbFrame& frame, const FrameRect& region) {
+        const std::size_t stride = static_cast<std::size_t>(frame_.width) * 3;
+        for (int y = region.y; y < region.y + region.height; ++y) {
+            const std::size_t offset = y * stride + static_cast<std::size_t>(region.x) * 3;
+            std::copy_n(frame.pixels.begin() + offset, static_cast<std::size_t>(region.width) * 3,
+                        reference_.begin() + offset);
+        }
+    }
+
+    FrameSize frame_;
+    int tileSize_;
+    int columns_;
+    int rows_;
+    std::vector<std::uint8_t> reference_;
+};
+
+struct SequencedFrame {
+    std::size_t sequence{};
+    FramePool::Handle frame;
+    // Identical to the previous frame; carries no pixels and is not upscaled again.
+    bool repeat = false;
+    // With --changed-tiles, the parts of the frame that need upscaling; the rest keeps the previous output. Empty for
+    // a whole frame.
+    std::vector<FrameRect> regions;
+};
+
+// Upscaled pixels placed at (x, y) of the output frame, over whatever the previous frame left there. Whole frames
+// come from the output pool; changed-tile patches are small and allocated as they are made.
+struct UpscaledPatch {
+    int x{};
+    int y{};
+    FramePool::Handle pixels;
+};
+
+// Grid cell size --changed-tiles uses unless --changed-tile-size says otherwise.
+constexpr int kDefaultChangedTileSize = 64;
+
+struct StreamOptions {
+    // Frames that may sit in each of the decode->upscale and upscale->encode rings.
+    std::size_t ringFrames = 8;
+    // Re-emit the previous upscaled frame when a decoded frame repeats it exactly.
+    bool dedup = true;
+    ReuseOptions reuse;
+    // Grid cell size in inference pixels for upscaling only the parts of a frame that changed; 0 upscales whole frames.
+    int changedTileSize = 0;
+};
+
+// Copies patch into frame, an rgb24 image of the given width.
+void pastePatch(const UpscaledPatch& patch, int width, std::vector<std::uint8_t>& frame) {
+    const std::size_t stride = static_cast<std::size_t>(width) * 3;
+    const std::size_t rowBytes = static_cast<std::size_t>(patch.pixels->width) * 3;
+    for (int row = 0; row < patch.pixels->height; ++row) {
+        std::copy_n(patch.pixels->pixels.begin() + row * rowBytes, rowBytes,
+                    frame.begin() + (patch.y + row) * stride + static_cast<std::size_t>(patch.x) * 3);
+    }
+}
+
+// Decodes the input to raw rgb24 on a pipe, runs every frame through the resident upscalers and feeds the result to a
+// second ffmpeg reading rawvideo from stdin, so no intermediate images touch the disk. With one upscaler per GPU,
+// each takes the next decoded frame as soon as it is free and the encoder receives them back in decode order. With
+// changed tiles the upscalers return only the changed regions, and the encoder, which sees frames in order, pastes
+// them over the frame it wrote last; that keeps the lanes independent of each other. Decoded and upscaled frames live
+// in two pools allocated up front, sized for what the rings and stages can hold at once.
+void streamVideo(const fs::path& ffmpeg,
+                 const fs::path& input,
+                 const Passthrough& passthrough,
+                 const fs::path& outputFile,
+                 const fs::path& logDir,
+                 const VideoMetadata& metadata,
+                 const ScalePlan& plan,
+                 const std::vector<FrameUpscaler*>& upscalers,
+                 const StreamOptions& options,
+                 const HwAccel& hw,
+                 const EncoderProfile& encoding,
+                 JobMetrics& metrics,
+                 PipelineMeters* sharedMeters = nullptr) {
+    if (plan.inference.width <= 0 || plan.inference.height <= 0) {
+        throw std::runtime_error("Streaming mode needs the input resolution, but ffprobe did not report it.");
+    }
+#ifndef _WIN32
+    // A dying encoder must surface as a write error, not kill the whole process.
+    std::signal(SIGPIPE, SIG_IGN);
+#endif
+    ensureDirectory(logDir);
+    const fs::path decodeLog = logDir / "decode.log";
+    const fs::path encodeLog = logDir / "encode.log";
+
+    const int inWidth = plan.inference.width;
+    const int inHeight = plan.inference.height;
+    const int outWidth = inWidth * plan.model.scale;
+    const int outHeight = inHeight * plan.model.scale;
+    const std::size_t inBytes = static_cast<std::size_t>(inWidth) * inHeight * 3;
+    const std::size_t outBytes = static_cast<std::size_t>(outWidth) * outHeight * 3;
+
+    std::vector<std::string> decodeArgs = {ffmpeg.string(), "-v", "error"};
+    const auto hwDecodeArgs = buildDecodeArgs(hw, plan.preScale());
+    decodeArgs.insert(decodeArgs.end(), hwDecodeArgs.begin(), hwDecodeArgs.end());
+    const auto seekArgs = buildSeekArgs(metadata);
+    decodeArgs.insert(decodeArgs.end(), seekArgs.begin(), seekArgs.end());
+    decodeArgs.insert(decodeArgs.end(), {"-i", input.string(), "-map", "0:v:0", "-vsync", "0"});
+    if (metadata.frameLimit > 0) {
+        decodeArgs.insert(decodeArgs.end(), {"-frames:v", std::to_string(metadata.frameLimit)});
+    }
+    if (plan.preScale()) {
+        decodeArgs.insert(decodeArgs.end(), {"-vf", buildPreScaleFilter(plan, hw)});
+    }
+    decodeArgs.insert(decodeArgs.end(), {"-f", "rawvideo", "-pix_fmt", "rgb24", "pipe:1"});
+
+    std::vector<std::string> encodeArgs = {ffmpeg.string(), "-y", "-v", "error", "-f", "rawvideo", "-pix_fmt", "rgb24",
+                                           "-s", std::to_string(outWidth) + "x" + std::to_string(outHeight),
+                                           "-framerate", metadata.fpsRaw.empty() ? "30" : metadata.fpsRaw,
+                                           "-i", "pipe:0"};
+    const auto sourceArgs = buildSourceInputArgs(passthrough);
+    encodeArgs.insert(encodeArgs.end(), sourceArgs.begin(), sourceArgs.end());
+    encodeArgs.insert(encodeArgs.end(), {"-map", "0:v:0"});
+    const auto passthroughArgs = buildPassthroughArgs(passthrough, 1);
+    encodeArgs.insert(encodeArgs.end(), passthroughArgs.begin(), passthroughArgs.end());
+    const auto videoArgs = buildEncodeArgs(plan, hw, encoding, {outWidth, outHeight}, false);
+    encodeArgs.insert(encodeArgs.end(), videoArgs.begin(), videoArgs.end());
+    encodeArgs.insert(encodeArgs.end(), kProgressArgs.begin(), kProgressArgs.end());
+    encodeArgs.push_back(outputFile.string());
+
+    // Input frames: the ring, one per upscaler, and the decoder's current frame plus the one it compares with.
+    // Output frames: the reorder ring, one per upscaler, and the encoder's last frame plus the one replacing it.
+    FramePool inputPool(options.ringFrames + upscalers.size() + 2, inWidth, inHeight);
+    FramePool outputPool(options.ringFrames + 2 * upscalers.size() + 2, outWidth, outHeight);
+    metrics.framePoolBytes = inputPool.bytes() + outputPool.bytes();
+    if (!sharedMeters) {
+        std::cout << "Frame pool: " << inputPool.count() << " decoded and " << outputPool.count()
+                  << " upscaled frames (" << formatBytes(metrics.framePoolBytes) << "), "
+                  << (inputPool.pinned() && outputPool.pinned() ? "locked in memory"
+                                                                : "not locked in memory (memlock limit too low)")
+                  << ".\n";
+    }
+
+    BoundedQueue<SequencedFrame> decoded(options.ringFrames);
+    ReorderRing<std::vector<UpscaledPatch>> upscaled(options.ringFrames + upscalers.size());
+    PipelineMeters ownMeters;
+    PipelineMeters& meters = sharedMeters ? *sharedMeters : ownMeters;
+    StageMeter& decodeMeter = meters.decode;
+    StageMeter& upscaleMeter = meters.upscale;
+    StageMeter& encodeMeter = meters.encode;
+    FrameTotal total(metadata.totalFrames);
+    std::size_t repeats = 0;
+    std::size_t reused = 0;
+    std::size_t decodedFrames = 0;
+    std::size_t tilesChecked = 0;
+    std::size_t tilesUpscaled = 0;
+    FirstError firstError;
+    auto fail = [&](std::exception_ptr error) {
+        firstError.record(error);
+        decoded.close();
+        upscaled.close();
+        inputPool.close();
+        outputPool.close();
+    };
+
+    std::vector<std::function<void()>> bodies;
+    bodies.emplace_back([&] {
+        try {
+            Process decoder(decodeArgs, pipeOptions(false, decodeLog));
+            bool truncated = false;
+            FramePool::Handle previous;
+            std::optional<SimilarityGate> gate;
+            if (options.reuse.enabled) {
+                gate.emplace(options.reuse);
+            }
+            std::optional<TileChangeDetector> tiles;
+            if (options.changedTileSize > 0) {
+                tiles.emplace(plan.inference, options.changedTileSize);
+            }
+            for (std::size_t sequence = 0;; ++sequence) {
+                SequencedFrame item{sequence, inputPool.acquire(), false, {}};
+                if (!item.frame) {
+                    break;
+                }
+                std::size_t got = std::fread(item.frame->pixels.data(), 1, inBytes, decoder.output());
+                if (got != inBytes) {
+                    truncated = got != 0;
+                    break;
+                }
+                if (options.dedup) {
+                    // The frame compared with stays shared with the upscaler that works on it rather than copied.
+                    if (previous && item.frame->pixels == previous->pixels) {
+                        item.repeat = true;
+                        item.frame.reset();
+                        ++repeats;
+                    } else {
+                        previous = item.frame;
+                    }
+                }
+                // Repeats are of the previous frame, which is the gate's reference or reused it.
+                if (gate && !item.repeat &&
+                    gate->check(sequence + 1, lumaThumbnail(*item.frame, thumbnailSize(plan.inference)))) {
+                    item.repeat = true;
+                    item.frame.reset();
+                    ++reused;
+                }
+                if (tiles && !item.repeat) {
+                    std::size_t changed = 0;
+                    item.regions = tiles->changedRegions(*item.frame, changed);
+                    tilesChecked += tiles->cellCount();
+                    tilesUpscaled += changed;
+                    // Nothing moved beyond the tolerance: the previous output stands as it is.
+                    if (item.regions.empty()) {
+                        item.repeat = true;
+                        item.frame.reset();
+                    } else if (item.regions.size() == 1 && item.regions.front().width == inWidth &&
+                               item.regions.front().height == inHeight) {
+                        // A whole frame is upscaled into the output pool like one without --changed-tiles.
+                        item.regions.clear();
+                    }
+                }
+                decodeMeter.add();
+                ++decodedFrames;
+                total.observe(sequence + 1);
+                if (!decoded.push(std::move(item))) {
+                    break;
+                }
+            }
+            int exitCode = decoder.wait();
+            if (exitCode != 0 || truncated) {
+                throw std::runtime_error("Failed to decode frames:\n" + readLog(decodeLog));
+            }
+            total.settle(decodedFrames);
+            decoded.close();
+        } catch (...) {
+            fail(std::current_exception());
+        }
+        decodeMeter.finish();
+    });
+
+    std::atomic<std::size_t> upscalersLeft{upscalers.size()};
+    for (const auto& upscaler : upscalers) {
+        bodies.emplace_back([&, engine = upscaler] {
+            try {
+                while (auto item = decoded.pop()) {
+                    // No patches tell the encoder to repeat the frame it wrote last.
+                    std::vector<UpscaledPatch> result;
+                    if (!item->repeat) {
+                        const auto started = std::chrono::steady_clock::now();
+                        if (item->regions.empty()) {
+                            FramePool::Handle output = outputPool.acquire();
+                            if (!output) {
+                                break;
+                            }
+                            engine->upscale(*item->frame, *output);
+                            result.push_back({0, 0, std::move(output)});
+                        }
+                        for (const FrameRect& region : item->regions) {
+                            auto patch = std::make_shared<RgbFrame>();
+                            engine->upscaleRegion(*item->frame, region.x, region.y, region.width, region.height,
+                                                  *patch);
+                            result.push_back({region.x * plan.model.scale, region.y * plan.model.scale,
+                                              std::move(patch)});
+                        }
+                        // Release the decoded frame now rather than once the result is handed on.
+                        item->frame.reset();
+                        upscaleMeter.recordLatency(
+                            std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+                    }
+                    upscaleMeter.add();
+                    if (!upscaled.put(item->sequence, std::move(result))) {
+                        break;
+                    }
+                }
+            } catch (...) {
+                fail(std::current_exception());
+            }
+            if (--upscalersLeft == 0) {
+                upscaleMeter.finish();
+                upscaled.finish();
+            }
+        });
+    }
+
+    bodies.emplace_back([&] {
+        try {
+            Process encoder(encodeArgs, pipeOptions(true, encodeLog, &encodeMeter));
+            bool writeFailed = false;
+            FramePool::Handle last;
+            while (auto patches = upscaled.take()) {
+                for (auto& patch : *patches) {
+                    if (patch.pixels->width == outWidth && patch.pixels->height == outHeight) {
+                        last = std::move(patch.pixels);
+                    } else if (last) {
+                        pastePatch(patch, outWidth, last->pixels);
+                    }
+                }
+                if (!last || last->pixels.size() != outBytes ||
+                    std::fwrite(last->pixels.data(), 1, outBytes, encoder.input()) != outBytes) {
+                    writeFailed = true;
+                    break;
+                }
+                encodeMeter.add();
+            }
+            int exitCode = encoder.wait();
+            if (exitCode != 0 || writeFailed) {
+                throw std::runtime_error("Failed to encode video:\n" + readLog(encodeLog));
+            }
+        } catch (...) {
+            fail(std::current_exception());
+        }
+        encodeMeter.finish();
+    });
+
+    runStages(std::move(bodies), meters.all(), total, !sharedMeters, &meters.canceled,
+              [&] { fail(std::make_exception_ptr(std::runtime_error("The job was canceled."))); });
+    metrics.addStages(meters.all());
+    metrics.repeatedFrames = repeats;
+    metrics.reusedFrames = reused;
+    metrics.tilesChecked = tilesChecked;
+    metrics.tilesUpscaled = tilesUpscaled;
+    firstError.rethrowIfAny();
+    if (!sharedMeters) {
+        printInferenceSkipped(metrics, upscaleMeter.frames());
+    }
+}
+
+// Loads one in-process engine per GPU so the streaming stage can shard frames across all of them. Returns an empty
+// list when this build has no engine or the model cannot be loaded, which selects the external fallback.
+std::vector<std::unique_ptr<FrameUpscaler>> createResidentUpscalers(const fs::path& execDir,
+                                                                    const ScalePlan& plan,
+                                                                    const std::vector<int>& gpus) {
+    std::vector<std::unique_ptr<FrameUpscaler>> upscalers;
+#ifdef ICECALE_WITH_NCNN
+    auto model = plan.model.dir.empty() ? findModel(execDir, plan.model.files)
+                                        : findModel(plan.model.dir, plan.model.files);
+    if (!model) {
+        std::cout << "Model files " << plan.model.files << ".param/.bin not found; using the external upscaler.\n";
+        return upscalers;
+    }
+    for (int gpu : gpus) {
+        try {
+            upscalers.push_back(icecale::createNcnnUpscaler(
+                {model->param, model->bin, plan.model.scale, plan.model.precision}, gpu, plan.tileSize));
+        } catch (const std::exception& ex) {
+            std::cout << "In-process upscaler unavailable on GPU " << gpu << " (" << ex.what() << ").\n";
+        }
+    }
+    if (upscalers.empty()) {
+        std::cout << "No GPU could load the in-process upscaler; using the external upscaler.\n";
+    } else {
+        std::cout << "Loaded " << plan.model.files << " in-process on " << upscalers.size() << " GPU(s) from "
+                  << model->param.parent_path() << "\n";
+    }
+#else
+    (void)execDir;
+    (void)plan;
+    (void)gpus;
+#endif
+    return upscalers;
+}
+
+struct UpscaleJob {
+    fs::path input;
+    fs::path output;
+};
+
+// Port used by --coordinator and --worker when none is given.
+constexpr int kDefaultPort = 7439;
+// Port of the --serve job API when none is given.
+constexpr int kDefaultServePort = 7440;
+// A coordinator splits into this many segments unless --segments says otherwise, so workers that join late or run
+// slower still get a share.
+constexpr std::size_t kDefaultRemoteSegments = 16;
+
+struct UpscaleConfig {
+    std::vector<UpscaleJob> jobs;
+    fs::path workspaceRoot;
+    fs::path execDir;
+    fs::path ffmpeg;
+    fs::path ffprobe;
+    fs::path realesrgan;
+    fs::path metricsJson;
+    UpscaleOptions upscale;
+    StreamOptions stream;
+    std::vector<int> requestedGpus;
+    std::vector<int> gpus;
+    std::vector<GpuInfo> detectedGpus;
+    // Calibrated realesrgan-ncnn-vulkan settings per GPU model are read from and saved to profileFile.
+    fs::path profileFile;
+    bool calibrate = true;
+    bool recalibrate = false;
+    HwAccel hwaccel;
+    // Keyframe segments processed in parallel and joined without re-encoding; 1 keeps a single pass.
+    std::size_t segments = 1;
+    // --coordinator hands segments to remote workers on this port; --worker connects to workerHost:workerPort.
+    int coordinatorPort = 0;
+    std::string workerHost;
+    int workerPort = kDefaultPort;
+    // Shared secret a worker must present. Without one the coordinator only listens on loopback.
+    std::string token;
+    // --serve takes jobs over HTTP on this port; outputs of submitted jobs default to outputDir.
+    int servePort = 0;
+    fs::path outputDir;
+    // Other jobs run in this process at the same time (--serve on several GPUs).
+    bool concurrentJobs = false;
+    // A --worker's current segment: the coordinator's scale plan, used instead of one made from this worker's model
+    // settings, so all segments of a job come out alike.
+    std::optional<ScalePlan> assignedPlan;
+    // Candidates for the scale planner, from --preset or --model, at the preset's or --precision's precision.
+    std::vector<UpscaleModel> models;
+    EncoderProfile encoder = findEncoderProfile("balanced");
+    bool streaming = false;
+    bool forceExternal = false;
+    bool resume = false;
+    bool keepWorkspace = false;
+};
+
+void printUsage(std::ostream& out) {
+    out << "Usage: icecale [options] [input_video|pattern]...\n"
+           "\n"
+           "Without inputs the path of a single video is read from stdin.\n"
+           "\n"
+           "Options:\n"
+           "  -o, --output FILE        Output file (only with a single input)\n"
+           "  --output-dir DIR         Directory for <name>_upscaled.mp4 outputs (default: Downloads)\n"
+           "  --jobs FILE              Read inputs from FILE, one per line: input[<TAB>output]\n"
+           "  --workspace-root DIR     Parent directory of the per-job workspaces\n"
+           "  --keep-workspace         Keep the workspace after a successful job\n"
+           "  --resume                 Continue an interrupted job from its workspace\n"
+           "  --gpus LIST              Comma-separated GPU indices to use (default: all)\n"
+           "  --gpu-profiles FILE      Calibrated tile and thread settings per GPU model (default: per-user file)\n"
+           "  --recalibrate            Measure the upscaler settings again instead of using the saved profile\n"
+           "  --no-calibrate           Use the default tile size and threads without measuring\n"
+           "  --preset NAME            Models and precision: preview (fastest), standard (default) or max\n"
+           "  --model NAME[:SCALE]     Upscale with this model, or with NAME.param/.bin from the model folders\n"
+           "  --precision NAME         In-process engine precision: fp32, mixed (default), fp16 or int8\n"
+           "  --frame-format NAME      Intermediate frames: png (default), png-fast, bmp or webp\n"
+           "  --no-dedup               Upscale repeated frames again instead of reusing the first result\n"
+           "  --reuse-similar          Reuse the last upscaled frame for frames that barely differ from it\n"
+           "  --reuse-threshold D      Mean luma difference (0-255) still counted as unchanged (default: 1.5)\n"
+           "  --reuse-max-run N        Frames in a row that may reuse one result (default: 12)\n"
+           "  --changed-tiles          In streaming mode, upscale only the parts of a frame that changed\n"
+           "  --changed-tile-size PX   Grid cell size for --changed-tiles (default: 64)\n"
+           "  --cache-dir DIR          Reuse upscaled frames across runs from a cache in DIR\n"
+           "  --cache-size GIB         Cache size limit before old entries are evicted (default: 20)\n"
+           "  --disk-budget GIB        Delete frames once consumed and pause extraction above GIB of scratch\n"
+           "  --metrics-json FILE      Write per-job timings and throughput to FILE as JSON\n"
+           "  --encoder-profile NAME   NVENC tuning: fast, balanced (default) or archive\n"
+           "  --codec NAME             Output codec: h264 (default), hevc or av1\n"
+           "  --ten-bit                Encode 10-bit video (hevc or av1)\n"
+           "  --segments N             Split at keyframes into N segments processed in parallel (one per GPU)\n"
+           "  --coordinator [PORT]     Hand segments to --worker nodes instead of upscaling here (port 7439)\n"
+           "  --worker HOST[:PORT]     Upscale segments handed out by the coordinator at HOST\n"
+           "  --token SECRET           Shared secret of a coordinator and its workers; without it the coordinator\n"
+           "                           only takes workers on this machine (the link is not encrypted)\n"
+           "  --serve [PORT]           Keep running and take jobs over a local HTTP API (port 7440)\n"
+           "  --hwaccel                Decode with NVDEC and resize on the GPU (scale_cuda / scale_npp)\n"
+           "  --stream                 Require the in-memory streaming pipeline\n"
+           "  --external               Always use the external realesrgan-ncnn-vulkan binary\n"
+           "  -h, --help               Show this help\n";
+}
+
+// '*' matches any run of characters and '?' a single one.
+bool matchesWildcard(std::string_view name, std::string_view pattern) {
+    std::size_t n = 0;
+    std::size_t p = 0;
+    std::size_t starP = std::string_view::npos;
+    std::size_t starN = 0;
+    while (n < name.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+            ++n;
+            ++p;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            starP = p++;
+            starN = n;
+        } else if (starP != std::string_view::npos) {
+            p = starP + 1;
+            n = ++starN;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+        ++p;
+    }
+    return p == pattern.size();
+}
+
+// Expands wildcards in the file name part of a pattern, for shells (and job files) that leave them unexpanded.
+// Plain paths are returned unchanged so a missing file is reported by the job itself.
+std::vector<fs::path> expandInputPattern(const std::string& pattern) {
+    const fs::path path = fs::absolute(fs::path(pattern)).lexically_normal();
+    const std::string namePattern = path.filename().string();
+    if (namePattern.find_first_of("*?") == std::string::npos) {
+        return {path};
+    }
+
+    std::vector<fs::path> matches;
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(path.parent_path(), ec)) {
+        if (entry.is_regular_file() && matchesWildcard(entry.path().filename().string(), namePattern)) {
+            matches.push_back(entry.path());
+        }
+    }
+    if (matches.empty()) {
+        throw std::runtime_error("No files match " + pattern);
+    }
+    std::sort(matches.begin(), matches.end());
+    return matches;
+}
+
+fs::path defaultOutputPath(const fs::path& outputDir, const fs::path& input) {
+    fs::path outputName = input.stem();
+    if (outputName.empty()) {
+        outputName = "upscaled_video";
+    }
+    outputName += "_upscaled.mp4";
+    return outputDir / outputName;
+}
+
+std::string trim(const std::string& value) {
+    const auto first = value.find_first_not_of(" \t\r\n");
+    if (first == std::string::npos) {
+        return {};
+    }
+    return value.substr(first, value.find_last_not_of(" \t\r\n") - first + 1);
+}
+
+// Job files list one input (or wildcard pattern) per line, optionally followed by a tab and an explicit output path.
+// Blank lines and lines starting with '#' are ignored; relative paths are taken relative to the job file.
+void readJobFile(const fs::path& jobFile, const fs::path& outputDir, std::vector<UpscaleJob>& jobs) {
+    std::ifstream in(jobFile);
+    if (!in) {
+        throw std::runtime_error("Cannot read job file: " + jobFile.string());
+    }
+    const fs::path base = fs::absolute(jobFile).parent_path();
+    std::string line;
+    while (std::getline(in, line)) {
+        line = trim(line);
+        if (line.empty() || line.front() == '#') {
+            continue;
+        }
+        std::string inputField = line;
+        std::string outputField;
+        if (auto tab = line.find('\t'); tab != std::string::npos) {
+            inputField = trim(line.substr(0, tab));
+            outputField = trim(line.substr(tab + 1));
+        }
+        const fs::path inputPath = fs::path(inputField).is_absolute() ? fs::path(inputField) : base / inputField;
+        const auto inputs = expandInputPattern(inputPath.string());
+        if (!outputField.empty() && inputs.size() != 1) {
+            throw std::runtime_error("An explicit output needs a single input in " + jobFile.string() + ": " + line);
+        }
+        for (const auto& input : inputs) {
+            fs::path output = defaultOutputPath(outputDir, input);
+            if (!outputField.empty()) {
+                const fs::path outputPath(outputField);
+                output = (outputPath.is_absolute() ? outputPath : base / outputPath).lexically_normal();
+            }
+            jobs.push_back({input, output});
+        }
+    }
+}
+
+std::string requireValue(int argc, char** argv, int& i, std::string_view what) {
+    if (i + 1 >= argc) {
+        throw std::runtime_error(std::string(argv[i]) + " expects " + std::string(what) + ".");
+    }
+    return argv[++i];
+}
+
+int parsePort(const std::string& value) {
+    std::size_t used = 0;
+    int port = 0;
+    try {
+        port = std::stoi(value, &used);
+    } catch (const std::exception&) {
+        used = 0;
+    }
+    if (used != value.size() || port < 1 || port > 65535) {
+        throw std::runtime_error("Invalid port '" + value + "' (expected 1-65535).");
+    }
+    return port;
+}
+
+// An option whose port argument may be left out, like --coordinator [PORT].
+int optionalPort(int argc, char** argv, int& i, int defaultPort) {
+    const bool portGiven = i + 1 < argc && argv[i + 1][0] != '\0' &&
+                           std::all_of(argv[i + 1], argv[i + 1] + std::strlen(argv[i + 1]),
+                                       [](char c) { return std::isdigit(static_cast<unsigned char>(c)); });
+    return portGiven ? parsePort(argv[++i]) : defaultPort;
+}
+
+// "host", "host:port" or "[v6 address]:port".
+std::pair<std::string, int> parseHostPort(const std::string& value) {
+    std::string host = value;
+    int port = kDefaultPort;
+    const auto colon = value.rfind(':');
+    const bool bracketed = !value.empty() && value.front() == '[';
+    // A bare IPv6 address has several colons and no port.
+    const bool hasPort = bracketed ? colon != std::string::npos && colon > 0 && value[colon - 1] == ']'
+                                   : colon != std::string::npos && value.find(':') == colon;
+    if (hasPort) {
+        host = value.substr(0, colon);
+        port = parsePort(value.substr(colon + 1));
+    }
+    if (host.size() > 1 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+    if (host.empty()) {
+        throw std::runtime_error("--worker expects the coordinator's host name, optionally followed by :PORT.");
+    }
+    return {host, port};
+}
+
+// A model name from knownModels() stands for every scale of it, unless :SCALE picks one. Any other name is a custom
+// model: NAME.param/.bin must be in one of the folders findModel() searches, and it is taken as x4 unless :SCALE
+// says otherwise.
+std::vector<UpscaleModel> resolveModels(const fs::path& execDir, const std::string& spec) {
+    std::string name = spec;
+    int scale = 0;
+    const auto colon = spec.rfind(':');
+    if (colon != std::string::npos) {
+        name = spec.substr(0, colon);
+        const long long value = safeParseLong(spec.substr(colon + 1));
+        if (value < 2 || value > 4) {
+            throw std::runtime_error("--model expects a scale of 2, 3 or 4 after ':', got '" + spec + "'.");
+        }
+        scale = static_cast<int>(value);
+    }
+
+    std::vector<UpscaleModel> models;
+    bool known = false;
+    for (const auto& model : knownModels()) {
+        known = known || model.name == name;
+        if (model.name == name && (scale == 0 || model.scale == scale)) {
+            models.push_back(model);
+        }
+    }
+    if (known) {
+        if (models.empty()) {
+            throw std::runtime_error(name + " has no x" + std::to_string(scale) + " model.");
+        }
+        return models;
+    }
+
+    auto files = findModel(execDir, name);
+    if (!files) {
+        throw std::runtime_error("Model files " + name + ".param/.bin not found next to the executable, in bin/, "
+                                 "models/ or third_party/realesrgan-ncnn-vulkan/.");
+    }
+    return {{name, scale == 0 ? 4 : scale, name, Precision::Mixed, files->param.parent_path()}};
+}
+
+UpscaleConfig parseArgs(int argc, char** argv) {
+    UpscaleConfig cfg;
+    cfg.execDir = executableDir(argv[0]);
+    cfg.workspaceRoot = fs::temp_directory_path() / "icecale-work";
+
+    std::vector<std::string> inputArgs;
+    std::vector<fs::path> jobFiles;
+    fs::path outputFile;
+    fs::path outputDir;
+    bool segmentsGiven = false;
+    ModelPreset preset = findModelPreset("standard");
+    std::string modelArg;
+    std::optional<Precision> precision;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            printUsage(std::cout);
+            std::exit(0);
+        } else if (arg == "--stream") {
+            cfg.streaming = true;
+        } else if (arg == "--encoder-profile") {
+            EncoderProfile profile = findEncoderProfile(requireValue(argc, argv, i, "a profile name"));
+            profile.codec = cfg.encoder.codec;
+            profile.tenBit = cfg.encoder.tenBit;
+            cfg.encoder = profile;
+        } else if (arg == "--codec") {
+            cfg.encoder.codec = requireValue(argc, argv, i, "a codec name");
+            if (cfg.encoder.codec != "h264" && cfg.encoder.codec != "hevc" && cfg.encoder.codec != "av1") {
+                throw std::runtime_error("Unknown codec '" + cfg.encoder.codec + "' (expected h264, hevc or av1).");
+            }
+        } else if (arg == "--ten-bit") {
+            cfg.encoder.tenBit = true;
+        } else if (arg == "--segments") {
+            const long long segments = safeParseLong(requireValue(argc, argv, i, "a segment count"));
+            if (segments < 1) {
+                throw std::runtime_error("--segments expects a positive number.");
+            }
+            cfg.segments = static_cast<std::size_t>(segments);
+            segmentsGiven = true;
+        } else if (arg == "--coordinator") {
+            cfg.coordinatorPort = optionalPort(argc, argv, i, kDefaultPort);
+        } else if (arg == "--serve") {
+            cfg.servePort = optionalPort(argc, argv, i, kDefaultServePort);
+        } else if (arg == "--worker") {
+            std::tie(cfg.workerHost, cfg.workerPort) = parseHostPort(requireValue(argc, argv, i, "HOST[:PORT]"));
+        } else if (arg == "--token") {
+            cfg.token = requireValue(argc, argv, i, "a shared secret");
+            if (cfg.token.empty() ||
+                std::any_of(cfg.token.begin(), cfg.token.end(), [](unsigned char c) { return std::isspace(c); })) {
+                throw std::runtime_error("--token expects a secret without spaces.");
+            }
+        } else if (arg == "--hwaccel") {
+            cfg.hwaccel.enabled = true;
+        } else if (arg == "--external") {
+            cfg.forceExternal = true;
+        } else if (arg == "--resume") {
+            cfg.resume = true;
+        } else if (arg == "--keep-workspace") {
+            cfg.keepWorkspace = true;
+        } else if (arg == "--workspace-root") {
+            cfg.workspaceRoot = fs::absolute(fs::path(requireValue(argc, argv, i, "a directory"))).lexically_normal();
+        } else if (arg == "-o" || arg == "--output") {
+            outputFile = fs::absolute(fs::path(requireValue(argc, argv, i, "a file path"))).lexically_normal();
+        } else if (arg == "--output-dir") {
+            outputDir = fs::absolute(fs::path(requireValue(argc, argv, i, "a directory"))).lexically_normal();
+        } else if (arg == "--metrics-json") {
+            cfg.metricsJson = fs::absolute(fs::path(requireValue(argc, argv, i, "a file path"))).lexically_normal();
+        } else if (arg == "--jobs") {
+            jobFiles.emplace_back(requireValue(argc, argv, i, "a job file"));
+        } else if (arg == "--no-dedup") {
+            cfg.upscale.dedup = false;
+            cfg.stream.dedup = false;
+        } else if (arg == "--reuse-similar") {
+            cfg.upscale.reuse.enabled = true;
+        } else if (arg == "--reuse-threshold") {
+            const double threshold = safeParseDouble(requireValue(argc, argv, i, "a luma difference"));
+            if (threshold < 0.0 || threshold > 255.0) {
+                throw std::runtime_error("--reuse-threshold expects a difference between 0 and 255.");
+            }
+            cfg.upscale.reuse.enabled = true;
+            cfg.upscale.reuse.threshold = threshold;
+        } else if (arg == "--reuse-max-run") {
+            const long long run = safeParseLong(requireValue(argc, argv, i, "a frame count"));
+            if (run < 1) {
+                throw std::runtime_error("--reuse-max-run expects a positive number.");
+            }
+            cfg.upscale.reuse.enabled = true;
+            cfg.upscale.reuse.maxRun = static_cast<std::size_t>(run);
+        } else if (arg == "--changed-tiles") {
+            cfg.stream.changedTileSize = kDefaultChangedTileSize;
+        } else if (arg == "--changed-tile-size") {
+            const long long size = safeParseLong(requireValue(argc, argv, i, "a size in pixels"));
+            if (size < 16 || size > 1024) {
+                throw std::runtime_error("--changed-tile-size expects a size between 16 and 1024 pixels.");
+            }
+            cfg.stream.changedTileSize = static_cast<int>(size);
+        } else if (arg == "--cache-dir") {
+            cfg.upscale.cacheDir =
+                fs::absolute(fs::path(requireValue(argc, argv, i, "a directory"))).lexically_normal();
+        } else if (arg == "--cache-size") {
+            const double gigabytes = safeParseDouble(requireValue(argc, argv, i, "a size in GiB"));
+            if (gigabytes <= 0.0) {
+                throw std::runtime_error("--cache-size expects a positive size in GiB.");
+            }
+            cfg.upscale.cacheBytes = static_cast<std::uintmax_t>(gigabytes * (1 << 30));
+        } else if (arg == "--disk-budget") {
+            const double gigabytes = safeParseDouble(requireValue(argc, argv, i, "a size in GiB"));
+            if (gigabytes <= 0.0) {
+                throw std::runtime_error("--disk-budget expects a positive size in GiB.");
+            }
+            cfg.upscale.diskBudget = std::make_shared<DiskBudget>(static_cast<std::uintmax_t>(gigabytes * (1 << 30)));
+        } else if (arg == "--preset") {
+            preset = findModelPreset(requireValue(argc, argv, i, "a preset name"));
+        } else if (arg == "--model") {
+            modelArg = requireValue(argc, argv, i, "a model name");
+        } else if (arg == "--precision") {
+            precision = findPrecision(requireValue(argc, argv, i, "a precision"));
+        } else if (arg == "--frame-format") {
+            cfg.upscale.frames = findFrameFormat(requireValue(argc, argv, i, "a frame format"));
+        } else if (arg == "--gpu-profiles") {
+            cfg.profileFile = fs::absolute(fs::path(requireValue(argc, argv, i, "a file path"))).lexically_normal();
+        } else if (arg == "--recalibrate") {
+            cfg.recalibrate = true;
+        } else if (arg == "--no-calibrate") {
+            cfg.calibrate = false;
+        } else if (arg == "--gpus") {
+            cfg.requestedGpus = parseGpuList(requireValue(argc, argv, i, "a comma-separated list of GPU indices"));
+        } else if (arg.size() > 1 && arg.front() == '-') {
+            throw std::runtime_error("Unknown option: " + std::string(arg) + " (see --help)");
+        } else {
+            inputArgs.emplace_back(arg);
+        }
+    }
+
+    if (outputDir.empty()) {
+        outputDir = downloadsDirectory();
+    }
+    for (const auto& pattern : inputArgs) {
+        for (const auto& input : expandInputPattern(pattern)) {
+            cfg.jobs.push_back({input, defaultOutputPath(outputDir, input)});
+        }
+    }
+    for (const auto& jobFile : jobFiles) {
+        readJobFile(jobFile, outputDir, cfg.jobs);
+    }
+
+    if (cfg.encoder.tenBit && cfg.encoder.codec == "h264") {
+        throw std::runtime_error("--ten-bit needs --codec hevc or av1; NVENC encodes H.264 in 8 bits only.");
+    }
+    cfg.stream.reuse = cfg.upscale.reuse;
+    if (cfg.recalibrate && !cfg.calibrate) {
+        throw std::runtime_error("--recalibrate and --no-calibrate cannot be combined.");
+    }
+    if (cfg.profileFile.empty()) {
+        cfg.profileFile = defaultProfileFile();
+    }
+    cfg.models = resolveModels(cfg.execDir, modelArg.empty() ? preset.models : modelArg);
+    for (auto& model : cfg.models) {
+        model.precision = precision.value_or(preset.precision);
+    }
+
+    if (!cfg.workerHost.empty()) {
+        if (cfg.coordinatorPort > 0 || cfg.servePort > 0) {
+            throw std::runtime_error("--worker cannot be combined with --coordinator or --serve.");
+        }
+        if (!cfg.jobs.empty() || !jobFiles.empty() || !outputFile.empty()) {
+            throw std::runtime_error("A --worker takes its inputs from the coordinator; give them there instead.");
+        }
+        // Each assignment is already one segment, processed with every local GPU.
+        cfg.segments = 1;
+        return cfg;
+    }
+    if (!cfg.token.empty() && cfg.coordinatorPort == 0) {
+        throw std::runtime_error("--token is only used with --coordinator or --worker.");
+    }
+    if (cfg.coordinatorPort > 0 && !segmentsGiven) {
+        cfg.segments = kDefaultRemoteSegments;
+    }
+    if (cfg.servePort > 0) {
+        if (cfg.coordinatorPort > 0) {
+            throw std::runtime_error("--serve and --coordinator cannot be combined.");
+        }
+        if (!outputFile.empty()) {
+            throw std::runtime_error("--serve takes the output path with each submitted job instead of --output.");
+        }
+        // Inputs on the command line become the first queued jobs; the rest arrive over HTTP.
+        cfg.outputDir = outputDir;
+        return cfg;
+    }
+
+    if (cfg.jobs.empty() && jobFiles.empty()) {
+        std::cout << "Enter the path to the input video: " << std::flush;
+        std::string inputLine;
+        std::getline(std::cin, inputLine);
+        inputLine = trim(inputLine);
+        if (inputLine.empty()) {
+            throw std::runtime_error("No input path provided.");
+        }
+        const fs::path input = fs::absolute(fs::path(inputLine)).lexically_normal();
+        cfg.jobs.push_back({input, defaultOutputPath(outputDir, input)});
+    }
+    if (cfg.jobs.empty()) {
+        throw std::runtime_error("The job files list no inputs.");
+    }
+
+    if (!outputFile.empty()) {
+        if (cfg.jobs.size() != 1) {
+            throw std::runtime_error("--output needs exactly one input; use --output-dir for several.");
+        }
+        cfg.jobs.front().output = outputFile;
+    }
+
+    std::map<fs::path, fs::path> outputs;
+    for (const auto& job : cfg.jobs) {
+        auto [it, inserted] = outputs.emplace(job.output, job.input);
+        if (!inserted) {
+            throw std::runtime_error(it->second.string() + " and " + job.input.string() + " would both write " +
+                                     job.output.string());
+        }
+    }
+
+    return cfg;
+}
+
+// Engines stay loaded across the jobs of a queue as long as their model and precision are what the next plan needs.
+struct ResidentUpscalers {
+    std::string model;
+    int tileSize = -1;
+    bool loaded = false;
+    std::vector<std::unique_ptr<FrameUpscaler>> engines;
+
+    std::vector<std::unique_ptr<FrameUpscaler>>& acquire(const UpscaleConfig& config, const ScalePlan& plan) {
+        // Every scale of a model is its own network.
+        const std::string key =
+            (plan.model.dir / plan.model.files).string() + " " + precisionName(plan.model.precision);
+        if (!loaded || model != key) {
+            engines.clear();
+            engines = createResidentUpscalers(config.execDir, plan, config.gpus);
+            model = key;
+            loaded = true;
+        } else if (tileSize != plan.tileSize) {
+            // Only the model needs loading; the tile follows each job's inference size.
+            for (auto& engine : engines) {
+                engine->setTileSize(plan.tileSize);
+            }
+        }
+        tileSize = plan.tileSize;
+        return engines;
+    }
+};
+
+fs::path segmentDirectory(const fs::path& workspace, const Segment& segment) {
+    std::ostringstream name;
+    name << "segment_" << std::setw(4) << std::setfill('0') << segment.index;
+    return workspace / "segments" / name.str();
+}
+
+// Job manifest key recording that a segment's video.mp4 is complete.
+std::string segmentDoneKey(const Segment& segment) {
+    return "segment." + std::to_string(segment.index);
+}
+
+// Joins encoded segments with the concat demuxer. Video packets are copied as they are and the source's audio,
+// subtitles and chapters are muxed in, so the result is the same as one long encode apart from keyframes at the
+// segment boundaries.
+void concatSegments(const fs::path& ffmpeg,
+                    const std::vector<fs::path>& files,
+                    const fs::path& listFile,
+                    const Passthrough& passthrough,
+                    const EncoderProfile& encoding,
+                    const fs::path& outputFile) {
+    {
+        std::ofstream list(listFile, std::ios::trunc);
+        for (const auto& file : files) {
+            // Single quotes are the concat list's only quoting; an embedded one is closed, escaped and reopened.
+            std::string quoted;
+            for (char c : file.string()) {
+                quoted += c == '\'' ? std::string("'\\''") : std::string(1, c);
+            }
+            list << "file '" << quoted << "'\n";
+        }
+        if (!list) {
+            throw std::runtime_error("Failed to write " + listFile.string());
+        }
+    }
+
+    std::vector<std::string> args = {ffmpeg.string(), "-y", "-v", "error", "-f", "concat", "-safe", "0",
+                                     "-i", listFile.string()};
+    const auto sourceArgs = buildSourceInputArgs(passthrough);
+    args.insert(args.end(), sourceArgs.begin(), sourceArgs.end());
+    args.insert(args.end(), {"-map", "0:v:0"});
+    const auto passthroughArgs = buildPassthroughArgs(passthrough, 1);
+    args.insert(args.end(), passthroughArgs.begin(), passthroughArgs.end());
+    args.insert(args.end(), {"-c:v", "copy"});
+    if (encoding.codec == "hevc") {
+        args.insert(args.end(), {"-tag:v", "hvc1"});
+    }
+    args.push_back(outputFile.string());
+
+    auto res = runCommand(args);
+    if (res.exitCode != 0) {
+        throw std::runtime_error("Failed to join segments:\n" + res.output);
+    }
+}
+
+// Runs the whole decode -> upscale -> encode pipeline on every segment, one segment per GPU (or per in-process engine)
+// at a time, then joins the results. Segments share one set of meters, so the status line shows the whole job. Each
+// segment has its own manifest and is recorded in the job's manifest once encoded, so --resume only redoes the
+// segments that had not finished, and those from the frame where they stopped.
+void runSegments(const UpscaleConfig& config,
+                 const UpscaleJob& job,
+                 const fs::path& workspace,
+                 const std::map<std::string, std::string>& identity,
+                 const VideoMetadata& metadata,
+                 const ScalePlan& plan,
+                 const std::vector<Segment>& segments,
+                 const std::vector<FrameUpscaler*>& engines,
+                 const Passthrough& passthrough,
+                 JobManifest& manifest,
+                 JobMetrics& metrics) {
+    const fs::path segmentRoot = workspace / "segments";
+    if (!manifest.resumed()) {
+        fs::remove_all(segmentRoot);
+    }
+    auto segmentDir = [&](const Segment& segment) { return segmentDirectory(workspace, segment); };
+    auto doneKey = segmentDoneKey;
+
+    PipelineMeters meters;
+    long long totalFrames = 0;
+    std::vector<const Segment*> pending;
+    for (const auto& segment : segments) {
+        totalFrames += segment.frames;
+        if (manifest.get(doneKey(segment)) == std::optional<std::string>("done") &&
+            fs::exists(segmentDir(segment) / "video.mp4")) {
+            for (StageMeter* meter : {&meters.decode, &meters.upscale, &meters.encode}) {
+                meter->add(static_cast<std::size_t>(segment.frames));
+            }
+        } else {
+            pending.push_back(&segment);
+        }
+    }
+    FrameTotal total(totalFrames);
+    total.settle(static_cast<std::size_t>(totalFrames));
+
+    const std::size_t lanes = engines.empty() ? std::max<std::size_t>(1, config.gpus.size()) : engines.size();
+    const std::size_t workers = std::min(lanes, pending.size());
+    std::cout << "Processing " << segments.size() << " segment(s)";
+    if (pending.size() < segments.size()) {
+        std::cout << " (" << segments.size() - pending.size() << " already done)";
+    }
+    std::cout << ", " << workers << " at a time...\n";
+    meters.shareBetween(pending.size());
+
+    std::vector<JobMetrics> segmentMetrics(segments.size());
+    std::mutex manifestMutex;
+    std::atomic<std::size_t> next{0};
+    std::atomic<bool> failed{false};
+    FirstError firstError;
+    auto runSegment = [&](const Segment& segment, std::size_t worker) {
+        const fs::path dir = segmentDir(segment);
+        VideoMetadata segmentMetadata = metadata;
+        segmentMetadata.seekTo = segment.start > 0.0 ? inputSeekOffset(metadata, segment.start) : 0.0;
+        segmentMetadata.frameLimit = segment.frames;
+        segmentMetadata.totalFrames = segment.frames;
+
+        auto segmentIdentity = identity;
+        std::ostringstream description;
+        description << segment.index << " " << std::fixed << std::setprecision(6) << segment.start << " "
+                    << segment.frames;
+        segmentIdentity["segment"] = description.str();
+        JobManifest segmentManifest(dir, segmentIdentity);
+        segmentManifest.open(config.resume && fs::exists(dir), dir / "frames_upscaled", config.upscale.frames.upscaled);
+
+        const fs::path output = dir / "video.mp4";
+        JobMetrics& scratch = segmentMetrics[segment.index];
+        if (engines.empty()) {
+            std::vector<int> gpus;
+            if (!config.gpus.empty()) {
+                gpus.push_back(config.gpus[worker]);
+            }
+            runDiskPipeline(config.ffmpeg, config.realesrgan, job.input, {}, output,
+                            {dir / "frames_raw", dir / "frames_upscaled", dir / "batches", dir / "logs"},
+                            segmentMetadata, plan, gpus, config.upscale, config.hwaccel, config.encoder,
+                            segmentManifest, scratch, &meters);
+        } else {
+            streamVideo(config.ffmpeg, job.input, {}, output, dir / "logs", segmentMetadata, plan, {engines[worker]},
+                        config.stream, config.hwaccel, config.encoder, scratch, &meters);
+        }
+        // The encoded segment is all the join needs; its frames would only take up space until the job ends.
+        if (!config.keepWorkspace) {
+            for (const auto& frames : {"frames_raw", "frames_upscaled", "batches"}) {
+                fs::remove_all(dir / frames);
+            }
+        }
+        std::lock_guard<std::mutex> lock(manifestMutex);
+        manifest.set(doneKey(segment), "done");
+    };
+
+    std::vector<std::function<void()>> bodies;
+    for (std::size_t worker = 0; worker < workers; ++worker) {
+        bodies.emplace_back([&, worker] {
+            // After a failure no new segment is started; the ones running finish and stay resumable.
+            while (!failed) {
+                const std::size_t i = next++;
+                if (i >= pending.size()) {
+                    return;
+                }
+                try {
+                    runSegment(*pending[i], worker);
+                } catch (...) {
+                    firstError.record(std::current_exception());
+                    failed = true;
+                }
+            }
+        });
+    }
+    runStages(std::move(bodies), meters.all(), total);
+
+    metrics.addStages(meters.all());
+    for (const auto& scratch : segmentMetrics) {
+        metrics.repeatedFrames += scratch.repeatedFrames;
+        metrics.reusedFrames += scratch.reusedFrames;
+        metrics.tilesChecked += scratch.tilesChecked;
+        metrics.tilesUpscaled += scratch.tilesUpscaled;
+        // Each lane streams one segment at a time with pools of its own.
+        metrics.framePoolBytes = std::max(metrics.framePoolBytes, scratch.framePoolBytes * workers);
+        metrics.cacheHits += scratch.cacheHits;
+    }
+    firstError.rethrowIfAny();
+    printInferenceSkipped(metrics, meters.upscale.frames());
+
+    std::vector<fs::path> files;
+    for (const auto& segment : segments) {
+        files.push_back(segmentDir(segment) / "video.mp4");
+    }
+    std::cout << "Joining " << files.size() << " segment(s) without re-encoding...\n";
+    concatSegments(config.ffmpeg, files, segmentRoot / "concat.txt", passthrough, config.encoder, job.output);
+}
+
+// Coordinator / worker protocol. Every message is one line: a verb followed by key=value fields. SEGMENT and RESULT
+// are followed by a payload of exactly bytes= bytes: the segment's source packets and its encoded video.
+//
+//   worker -> coordinator   HELLO version=2 name=HOST gpus=N token=T (token only when --token is given)
+//   coordinator -> worker   SEGMENT index=I frames=N bytes=B codec=C profile=P ten-bit=0|1 model=M scale=S
+//                           files=F precision=P source=WxH inference=WxH output=WxH tile=T, WAIT, DONE,
+//                           CANCEL index=I once another copy of I has finished, or REFUSED and a message line
+//   worker -> coordinator   PROGRESS index=I frames=N, RESULT index=I bytes=B, CANCELED index=I, or FAILED index=I
+//                           and a message line
+constexpr int kProtocolVersion = 3;
+// Both sides send something at least this often while a connection is open...
+constexpr int kHeartbeatSeconds = 5;
+// ...and take a peer that has been silent for this long to be gone.
+constexpr int kPeerTimeoutSeconds = 60;
+// Once nothing is left to hand out, an idle worker takes a second copy of a segment expected to need this long.
+constexpr double kStragglerSeconds = 30.0;
+// A segment that fails on this many workers fails the job.
+constexpr int kMaxSegmentFailures = 3;
+
+struct Message {
+    std::string verb;
+    std::map<std::string, std::string> fields;
+
+    std::string text(const std::string& key) const {
+        auto it = fields.find(key);
+        return it == fields.end() ? std::string() : it->second;
+    }
+
+    long long number(const std::string& key) const {
+        const std::string value = text(key);
+        std::size_t used = 0;
+        long long parsed = -1;
+        try {
+            parsed = std::stoll(value, &used);
+        } catch (const std::exception&) {
+            used = 0;
+        }
+        if (used == 0 || used != value.size() || parsed < 0) {
+            throw std::runtime_error(verb + " message without a valid " + key + ".");
+        }
+        return parsed;
+    }
+
+    // A WxH field.
+    FrameSize size(const std::string& key) const {
+        const std::string value = text(key);
+        const auto x = value.find('x');
+        const FrameSize size{static_cast<int>(safeParseLong(value.substr(0, x))),
+                             x == std::string::npos ? 0 : static_cast<int>(safeParseLong(value.substr(x + 1)))};
+        if (size.width <= 0 || size.height <= 0) {
+            throw std::runtime_error(verb + " message without a valid " + key + ".");
+        }
+        return size;
+    }
+};
+
+std::string sizeField(FrameSize size) {
+    return std::to_string(size.width) + "x" + std::to_string(size.height);
+}
+
+// Compares every byte whatever the first difference, so the reply time does not tell how much of a guess was right.
+bool sameToken(const std::string& given, const std::string& expected) {
+    if (given.size() != expected.size()) {
+        return false;
+    }
+    unsigned char difference = 0;
+    for (std::size_t i = 0; i < given.size(); ++i) {
+        difference |= static_cast<unsigned char>(given[i] ^ expected[i]);
+    }
+    return difference == 0;
+}
+
+Message parseMessage(const std::string& line) {
+    Message message;
+    std::istringstream in(line);
+    in >> message.verb;
+    std::string field;
+    while (in >> field) {
+        if (auto eq = field.find('='); eq != std::string::npos) {
+            message.fields[field.substr(0, eq)] = field.substr(eq + 1);
+        }
+    }
+    return message;
+}
+
+// Copies one segment's video packets out of the input for a worker, without decoding. A stream copy starts at the
+// keyframe at or before the seek point, so this aims a quarter frame past the segment's keyframe rather than before.
+void cutSegmentSource(const fs::path& ffmpeg,
+                      const fs::path& input,
+                      const VideoMetadata& metadata,
+                      const Segment& segment,
+                      const fs::path& output) {
+    const fs::path partial = output.string() + ".part";
+    std::vector<std::string> args = {ffmpeg.string(), "-y", "-v", "error"};
+    if (segment.start > 0.0) {
+        const double quarterFrame = metadata.fps > 0.0 ? 0.25 / metadata.fps : 0.001;
+        std::ostringstream position;
+        position << std::fixed << std::setprecision(6) << inputSeekOffset(metadata, segment.start) + quarterFrame;
+        args.insert(args.end(), {"-ss", position.str()});
+    }
+    args.insert(args.end(), {"-i", input.string(), "-map", "0:v:0", "-c", "copy", "-frames:v",
+                             std::to_string(segment.frames), "-f", "matroska", partial.string()});
+    auto res = runCommand(args);
+    if (res.exitCode != 0) {
+        throw std::runtime_error("Failed to cut segment " + std::to_string(segment.index) + ":\n" + res.output);
+    }
+    fs::rename(partial, output);
+}
+
+// Throws unless file is a video the other segments of the job can be joined with by stream copy: the planned output
+// size, in the job's codec and bit depth.
+void checkSegmentVideo(const fs::path& ffprobe, const fs::path& file, const ScalePlan& plan,
+                       const EncoderProfile& encoder) {
+    const auto fields = probeFields(ffprobe, file, {"-show_entries", "stream=codec_name,width,height,pix_fmt"});
+    const FrameSize size{static_cast<int>(safeParseLong(fieldOr(fields, "width"))),
+                         static_cast<int>(safeParseLong(fieldOr(fields, "height")))};
+    const std::string codec = fieldOr(fields, "codec_name");
+    const std::string pixelFormat = fieldOr(fields, "pix_fmt");
+    if (size.width != plan.output.width || size.height != plan.output.height) {
+        throw std::runtime_error("it is " + sizeField(size) + " instead of " + sizeField(plan.output));
+    }
+    if (codec != encoder.codec) {
+        throw std::runtime_error("it is " + (codec.empty() ? std::string("not video") : codec) + " instead of " +
+                                 encoder.codec);
+    }
+    if ((pixelFormat.find("10") != std::string::npos) != encoder.tenBit) {
+        throw std::runtime_error("its pixel format is " + pixelFormat + ", not " +
+                                 (encoder.tenBit ? "10-bit" : "8-bit"));
+    }
+}
+
+// Which segments of a distributed job are done, queued or held by workers. A segment goes back to the queue when its
+// worker is lost or fails it. Once the queue is empty, idle workers take second copies of segments that look far
+// from done, so a slow node cannot hold up the end of the job; whichever copy finishes first is kept.
+class RemoteScheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+    enum class Next { Segment, Wait, Done };
+
+    RemoteScheduler(const std::vector<Segment>& segments, const std::vector<bool>& done) {
+        for (const auto& segment : segments) {
+            Slot slot;
+            slot.frames = segment.frames;
+            slot.done = done[segment.index];
+            doneCount_ += slot.done ? 1 : 0;
+            slots_.push_back(slot);
+        }
+    }
+
+    // Picks a segment for a worker, waiting up to kHeartbeatSeconds for one to become available. Wait means the
+    // worker should be kept alive and ask again.
+    Next take(std::size_t& index) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        const auto deadline = Clock::now() + std::chrono::seconds(kHeartbeatSeconds);
+        for (;;) {
+            if (finishedLocked()) {
+                return Next::Done;
+            }
+            if (auto pick = pickLocked()) {
+                Slot& slot = slots_[*pick];
+                if (slot.copies++ == 0) {
+                    slot.started = Clock::now();
+                    slot.progress = 0;
+                }
+                index = *pick;
+                return Next::Segment;
+            }
+            if (Clock::now() >= deadline) {
+                return Next::Wait;
+            }
+            // Woken early by any change; the timeout re-checks for stragglers as their estimates grow.
+            changed_.wait_for(lock, std::chrono::seconds(1));
+        }
+    }
+
+    void progress(std::size_t index, long long frames) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        slots_[index].progress = std::max(slots_[index].progress, std::min(frames, slots_[index].frames));
+    }
+
+    // Called with a copy's result in hand. The first copy to finish runs commit (under the lock, so two copies cannot
+    // both install their file) and is counted; later ones are told to discard theirs. If commit throws, the copy is
+    // still held and is returned with release().
+    bool complete(std::size_t index, const std::function<void()>& commit) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Slot& slot = slots_[index];
+        const bool first = !slot.done;
+        if (first) {
+            commit();
+            slot.done = true;
+            ++doneCount_;
+        }
+        --slot.copies;
+        changed_.notify_all();
+        return first;
+    }
+
+    // Gives back a copy whose worker failed it or was lost; only failures count against the segment.
+    void release(std::size_t index, bool failed, const std::string& reason) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Slot& slot = slots_[index];
+        --slot.copies;
+        if (failed && !slot.done && ++slot.failures >= kMaxSegmentFailures && error_.empty()) {
+            error_ = "Segment " + std::to_string(index) + " failed on " + std::to_string(slot.failures) +
+                     " workers; the last said: " + reason;
+        }
+        changed_.notify_all();
+    }
+
+    // Frames of finished segments plus the progress reported on running ones.
+    std::size_t framesDone() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        long long frames = 0;
+        for (const auto& slot : slots_) {
+            frames += slot.done ? slot.frames : slot.progress;
+        }
+        return static_cast<std::size_t>(frames);
+    }
+
+    bool finished() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return finishedLocked();
+    }
+
+    bool done(std::size_t index) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return slots_[index].done;
+    }
+
+    std::string error() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return error_;
+    }
+
+private:
+    struct Slot {
+        long long frames = 0;
+        long long progress = 0;
+        bool done = false;
+        int copies = 0;
+        int failures = 0;
+        Clock::time_point started;
+    };
+
+    bool finishedLocked() const { return doneCount_ == slots_.size() || !error_.empty(); }
+
+    std::optional<std::size_t> pickLocked() const {
+        for (std::size_t i = 0; i < slots_.size(); ++i) {
+            if (!slots_[i].done && slots_[i].copies == 0) {
+                return i;
+            }
+        }
+        // Remaining time is extrapolated from the copy's own rate; one that has reported nothing for a while is
+        // assumed to be the slowest of all.
+        std::optional<std::size_t> straggler;
+        double longest = kStragglerSeconds;
+        const auto now = Clock::now();
+        for (std::size_t i = 0; i < slots_.size(); ++i) {
+            const Slot& slot = slots_[i];
+            if (slot.done || slot.copies != 1) {
+                continue;
+            }
+            const double elapsed = std::chrono::duration<double>(now - slot.started).count();
+            const double remaining = slot.progress > 0
+                                         ? elapsed * static_cast<double>(slot.frames - slot.progress) / slot.progress
+                                         : (elapsed > kStragglerSeconds ? HUGE_VAL : 0.0);
+            if (remaining > longest) {
+                longest = remaining;
+                straggler = i;
+            }
+        }
+        return straggler;
+    }
+
+    mutable std::mutex mutex_;
+    std::condition_variable changed_;
+    std::vector<Slot> slots_;
+    std::size_t doneCount_ = 0;
+    std::string error_;
+};
+
+// Serves the segments of one job to workers started with --worker, then joins what they send back. Each worker gets a
+// stream copy of its segment's packets rather than a path, so the nodes need no shared storage, and returns the
+// encoded segment. A worker that disconnects or stays silent for kPeerTimeoutSeconds loses its segment to the queue.
+// Finished segments are recorded in the job manifest like local ones, so --resume only hands out the rest.
+void coordinateSegments(const UpscaleConfig& config,
+                        const UpscaleJob& job,
+                        const fs::path& workspace,
+                        const VideoMetadata& metadata,
+                        const ScalePlan& plan,
+                        const std::vector<Segment>& segments,
+                        const Passthrough& passthrough,
+                        JobManifest& manifest,
+                        JobMetrics& metrics) {
+    const fs::path segmentRoot = workspace / "segments";
+    if (!manifest.resumed()) {
+        fs::remove_all(segmentRoot);
+    }
+
+    StageMeter remote("remote");
+    std::vector<bool> done(segments.size(), false);
+    long long totalFrames = 0;
+    std::size_t pending = 0;
+    for (const auto& segment : segments) {
+        totalFrames += segment.frames;
+        const fs::path dir = segmentDirectory(workspace, segment);
+        done[segment.index] = manifest.get(segmentDoneKey(segment)) == std::optional<std::string>("done") &&
+                              fs::exists(dir / "video.mp4");
+        if (done[segment.index]) {
+            remote.add(static_cast<std::size_t>(segment.frames));
+            continue;
+        }
+        ++pending;
+        ensureDirectory(dir);
+        if (!fs::exists(dir / "source.mkv")) {
+            cutSegmentSource(config.ffmpeg, job.input, metadata, segment, dir / "source.mkv");
+            remote.addBytes(fs::file_size(dir / "source.mkv"));
+        }
+    }
+    std::cout << "Cut " << pending << " of " << segments.size() << " segment(s) for the workers.\n";
+    metrics.lap("cut");
+
+    RemoteScheduler scheduler(segments, done);
+    // Without a shared token only workers on this machine can connect.
+    const bool loopbackOnly = config.token.empty();
+    Socket listener = Socket::listen(config.coordinatorPort, loopbackOnly);
+    if (loopbackOnly) {
+        std::cout << "Waiting for workers on this machine (start them with --worker 127.0.0.1:"
+                  << config.coordinatorPort
+                  << "); give the coordinator and its workers a --token to take workers on other machines...\n";
+    } else {
+        std::cout << "Waiting for workers on port " << config.coordinatorPort << " (start them with --worker "
+                  << icecale::hostName() << ":" << config.coordinatorPort << " --token SECRET)...\n";
+    }
+
+    // One per connection. Its own thread sends everything but a cancel, which comes from the thread of the worker
+    // that finished the same segment first, so every send holds the link's lock.
+    struct Link {
+        std::shared_ptr<Socket> socket;
+        std::mutex sending;
+        // The segment this worker is running, guarded by connectionsMutex.
+        std::optional<std::size_t> holding;
+    };
+
+    std::atomic<bool> stopping{false};
+    std::atomic<std::size_t> connected{0};
+    std::atomic<std::size_t> connectionIds{0};
+    std::mutex connectionsMutex;
+    std::vector<std::thread> connections;
+    std::set<std::shared_ptr<Link>> open;
+
+    // Tells every other worker still running a copy of index to drop it, so it can take something else.
+    auto cancelCopies = [&](std::size_t index, const Link* winner) {
+        std::vector<std::shared_ptr<Link>> losers;
+        {
+            std::lock_guard<std::mutex> lock(connectionsMutex);
+            for (const auto& link : open) {
+                if (link.get() != winner && link->holding == index) {
+                    losers.push_back(link);
+                }
+            }
+        }
+        for (const auto& link : losers) {
+            try {
+                std::lock_guard<std::mutex> lock(link->sending);
+                link->socket->sendLine("CANCEL index=" + std::to_string(index));
+            } catch (const std::exception&) {
+                // Its own thread finds the connection gone and gives the copy back.
+            }
+        }
+    };
+
+    auto serve = [&](std::shared_ptr<Link> link) {
+        Socket* socket = link->socket.get();
+        std::string name = socket->peer();
+        const std::string id = std::to_string(connectionIds++);
+        std::optional<std::size_t> holding;
+        auto hold = [&](std::optional<std::size_t> index) {
+            holding = index;
+            std::lock_guard<std::mutex> lock(connectionsMutex);
+            link->holding = index;
+        };
+        auto send = [&](const std::string& line) {
+            std::lock_guard<std::mutex> lock(link->sending);
+            socket->sendLine(line);
+        };
+        auto refuse = [&](const std::string& reason) {
+            send("REFUSED");
+            send(reason);
+            throw std::runtime_error(reason);
+        };
+        bool joined = false;
+        try {
+            socket->setReceiveTimeout(kPeerTimeoutSeconds);
+            std::string line;
+            if (!socket->readLine(line)) {
+                throw std::runtime_error("closed the connection before saying hello");
+            }
+            const Message hello = parseMessage(line);
+            if (hello.verb != "HELLO" || hello.number("version") != kProtocolVersion) {
+                refuse("does not speak version " + std::to_string(kProtocolVersion) + " of the worker protocol");
+            }
+            if (!sameToken(hello.text("token"), config.token)) {
+                refuse("did not give the coordinator's --token");
+            }
+            name = hello.text("name") + " (" + socket->peer() + ")";
+            joined = true;
+            ++connected;
+            if (!scheduler.finished()) {
+                std::cout << "\nWorker " << name << " joined with " << hello.text("gpus") << " GPU(s).\n";
+            }
+
+            for (;;) {
+                std::size_t index = 0;
+                const auto next = scheduler.take(index);
+                if (next == RemoteScheduler::Next::Done) {
+                    send("DONE");
+                    break;
+                }
+                if (next == RemoteScheduler::Next::Wait) {
+                    send("WAIT");
+                    continue;
+                }
+                hold(index);
+                // A second copy whose first finished before it was recorded here would not be canceled.
+                if (scheduler.done(index)) {
+                    hold(std::nullopt);
+                    scheduler.release(index, false, {});
+                    continue;
+                }
+                const Segment& segment = segments[index];
+                const fs::path dir = segmentDirectory(workspace, segment);
+                const fs::path source = dir / "source.mkv";
+                const auto sourceBytes = fs::file_size(source);
+                std::ostringstream header;
+                header << "SEGMENT index=" << index << " frames=" << segment.frames << " bytes=" << sourceBytes
+                       << " codec=" << config.encoder.codec << " profile=" << config.encoder.name
+                       << " ten-bit=" << (config.encoder.tenBit ? 1 : 0) << " model=" << plan.model.name
+                       << " scale=" << plan.model.scale << " files=" << plan.model.files
+                       << " precision=" << precisionName(plan.model.precision) << " source=" << sizeField(plan.source)
+                       << " inference=" << sizeField(plan.inference) << " output=" << sizeField(plan.output)
+                       << " tile=" << plan.tileSize;
+                {
+                    std::lock_guard<std::mutex> lock(link->sending);
+                    socket->sendLine(header.str());
+                    icecale::sendFile(*socket, source, sourceBytes);
+                }
+
+                for (;;) {
+                    if (!socket->readLine(line)) {
+                        throw std::runtime_error("closed the connection");
+                    }
+                    const Message message = parseMessage(line);
+                    if (message.verb == "PROGRESS") {
+                        scheduler.progress(index, message.number("frames"));
+                    } else if (message.verb == "RESULT") {
+                        const auto bytes = static_cast<std::uintmax_t>(message.number("bytes"));
+                        const fs::path part = dir / ("video." + id + ".part");
+                        icecale::receiveFile(*socket, part, bytes);
+                        // A worker that ignored the plan would break the stream-copy join; its copy counts as failed.
+                        try {
+                            checkSegmentVideo(config.ffprobe, part, plan, config.encoder);
+                        } catch (const std::exception& ex) {
+                            fs::remove(part);
+                            std::cout << "\nWorker " << name << " sent an unusable segment " << index << ": "
+                                      << ex.what() << "\n";
+                            hold(std::nullopt);
+                            scheduler.release(index, true, ex.what());
+                            break;
+                        }
+                        const bool first = scheduler.complete(index, [&] {
+                            fs::rename(part, dir / "video.mp4");
+                            manifest.set(segmentDoneKey(segment), "done");
+                        });
+                        hold(std::nullopt);
+                        if (first) {
+                            remote.add(static_cast<std::size_t>(segment.frames));
+                            remote.addBytes(bytes);
+                            cancelCopies(index, link.get());
+                        } else {
+                            fs::remove(part);
+                        }
+                        break;
+                    } else if (message.verb == "CANCELED") {
+                        hold(std::nullopt);
+                        scheduler.release(index, false, {});
+                        break;
+                    } else if (message.verb == "FAILED") {
+                        std::string reason;
+                        socket->readLine(reason);
+                        std::cout << "\nWorker " << name << " failed segment " << index << ": " << reason << "\n";
+                        hold(std::nullopt);
+                        scheduler.release(index, true, reason);
+                        break;
+                    } else {
+                        throw std::runtime_error("sent an unexpected " + message.verb + " message");
+                    }
+                }
+            }
+        } catch (const std::exception& ex) {
+            if (!stopping) {
+                std::cout << "\nLost worker " << name << ": " << ex.what();
+                if (holding) {
+                    std::cout << "; segment " << *holding << " goes back to the queue";
+                }
+                std::cout << ".\n";
+            }
+        }
+        if (holding) {
+            scheduler.release(*holding, false, {});
+        }
+        if (joined) {
+            --connected;
+        }
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        open.erase(link);
+    };
+
+    std::thread acceptor([&] {
+        while (!stopping) {
+            try {
+                if (!listener.waitReadable(250)) {
+                    continue;
+                }
+                auto link = std::make_shared<Link>();
+                link->socket = std::make_shared<Socket>(listener.accept());
+                std::lock_guard<std::mutex> lock(connectionsMutex);
+                open.insert(link);
+                connections.emplace_back(serve, link);
+            } catch (const std::exception& ex) {
+                std::cout << "\nWarning: " << ex.what() << "\n";
+                std::this_thread::sleep_for(std::chrono::milliseconds(250));
+            }
+        }
+    });
+
+    const auto start = std::chrono::steady_clock::now();
+    const std::size_t resumedFrames = remote.frames();
+    auto report = [&] {
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const std::size_t frames = scheduler.framesDone();
+        const std::size_t fresh = frames - std::min(frames, resumedFrames);
+        const double fps = elapsed > 0.0 ? static_cast<double>(fresh) / elapsed : 0.0;
+        printProgress("Distributed on " + std::to_string(connected) + " worker(s):", frames,
+                      static_cast<std::size_t>(totalFrames), fps, 0.0);
+    };
+    while (!scheduler.finished()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        report();
+    }
+    report();
+    std::cout << "\n";
+
+    // Idle workers have been told DONE by now; the rest are still dropping copies nobody needs any more.
+    stopping = true;
+    acceptor.join();
+    {
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        for (const auto& link : open) {
+            link->socket->shutdown();
+        }
+    }
+    for (auto& connection : connections) {
+        connection.join();
+    }
+    listener.close();
+    remote.finish();
+    metrics.addStages({&remote});
+
+    if (const std::string error = scheduler.error(); !error.empty()) {
+        throw std::runtime_error(error);
+    }
+    std::vector<fs::path> files;
+    for (const auto& segment : segments) {
+        files.push_back(segmentDirectory(workspace, segment) / "video.mp4");
+    }
+    std::cout << "Joining " << files.size() << " segment(s) without re-encoding...\n";
+    concatSegments(config.ffmpeg, files, segmentRoot / "concat.txt", passthrough, config.encoder, job.output);
+}
+
+// Runs one job of the queue. Tools and GPUs have already been verified by the caller; the realesrgan binary is only
+// looked for the first time a job actually needs it. Returns the job workspace once it is locked, via workspaceOut,
+// so a failure can be reported with a resume hint. A worker passes sharedMeters to follow the pipeline's progress and
+// report it, in which case the pipeline leaves the status line alone.
+void runJob(UpscaleConfig& config,
+            const UpscaleJob& job,
+            ResidentUpscalers& resident,
+            fs::path& workspaceOut,
+            JobMetrics& metrics,
+            PipelineMeters* sharedMeters = nullptr) {
+    if (!fs::exists(job.input)) {
+        throw std::runtime_error("Input file does not exist: " + job.input.string());
+    }
+
+    std::cout << "Probing input video...\n";
+    auto metadata = probeVideo(config.ffprobe, job.input);
+    std::cout << "Resolution: " << metadata.width << "x" << metadata.height << ", FPS: "
+              << (metadata.fpsRaw.empty() ? std::to_string(metadata.fps) : metadata.fpsRaw)
+              << ", Frames: " << metadata.totalFrames << " (" << metadata.frameCountSource << ")\n";
+    if (sharedMeters) {
+        sharedMeters->expectedFrames = static_cast<std::size_t>(std::max(0LL, metadata.totalFrames));
+    }
+
+    if (config.assignedPlan && (config.assignedPlan->source.width != metadata.width ||
+                                config.assignedPlan->source.height != metadata.height)) {
+        throw std::runtime_error("The segment is " + std::to_string(metadata.width) + "x" +
+                                 std::to_string(metadata.height) + ", but the coordinator planned for " +
+                                 sizeField(config.assignedPlan->source) + ".");
+    }
+    const ScalePlan plan = config.assignedPlan ? *config.assignedPlan : planScale(metadata, config.models);
+    printPlan(plan);
+    // A coordinator hands out even a single segment, since it has no upscaler of its own.
+    const bool remote = plan.upscale && config.coordinatorPort > 0;
+    std::vector<Segment> segments;
+    if (plan.upscale && (config.segments > 1 || remote)) {
+        std::cout << "Finding keyframes to split at...\n";
+        segments = planSegments(probePackets(config.ffprobe, job.input), config.segments);
+        if (remote && (segments.empty() || segments.front().frames == 0)) {
+            throw std::runtime_error("ffprobe listed no video packets to hand to the workers.");
+        }
+        if (segments.size() < 2 && !remote) {
+            std::cout << "Too few keyframes to split this input; processing it in one pass.\n";
+            segments.clear();
+        }
+    }
+    // Audio, subtitles and chapters are mapped from the source by the final mux instead of being extracted first,
+    // which would read the whole source one more time.
+    const Passthrough passthrough =
+        planPassthrough(job.input, probeSubtitleCodecs(config.ffprobe, job.input), job.output);
+    metrics.lap("probe");
+
+    // The in-process engine is preferred when this build has one; realesrgan-ncnn-vulkan stays the fallback.
+    std::vector<std::unique_ptr<FrameUpscaler>> none;
+    auto& upscalers = plan.upscale && !config.forceExternal && !remote ? resident.acquire(config, plan) : none;
+    std::vector<FrameUpscaler*> engines;
+    for (const auto& upscaler : upscalers) {
+        engines.push_back(upscaler.get());
+    }
+    if (plan.upscale && upscalers.empty() && !remote) {
+        if (config.streaming) {
+            throw std::runtime_error("Streaming mode needs an in-process upscaler, which is not available.");
+        }
+        if (config.stream.changedTileSize > 0) {
+            std::cout << "--changed-tiles needs the in-process upscaler; upscaling whole frames.\n";
+        }
+        if (config.realesrgan.empty()) {
+            const fs::path realesrgan = findTool(config.execDir, "realesrgan-ncnn-vulkan");
+            requireCommand(realesrgan, "-h");
+            config.realesrgan = realesrgan;
+        }
+    }
+
+    auto identity = jobIdentity(job.input, metadata, plan, config.upscale, config.hwaccel);
+    if (!segments.empty()) {
+        identity["segments"] = std::to_string(segments.size());
+    }
+    const fs::path workspace = jobWorkspace(config.workspaceRoot, identity);
+    WorkspaceLock workspaceLock(workspace);
+    workspaceOut = workspace;
+    std::cout << "Workspace: " << workspace << "\n";
+
+    const fs::path framesDir = workspace / "frames_raw";
+    const fs::path upscaledDir = workspace / "frames_upscaled";
+    const fs::path batchRoot = workspace / "batches";
+
+    // Only the frame-based disk path and finished segments leave anything behind that a later run could pick up.
+    const bool resumable = (plan.upscale && upscalers.empty()) || !segments.empty();
+    if (config.resume && !resumable) {
+        std::cout << "Nothing to resume for this mode; running the whole job.\n";
+    }
+    JobManifest manifest(workspace, identity);
+    manifest.open(config.resume && resumable, upscaledDir, config.upscale.frames.upscaled);
+    metrics.lap("setup");
+
+    // Only realesrgan-ncnn-vulkan takes its tile and threads per run; the in-process engine keeps the planned tile.
+    if (plan.upscale && upscalers.empty() && !remote && config.calibrate) {
+        std::vector<GpuInfo> gpus;
+        for (int index : config.gpus) {
+            for (const auto& gpu : config.detectedGpus) {
+                if (gpu.index == index) {
+                    gpus.push_back(gpu);
+                }
+            }
+        }
+        // --serve runs a job per GPU side by side; the first to measure a GPU model saves it for the others.
+        static std::mutex calibrationMutex;
+        std::lock_guard<std::mutex> lock(calibrationMutex);
+        tuneUpscaler(config.ffmpeg, config.realesrgan, job.input, metadata, plan, gpus, config.profileFile,
+                     config.recalibrate, workspace / "calibration", config.upscale);
+        // Measured once per run; later jobs of the queue use what was just saved.
+        config.recalibrate = false;
+        metrics.lap("calibrate");
+    }
+
+    ensureDirectory(job.output.parent_path());
+    metrics.encoder = config.encoder.encoder() + " " + config.encoder.name + (config.encoder.tenBit ? " 10-bit" : "");
+    if (config.upscale.diskBudget) {
+        config.upscale.diskBudget->resetPeak();
+    }
+    // The peak is process-wide, so it only starts over for a job that has the process to itself.
+    if (!config.concurrentJobs) {
+        icecale::resetOwnPeakMemory();
+    }
+    if (!plan.upscale) {
+        metrics.mode = "transcode";
+        std::cout << "Re-encoding with resolution capped at 1440p...\n";
+        ensureDirectory(workspace / "logs");
+        transcodeWithoutUpscale(config.ffmpeg, job.input, passthrough, job.output, workspace / "logs" / "transcode.log",
+                                metadata.totalFrames, plan, config.hwaccel, config.encoder, metrics);
+    } else if (remote) {
+        metrics.mode = "distributed";
+        metrics.segments = segments.size();
+        coordinateSegments(config, job, workspace, metadata, plan, segments, passthrough, manifest, metrics);
+    } else if (!segments.empty()) {
+        metrics.mode = engines.empty() ? "disk" : "stream";
+        metrics.segments = segments.size();
+        runSegments(config, job, workspace, identity, metadata, plan, segments, engines, passthrough, manifest,
+                    metrics);
+    } else if (!engines.empty()) {
+        metrics.mode = "stream";
+        std::cout << "Streaming decode -> upscale -> encode (no intermediate frames on disk)...\n";
+        streamVideo(config.ffmpeg, job.input, passthrough, job.output, workspace / "logs", metadata, plan, engines,
+                    config.stream, config.hwaccel, config.encoder, metrics, sharedMeters);
+    } else {
+        metrics.mode = "disk";
+        std::cout << "Extracting, upscaling with Real-ESRGAN (" << plan.model.name << " x" << plan.model.scale
+                  << " on " << config.gpus.size() << " GPU(s)) and encoding concurrently, capped to 1440p...\n";
+        if (plan.upscale && plan.model.precision != Precision::Mixed) {
+            std::cout << "Note: realesrgan-ncnn-vulkan picks its own precision; "
+                      << precisionName(plan.model.precision) << " applies to the in-process engine only.\n";
+        }
+        runDiskPipeline(config.ffmpeg, config.realesrgan, job.input, passthrough, job.output,
+                        {framesDir, upscaledDir, batchRoot, workspace / "logs"}, metadata, plan, config.gpus,
+                        config.upscale, config.hwaccel, config.encoder, manifest, metrics, sharedMeters);
+    }
+    metrics.lap(plan.upscale ? "pipeline" : "transcode");
+    metrics.peakMemoryBytes = icecale::ownPeakMemory();
+    metrics.peakMemoryProcessWide = config.concurrentJobs;
+    printPhaseSummary(metrics);
+    if (config.upscale.diskBudget && metrics.mode == "disk") {
+        metrics.peakScratchBytes = config.upscale.diskBudget->peak();
+        std::cout << "Peak frame scratch: " << formatBytes(metrics.peakScratchBytes) << " of the "
+                  << formatBytes(config.upscale.diskBudget->limit()) << " budget.\n";
+    }
+
+    std::cout << "Upscaled video saved to: " << job.output << "\n";
+    if (!config.keepWorkspace) {
+        std::error_code ec;
+        fs::remove_all(workspace, ec);
+        // Windows keeps the open lock file, and so the directory, until the lock is released.
+        workspaceLock.release();
+        fs::remove_all(workspace, ec);
+    }
+}
+
+std::string jsonString(std::string_view text) {
+    std::ostringstream out;
+    out << '"';
+    for (char c : text) {
+        switch (c) {
+            case '"':
+                out << "\\\"";
+                break;
+            case '\\':
+                out << "\\\\";
+                break;
+            case '\n':
+                out << "\\n";
+                break;
+            case '\t':
+                out << "\\t";
+                break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec
+                        << std::setfill(' ');
+                } else {
+                    out << c;
+                }
+        }
+    }
+    out << '"';
+    return out.str();
+}
+
+// One object per job of the queue, finished or not. Times are seconds, latencies milliseconds and sizes bytes; the
+// layout is kept stable (see "version") so dashboards can compare runs.
+void writeMetricsJson(const fs::path& path, const std::vector<JobMetrics>& jobs) {
+    std::ostringstream json;
+    json << std::fixed << std::setprecision(3);
+    json << "{\n  \"version\": 1,\n  \"jobs\": [";
+    for (std::size_t i = 0; i < jobs.size(); ++i) {
+        const JobMetrics& job = jobs[i];
+        json << (i == 0 ? "" : ",") << "\n    {\n"
+             << "      \"input\": " << jsonString(job.input.string()) << ",\n"
+             << "      \"output\": " << jsonString(job.output.string()) << ",\n"
+             << "      \"status\": " << jsonString(job.succeeded ? "ok" : "failed") << ",\n"
+             << "      \"error\": " << jsonString(job.error) << ",\n"
+             << "      \"mode\": " << jsonString(job.mode) << ",\n"
+             << "      \"encoder\": " << jsonString(job.encoder) << ",\n"
+             << "      \"started_at\": " << job.startedAt << ",\n"
+             << "      \"seconds\": " << job.seconds() << ",\n"
+             << "      \"bytes_written\": " << job.bytesWritten() << ",\n"
+             << "      \"repeated_frames\": " << job.repeatedFrames << ",\n"
+             << "      \"reused_frames\": " << job.reusedFrames << ",\n"
+             << "      \"tiles_checked\": " << job.tilesChecked << ",\n"
+             << "      \"tiles_upscaled\": " << job.tilesUpscaled << ",\n"
+             << "      \"cache_hits\": " << job.cacheHits << ",\n"
+             << "      \"segments\": " << job.segments << ",\n"
+             << "      \"peak_scratch_bytes\": " << job.peakScratchBytes << ",\n"
+             << "      \"frame_pool_bytes\": " << job.framePoolBytes << ",\n"
+             << "      \"peak_memory_bytes\": " << job.peakMemoryBytes << ",\n"
+             << "      \"peak_memory_scope\": " << jsonString(job.peakMemoryProcessWide ? "process" : "job") << ",\n"
+             << "      \"phases\": {";
+        for (std::size_t p = 0; p < job.phases.size(); ++p) {
+            json << (p == 0 ? "" : ", ") << jsonString(job.phases[p].first) << ": " << job.phases[p].second;
+        }
+        json << "},\n      \"stages\": [";
+        for (std::size_t st = 0; st < job.stages.size(); ++st) {
+            const StageReport& stage = job.stages[st];
+            json << (st == 0 ? "" : ",") << "\n        {\"name\": " << jsonString(stage.name)
+                 << ", \"frames\": " << stage.frames << ", \"seconds\": " << stage.seconds
+                 << ", \"fps\": " << stage.fps << ", \"bytes_written\": " << stage.bytes;
+            if (stage.latencySamples > 0) {
+                json << ", \"latency_ms\": {\"samples\": " << stage.latencySamples << ", \"p50\": " << stage.p50 * 1e3
+                     << ", \"p95\": " << stage.p95 * 1e3 << ", \"p99\": " << stage.p99 * 1e3 << "}";
+            }
+            json << "}";
+        }
+        json << (job.stages.empty() ? "" : "\n      ") << "]\n    }";
+    }
+    json << (jobs.empty() ? "" : "\n  ") << "]\n}\n";
+
+    // Replaced in one step, so a dashboard polling the file never reads half of it.
+    if (!path.parent_path().empty()) {
+        ensureDirectory(path.parent_path());
+    }
+    const fs::path temporary = path.string() + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        out << json.str();
+        if (!out) {
+            throw std::runtime_error("Failed to write metrics to " + temporary.string());
+        }
+    }
+    fs::rename(temporary, path);
+}
+
+// The coordinator's plan for a segment, with this worker's copy of the model. Throws when the worker does not have
+// the same model files.
+ScalePlan assignedPlan(const UpscaleConfig& config, const Message& assignment) {
+    ScalePlan plan;
+    plan.model =
+        resolveModels(config.execDir, assignment.text("model") + ":" + std::to_string(assignment.number("scale")))
+            .front();
+    if (plan.model.files != assignment.text("files")) {
+        throw std::runtime_error("This worker's " + plan.model.name + " x" + std::to_string(plan.model.scale) +
+                                 " model is " + plan.model.files + ", the coordinator's is " +
+                                 assignment.text("files") + ".");
+    }
+    plan.model.precision = findPrecision(assignment.text("precision"));
+    plan.source = assignment.size("source");
+    plan.inference = assignment.size("inference");
+    plan.output = assignment.size("output");
+    plan.tileSize = static_cast<int>(assignment.number("tile"));
+    return plan;
+}
+
+// Upscales and encodes one segment handed out by the coordinator and sends the result back, or reports the failure.
+// The segment runs as an ordinary single-pass job on its source packets, with every local GPU and the coordinator's
+// scale plan and encoder settings, so all segments of a job can be joined by stream copy. Progress is reported every
+// kHeartbeatSeconds, which also tells the coordinator this worker is still alive.
+void runRemoteSegment(UpscaleConfig& config,
+                      ResidentUpscalers& resident,
+                      Socket& socket,
+                      const Message& assignment,
+                      std::vector<JobMetrics>& metrics) {
+    const long long index = assignment.number("index");
+    const long long frames = assignment.number("frames");
+    // Several workers may share a workspace root, so each keeps its segments in a directory of its own.
+    const fs::path dir = config.workspaceRoot / ("remote-" + std::to_string(currentProcessId()) + "-segment_" +
+                                                 std::to_string(index));
+    fs::remove_all(dir);
+    ensureDirectory(dir);
+    const fs::path source = dir / "source.mkv";
+    icecale::receiveFile(socket, source, static_cast<std::uintmax_t>(assignment.number("bytes")));
+
+    EncoderProfile encoding = findEncoderProfile(assignment.text("profile"));
+    encoding.codec = assignment.text("codec");
+    encoding.tenBit = assignment.text("ten-bit") == "1";
+    if (encoding.name != config.encoder.name || encoding.codec != config.encoder.codec ||
+        encoding.tenBit != config.encoder.tenBit) {
+        requireEncoder(config.ffmpeg, encoding);
+        config.encoder = encoding;
+    }
+
+    std::cout << "\nSegment " << index << ": " << frames << " frame(s)\n";
+    PipelineMeters meters;
+    std::atomic<bool> running{true};
+    std::thread heartbeat([&] {
+        auto lastBeat = std::chrono::steady_clock::now();
+        while (running) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(250));
+            if (meters.decode.frames() > 0) {
+                printProgress("Segment " + std::to_string(index) + ":", meters.encode.frames(),
+                              static_cast<std::size_t>(frames), meters.encode.fps(), 0.0);
+            }
+            try {
+                // The coordinator sends a cancel once another worker has finished this segment.
+                std::string line;
+                if (socket.waitReadable(0)) {
+                    if (!socket.readLine(line)) {
+                        throw std::runtime_error("closed the connection");
+                    }
+                    const Message message = parseMessage(line);
+                    if (message.verb == "CANCEL" && message.number("index") == index) {
+                        meters.canceled = true;
+                    }
+                }
+                if (std::chrono::steady_clock::now() - lastBeat >= std::chrono::seconds(kHeartbeatSeconds)) {
+                    lastBeat = std::chrono::steady_clock::now();
+                    socket.sendLine("PROGRESS index=" + std::to_string(index) +
+                                    " frames=" + std::to_string(meters.encode.frames()));
+                }
+            } catch (const std::exception&) {
+                // The segment still finishes; sending its result reports the lost connection.
+                return;
+            }
+        }
+    });
+
+    const fs::path output = dir / "video.mp4";
+    JobMetrics& jobMetrics = metrics.emplace_back();
+    jobMetrics.input = source;
+    jobMetrics.output = output;
+    fs::path workspace;
+    std::string failure;
+    try {
+        config.assignedPlan = assignedPlan(config, assignment);
+        runJob(config, {source, output}, resident, workspace, jobMetrics, &meters);
+        jobMetrics.succeeded = true;
+    } catch (const std::exception& ex) {
+        failure = ex.what();
+        jobMetrics.error = failure;
+        jobMetrics.lap("failed");
+        // The coordinator decides whether the segment is retried, here or elsewhere; nothing here resumes it.
+        if (!workspace.empty() && !config.keepWorkspace) {
+            std::error_code ec;
+            fs::remove_all(workspace, ec);
+        }
+    }
+    running = false;
+    heartbeat.join();
+    if (!config.metricsJson.empty()) {
+        writeMetricsJson(config.metricsJson, metrics);
+    }
+
+    if (meters.canceled) {
+        socket.sendLine("CANCELED index=" + std::to_string(index));
+        std::cout << "\nSegment " << index << " was finished by another worker first; dropped this copy.\n";
+    } else if (failure.empty()) {
+        const auto bytes = fs::file_size(output);
+        socket.sendLine("RESULT index=" + std::to_string(index) + " bytes=" + std::to_string(bytes));
+        icecale::sendFile(socket, output, bytes);
+        std::cout << "Sent segment " << index << " (" << formatBytes(bytes) << ") to the coordinator.\n";
+    } else {
+        std::cerr << "Error: " << failure << "\n";
+        std::replace(failure.begin(), failure.end(), '\n', ' ');
+        std::replace(failure.begin(), failure.end(), '\r', ' ');
+        socket.sendLine("FAILED index=" + std::to_string(index));
+        socket.sendLine(failure);
+    }
+    std::error_code ec;
+    fs::remove_all(dir, ec);
+}
+
+// --worker: takes segments from the coordinator until it has none left, then reconnects for the next job of its queue.
+// Gives up once the coordinator has been unreachable for kPeerTimeoutSeconds, which is also how long a worker started
+// before its coordinator waits for it.
+int runWorker(UpscaleConfig& config) {
+    ResidentUpscalers resident;
+    std::vector<JobMetrics> metrics;
+    std::size_t completed = 0;
+    const std::string name = icecale::hostName();
+    for (bool first = true;; first = false) {
+        if (!first) {
+            // A coordinator that just finished a job takes a moment to stop listening or start the next one.
+            std::this_thread::sleep_for(std::chrono::seconds(kHeartbeatSeconds));
+        }
+        Socket socket;
+        const auto giveUp = std::chrono::steady_clock::now() + std::chrono::seconds(kPeerTimeoutSeconds);
+        while (!socket.valid()) {
+            try {
+                socket = Socket::connect(config.workerHost, config.workerPort);
+            } catch (const std::exception& ex) {
+                if (std::chrono::steady_clock::now() >= giveUp) {
+                    std::cout << ex.what() << "\nStopping after " << completed << " segment(s).\n";
+                    return 0;
+                }
+                std::this_thread::sleep_for(std::chrono::seconds(2));
+            }
+        }
+
+        std::cout << "Connected to coordinator " << socket.peer() << "\n";
+        try {
+            socket.setReceiveTimeout(kPeerTimeoutSeconds);
+            socket.sendLine("HELLO version=" + std::to_string(kProtocolVersion) + " name=" + name +
+                            " gpus=" + std::to_string(config.gpus.size()) +
+                            (config.token.empty() ? std::string() : " token=" + config.token));
+            std::string line;
+            while (socket.readLine(line)) {
+                const Message message = parseMessage(line);
+                // A cancel can cross the result of the segment it was for.
+                if (message.verb == "WAIT" || message.verb == "CANCEL") {
+                    continue;
+                }
+                if (message.verb == "REFUSED") {
+                    std::string reason;
+                    socket.readLine(reason);
+                    std::cerr << "The coordinator refused this worker: it " << reason << ".\n";
+                    return 1;
+                }
+                if (message.verb == "DONE") {
+                    std::cout << "The coordinator has no more segments for this job.\n";
+                    break;
+                }
+                if (message.verb != "SEGMENT") {
+                    throw std::runtime_error("unexpected message: " + line);
+                }
+                runRemoteSegment(config, resident, socket, message, metrics);
+                ++completed;
+            }
+        } catch (const std::exception& ex) {
+            std::cerr << "\nLost the coordinator: " << ex.what() << "\n";
+        }
+    }
+}
+
+// --serve API. Requests and responses are HTTP/1.1 with JSON bodies, one request per connection:
+//
+//   POST   /jobs       {"input": PATH, "output": PATH, "priority": N}  queue a job (output and priority optional)
+//   GET    /jobs       every job the server has seen
+//   GET    /jobs/ID    one job: status (queued, running, done, failed, canceled), GPU, frames done and expected
+//   DELETE /jobs/ID    cancel a job that has not started
+//   GET    /status     GPU workers (starting, ready or failed) and queue length
+//
+// Higher priorities run first, and jobs of equal priority in the order they were submitted.
+constexpr std::size_t kMaxRequestBytes = 64 * 1024;
+// A client that stops sending in the middle of a request is dropped after this long.
+constexpr int kRequestTimeoutSeconds = 10;
+
+struct HttpRequest {
+    std::string method;
+    std::string path;
+    std::string body;
+};
+
+struct HttpResponse {
+    int status = 200;
+    std::string body;
+};
+
+void appendUtf8(std::string& out, unsigned code) {
+    if (code < 0x80) {
+        out += static_cast<char>(code);
+    } else if (code < 0x800) {
+        out += static_cast<char>(0xc0 | (code >> 6));
+        out += static_cast<char>(0x80 | (code & 0x3f));
+    } else {
+        out += static_cast<char>(0xe0 | (code >> 12));
+        out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (code & 0x3f));
+    }
+}
+
+// Parses a flat JSON object. String values are unescaped; numbers, true, false and null are kept as their text.
+std::map<std::string, std::string> parseJsonObject(const std::string& text) {
+    std::size_t pos = 0;
+    auto fail = [&](const std::string& what) -> std::runtime_error {
+        return std::runtime_error("Malformed JSON at offset " + std::to_string(pos) + ": " + what);
+    };
+    auto skipSpace = [&] {
+        while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) {
+            ++pos;
+        }
+    };
+    auto expect = [&](char c) {
+        skipSpace();
+        if (pos >= text.size() || text[pos] != c) {
+            throw fail(std::string("expected '") + c + "'");
+        }
+        ++pos;
+    };
+    auto parseString = [&] {
+        expect('"');
+        std::string value;
+        while (pos < text.size() && text[pos] != '"') {
+            char c = text[pos++];
+            if (c != '\\') {
+                value += c;
+                continue;
+            }
+            if (pos >= text.size()) {
+                break;
+            }
+            c = text[pos++];
+            switch (c) {
+                case 'b': value += '\b'; break;
+                case 'f': value += '\f'; break;
+                case 'n': value += '\n'; break;
+                case 'r': value += '\r'; break;
+                case 't': value += '\t'; break;
+                case 'u': {
+                    if (pos + 4 > text.size()) {
+                        throw fail("short \\u escape");
+                    }
+                    unsigned code = 0;
+                    for (int i = 0; i < 4; ++i) {
+                        const char digit = text[pos++];
+                        if (!std::isxdigit(static_cast<unsigned char>(digit))) {
+                            throw fail("bad \\u escape");
+                        }
+                        code = code * 16 + static_cast<unsigned>(std::isdigit(static_cast<unsigned char>(digit))
+                                                                     ? digit - '0'
+                                                                     : std::tolower(digit) - 'a' + 10);
+                    }
+                    appendUtf8(value, code);
+                    break;
+                }
+                default: value += c; break;
+            }
+        }
+        if (pos >= text.size()) {
+            throw fail("unterminated string");
+        }
+        ++pos;
+        return value;
+    };
+
+    std::map<std::string, std::string> fields;
+    expect('{');
+    skipSpace();
+    if (pos < text.size() && text[pos] == '}') {
+        ++pos;
+    } else {
+        while (true) {
+            skipSpace();
+            const std::string key = parseString();
+            expect(':');
+            skipSpace();
+            if (pos < text.size() && text[pos] == '"') {
+                fields[key] = parseString();
+            } else {
+                const std::size_t start = pos;
+                while (pos < text.size() && (std::isalnum(static_cast<unsigned char>(text[pos])) ||
+                                             text[pos] == '-' || text[pos] == '+' || text[pos] == '.')) {
+                    ++pos;
+                }
+                if (pos == start) {
+                    throw fail("expected a string, number or literal (nested values are not supported)");
+                }
+                fields[key] = text.substr(start, pos - start);
+            }
+            skipSpace();
+            if (pos < text.size() && text[pos] == ',') {
+                ++pos;
+                continue;
+            }
+            expect('}');
+            break;
+        }
+    }
+    skipSpace();
+    if (pos != text.size()) {
+        throw fail("trailing characters");
+    }
+    return fields;
+}
+
+// Reads one request; false when the client closed the connection without sending one.
+bool readHttpRequest(Socket& socket, HttpRequest& request) {
+    std::string line;
+    if (!socket.readLine(line)) {
+        return false;
+    }
+    if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+    }
+    std::istringstream requestLine(line);
+    std::string version;
+    requestLine >> request.method >> request.path >> version;
+    if (request.method.empty() || request.path.empty() || version.compare(0, 5, "HTTP/") != 0) {
+        throw std::runtime_error("Malformed request line: " + line);
+    }
+    request.path = request.path.substr(0, request.path.find('?'));
+
+    std::size_t length = 0;
+    std::size_t headerBytes = 0;
+    while (true) {
+        if (!socket.readLine(line)) {
+            throw std::runtime_error("Connection closed in the request headers.");
+        }
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            break;
+        }
+        headerBytes += line.size();
+        if (headerBytes > kMaxRequestBytes) {
+            throw std::runtime_error("Request headers are too large.");
+        }
+        const auto colon = line.find(':');
+        std::string name = line.substr(0, colon);
+        std::transform(name.begin(), name.end(), name.begin(),
+                       [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        if (colon != std::string::npos && name == "content-length") {
+            length = static_cast<std::size_t>(std::max(0LL, safeParseLong(trim(line.substr(colon + 1)))));
+        }
+    }
+    if (length > kMaxRequestBytes) {
+        throw std::runtime_error("Request body is too large.");
+    }
+    request.body.resize(length);
+    if (length > 0) {
+        socket.readExactly(request.body.data(), length);
+    }
+    return true;
+}
+
+void sendHttpResponse(Socket& socket, const HttpResponse& response) {
+    static const std::map<int, std::string> reasons = {{200, "OK"},          {201, "Created"},
+                                                       {400, "Bad Request"}, {404, "Not Found"},
+                                                       {405, "Method Not Allowed"}, {409, "Conflict"},
+                                                       {503, "Service Unavailable"}};
+    auto reason = reasons.find(response.status);
+    std::string message = "HTTP/1.1 " + std::to_string(response.status) + " " +
+                          (reason != reasons.end() ? reason->second : std::string("Error")) +
+                          "\r\nContent-Type: application/json\r\nContent-Length: " +
+                          std::to_string(response.body.size()) + "\r\nConnection: close\r\n\r\n" + response.body;
+    socket.sendAll(message.data(), message.size());
+}
+
+HttpResponse jsonError(int status, const std::string& message) {
+    return {status, "{\"error\": " + jsonString(message) + "}\n"};
+}
+
+// A job submitted to --serve, from the queue to its result.
+struct ServedJob {
+    std::size_t id{};
+    UpscaleJob job;
+    int priority = 0;
+    std::int64_t submittedAt{};
+    // Guarded by the server's mutex.
+    std::string status = "queued";
+    int gpu = -1;
+    std::string error;
+    std::chrono::steady_clock::time_point started;
+    double seconds = 0.0;
+    // Updated by the running job; read by status requests without the lock.
+    PipelineMeters meters;
+    // Only touched by the worker running the job, and read once the job has finished.
+    JobMetrics metrics;
+};
+
+// --serve: keeps one worker thread per GPU, each with its own resident engine loaded at startup and its own copy of
+// the configuration, taking jobs from a shared priority queue. Tools, GPUs and encoders were checked once in main(),
+// so a job starts with probing its input.
+class JobServer {
+public:
+    explicit JobServer(const UpscaleConfig& config) : config_(config) {}
+
+    // Runs the workers and answers requests until the process is stopped.
+    [[noreturn]] void run() {
+        Socket listener = Socket::listen(config_.servePort, true);
+        for (const auto& job : config_.jobs) {
+            submit(job, 0);
+        }
+        for (int gpu : config_.gpus) {
+            workers_[gpu];
+        }
+        for (int gpu : config_.gpus) {
+            std::thread([this, gpu] { work(gpu); }).detach();
+        }
+        std::cout << "Serving the job API on http://" << listener.peer() << " with " << config_.gpus.size()
+                  << " GPU worker(s).\n";
+        while (true) {
+            Socket client;
+            try {
+                client = listener.accept();
+            } catch (const std::exception& ex) {
+                std::cerr << "Accept failed: " << ex.what() << "\n";
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                continue;
+            }
+            try {
+                client.setReceiveTimeout(kRequestTimeoutSeconds);
+                HttpRequest request;
+                if (!readHttpRequest(client, request)) {
+                    continue;
+                }
+                sendHttpResponse(client, handle(request));
+            } catch (const std::exception& ex) {
+                try {
+                    sendHttpResponse(client, jsonError(400, ex.what()));
+                } catch (const std::exception&) {
+                    // The client is gone.
+                }
+            }
+        }
+    }
+
+private:
+    HttpResponse handle(const HttpRequest& request) {
+        const std::string prefix = "/jobs/";
+        if (request.path == "/status") {
+            if (request.method != "GET") {
+                return jsonError(405, "Use GET for /status.");
+            }
+            return {200, statusJson()};
+        }
+        if (request.path == "/jobs") {
+            if (request.method == "GET") {
+                return {200, jobsJson()};
+            }
+            if (request.method == "POST") {
+                return create(request.body);
+            }
+            return jsonError(405, "Use GET or POST for /jobs.");
+        }
+        if (request.path.compare(0, prefix.size(), prefix) == 0) {
+            const std::string id = request.path.substr(prefix.size());
+            if (id.empty() || !std::all_of(id.begin(), id.end(), [](unsigned char c) { return std::isdigit(c); })) {
+                return jsonError(404, "No such job.");
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = jobs_.find(static_cast<std::size_t>(safeParseLong(id)));
+            if (it == jobs_.end()) {
+                return jsonError(404, "No such job.");
+            }
+            ServedJob& job = *it->second;
+            if (request.method == "GET") {
+                return {200, jobJson(job) + "\n"};
+            }
+            if (request.method == "DELETE") {
+                if (job.status != "queued") {
+                    return jsonError(409, "Job " + id + " is " + job.status + "; only queued jobs can be canceled.");
+                }
+                queue_.erase({-job.priority, job.id});
+                job.status = "canceled";
+                return {200, jobJson(job) + "\n"};
+            }
+            return jsonError(405, "Use GET or DELETE for /jobs/ID.");
+        }
+        return jsonError(404, "Unknown path " + request.path + ".");
+    }
+
+    HttpResponse create(const std::string& body) {
+        const auto fields = parseJsonObject(body);
+        auto field = [&](const std::string& key) {
+            auto it = fields.find(key);
+            return it == fields.end() ? std::string() : it->second;
+        };
+        if (field("input").empty()) {
+            return jsonError(400, "A job needs an \"input\" path.");
+        }
+        UpscaleJob job;
+        job.input = fs::absolute(fs::path(field("input"))).lexically_normal();
+        if (!fs::exists(job.input)) {
+            return jsonError(400, "Input file does not exist: " + job.input.string());
+        }
+        job.output = field("output").empty() ? defaultOutputPath(config_.outputDir, job.input)
+                                             : fs::absolute(fs::path(field("output"))).lexically_normal();
+        int priority = 0;
+        if (!field("priority").empty()) {
+            try {
+                priority = std::stoi(field("priority"));
+            } catch (const std::exception&) {
+                return jsonError(400, "\"priority\" must be an integer.");
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (const std::string conflict = conflictLocked(job); !conflict.empty()) {
+            return jsonError(409, conflict);
+        }
+        if (liveWorkersLocked() == 0) {
+            return jsonError(503, "No GPU worker could start; see /status.");
+        }
+        return {201, jobJson(enqueue(job, priority)) + "\n"};
+    }
+
+    // Queues a job from the command line, unless it clashes with one queued before it.
+    void submit(const UpscaleJob& job, int priority) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (const std::string conflict = conflictLocked(job); !conflict.empty()) {
+            std::cerr << "Skipping " << job.input << ": " << conflict << "\n";
+            return;
+        }
+        enqueue(job, priority);
+    }
+
+    // Why job cannot run next to the queued and running jobs, or empty when it can. Caller holds mutex_.
+    std::string conflictLocked(const UpscaleJob& job) const {
+        for (const auto& [id, other] : jobs_) {
+            if (other->status != "queued" && other->status != "running") {
+                continue;
+            }
+            if (other->job.output == job.output) {
+                return "Job " + std::to_string(id) + " already writes " + job.output.string() + ".";
+            }
+            // Jobs on one input share a workspace, which only one of them can hold at a time.
+            if (other->job.input == job.input) {
+                return "Job " + std::to_string(id) + " already reads " + job.input.string() + ".";
+            }
+        }
+        return {};
+    }
+
+    // Caller holds mutex_.
+    std::size_t liveWorkersLocked() const {
+        return static_cast<std::size_t>(
+            std::count_if(workers_.begin(), workers_.end(), [](const auto& w) { return w.second.state != "failed"; }));
+    }
+
+    // Caller holds mutex_.
+    ServedJob& enqueue(const UpscaleJob& job, int priority) {
+        auto served = std::make_shared<ServedJob>();
+        served->id = nextId_++;
+        served->job = job;
+        served->priority = priority;
+        served->submittedAt = std::chrono::duration_cast<std::chrono::seconds>(
+                                  std::chrono::system_clock::now().time_since_epoch()).count();
+        served->metrics.input = job.input;
+        served->metrics.output = job.output;
+        jobs_[served->id] = served;
+        queue_.insert({-priority, served->id});
+        queued_.notify_one();
+        std::cout << "Queued job " << served->id << ": " << job.input << " (priority " << priority << ")\n";
+        return *served;
+    }
+
+    void work(int gpu) {
+        UpscaleConfig config = config_;
+        config.gpus = {gpu};
+        config.jobs.clear();
+        config.concurrentJobs = config_.gpus.size() > 1;
+        ResidentUpscalers resident;
+        // A worker that cannot load its engine or find realesrgan-ncnn-vulkan says so in /status and takes no jobs.
+        try {
+            std::vector<std::unique_ptr<FrameUpscaler>> none;
+            ScalePlan warm;
+            warm.model = config.models.front();
+            if ((config.forceExternal ? none : resident.acquire(config, warm)).empty()) {
+                if (config.realesrgan.empty()) {
+                    config.realesrgan = findTool(config.execDir, "realesrgan-ncnn-vulkan");
+                    requireCommand(config.realesrgan, "-h");
+                }
+            }
+        } catch (const std::exception& ex) {
+            std::cerr << "The worker for GPU " << gpu << " could not start: " << ex.what() << "\n";
+            std::lock_guard<std::mutex> lock(mutex_);
+            workers_[gpu] = {"failed", ex.what()};
+            // With no worker left, queued jobs would wait forever.
+            if (liveWorkersLocked() == 0) {
+                for (const auto& [priority, id] : queue_) {
+                    jobs_[id]->status = "failed";
+                    jobs_[id]->error = "No GPU worker could start; see /status.";
+                }
+                queue_.clear();
+            }
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            workers_[gpu].state = "ready";
+        }
+
+        while (true) {
+            std::shared_ptr<ServedJob> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                queued_.wait(lock, [&] { return !queue_.empty(); });
+                job = jobs_.at(queue_.begin()->second);
+                queue_.erase(queue_.begin());
+                job->status = "running";
+                job->gpu = gpu;
+                job->started = std::chrono::steady_clock::now();
+            }
+            std::cout << "\nJob " << job->id << " on GPU " << gpu << ": " << job->job.input << "\n";
+            fs::path workspace;
+            try {
+                runJob(config, job->job, resident, workspace, job->metrics, &job->meters);
+                job->metrics.succeeded = true;
+            } catch (const std::exception& ex) {
+                std::cerr << "Job " << job->id << " failed: " << ex.what() << "\n";
+                job->metrics.error = ex.what();
+                job->metrics.lap("failed");
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            job->status = job->metrics.succeeded ? "done" : "failed";
+            job->error = job->metrics.error;
+            if (!job->metrics.succeeded && !workspace.empty()) {
+                job->error += " (workspace kept at " + workspace.string() + ")";
+            }
+            job->seconds = job->metrics.seconds();
+            finished_.push_back(job->metrics);
+            if (!config.metricsJson.empty()) {
+                try {
+                    writeMetricsJson(config.metricsJson, finished_);
+                } catch (const std::exception& ex) {
+                    std::cerr << "Warning: " << ex.what() << "\n";
+                }
+            }
+        }
+    }
+
+    // Caller holds mutex_.
+    std::string jobJson(const ServedJob& job) const {
+        const std::size_t done = job.meters.encode.frames();
+        const std::size_t expected = std::max<std::size_t>(job.meters.expectedFrames, done);
+        double seconds = job.seconds;
+        if (job.status == "running") {
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - job.started).count();
+        }
+        double progress = expected > 0 ? static_cast<double>(done) / expected : 0.0;
+        if (job.status == "done") {
+            progress = 1.0;
+        }
+        std::ostringstream json;
+        json << std::fixed << std::setprecision(3) << "{\"id\": " << job.id << ", \"status\": "
+             << jsonString(job.status) << ", \"priority\": " << job.priority
+             << ", \"input\": " << jsonString(job.job.input.string())
+             << ", \"output\": " << jsonString(job.job.output.string()) << ", \"gpu\": " << job.gpu
+             << ", \"submitted_at\": " << job.submittedAt << ", \"frames_done\": " << done
+             << ", \"frames_expected\": " << expected << ", \"progress\": " << progress
+             << ", \"fps\": " << job.meters.encode.fps() << ", \"seconds\": " << seconds
+             << ", \"error\": " << jsonString(job.error) << "}";
+        return json.str();
+    }
+
+    std::string jobsJson() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string json = "{\"jobs\": [";
+        for (const auto& [id, job] : jobs_) {
+            json += (id == jobs_.begin()->first ? "\n  " : ",\n  ") + jobJson(*job);
+        }
+        return json + "\n]}\n";
+    }
+
+    std::string statusJson() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::size_t running = 0;
+        for (const auto& [id, job] : jobs_) {
+            running += job->status == "running" ? 1 : 0;
+        }
+        std::string gpus;
+        std::string workers;
+        for (int gpu : config_.gpus) {
+            gpus += (gpus.empty() ? "" : ", ") + std::to_string(gpu);
+            const WorkerState& worker = workers_.at(gpu);
+            workers += std::string(workers.empty() ? "" : ", ") + "{\"gpu\": " + std::to_string(gpu) +
+                       ", \"state\": " + jsonString(worker.state) + ", \"error\": " + jsonString(worker.error) + "}";
+        }
+        return "{\"gpus\": [" + gpus + "], \"workers\": [" + workers + "], \"queued\": " +
+               std::to_string(queue_.size()) + ", \"running\": " + std::to_string(running) +
+               ", \"jobs\": " + std::to_string(jobs_.size()) + "}\n";
+    }
+
+    struct WorkerState {
+        std::string state = "starting";
+        std::string error;
+    };
+
+    const UpscaleConfig config_;
+    mutable std::mutex mutex_;
+    std::condition_variable queued_;
+    // One per GPU, filled in before the workers start.
+    std::map<int, WorkerState> workers_;
+    std::map<std::size_t, std::shared_ptr<ServedJob>> jobs_;
+    // Ordered by descending priority, then by submission.
+    std::set<std::pair<int, std::size_t>> queue_;
+    std::size_t nextId_ = 1;
+    std::vector<JobMetrics> finished_;
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    try {
+        auto config = parseArgs(argc, argv);
+
+        // Verified once for the whole queue. A coordinator only cuts and joins segments, so it needs no GPU.
+        std::cout << "Verifying environment...\n";
+        if (config.coordinatorPort == 0) {
+            config.detectedGpus = requireNvidiaGpu();
+            config.gpus = selectGpus(config.detectedGpus, config.requestedGpus);
+        }
+        config.ffmpeg = findTool(config.execDir, "ffmpeg");
+        config.ffprobe = findTool(config.execDir, "ffprobe");
+        requireCommand(config.ffmpeg);
+        requireCommand(config.ffprobe);
+        requireEncoder(config.ffmpeg, config.encoder);
+        std::cout << "Encoder: " << config.encoder.encoder() << " (" << config.encoder.name << " profile"
+                  << (config.encoder.tenBit ? ", 10-bit" : "") << ")\n";
+        if (config.hwaccel.enabled && config.coordinatorPort == 0) {
+            config.hwaccel = detectHwAccel(config.ffmpeg);
+            std::cout << "Hardware decode and resize: NVDEC + " << config.hwaccel.scaler << "\n";
+        }
+        if (!config.workerHost.empty()) {
+            return runWorker(config);
+        }
+        if (config.servePort > 0) {
+            JobServer(config).run();
+        }
+
+        ResidentUpscalers resident;
+        std::vector<const UpscaleJob*> failed;
+        std::vector<JobMetrics> metrics;
+        for (std::size_t i = 0; i < config.jobs.size(); ++i) {
+            const auto& job = config.jobs[i];
+            if (config.jobs.size() > 1) {
+                std::cout << "\n[" << (i + 1) << "/" << config.jobs.size() << "] " << job.input << "\n";
+            }
+            // Set once the job owns a workspace, so a failure can point at what was kept for --resume.
+            fs::path workspace;
+            JobMetrics& jobMetrics = metrics.emplace_back();
+            jobMetrics.input = job.input;
+            jobMetrics.output = job.output;
+            try {
+                runJob(config, job, resident, workspace, jobMetrics);
+                jobMetrics.succeeded = true;
+            } catch (const std::exception& ex) {
+                std::cerr << "Error: " << ex.what() << "\n";
+                if (!workspace.empty()) {
+                    std::cerr << "Workspace kept at " << workspace << "; rerun with --resume to continue.\n";
+                }
+                failed.push_back(&job);
+                jobMetrics.error = ex.what();
+                jobMetrics.lap("failed");
+            }
+            // Rewritten after every job, so an interrupted queue still leaves the jobs it finished.
+            if (!config.metricsJson.empty()) {
+                writeMetricsJson(config.metricsJson, metrics);
+            }
+        }
+
+        if (config.jobs.size() > 1) {
+            std::cout << "\n" << (config.jobs.size() - failed.size()) << " of " << config.jobs.size()
+                      << " job(s) completed.\n";
+            for (const auto* job : failed) {
+                std::cout << "  failed: " << job->input << "\n";
+            }
+        }
+        return failed.empty() ? 0 : 1;
     } catch (const std::exception& ex) {
         std::cerr << "Error: " << ex.what() << "\n";
         return 1;
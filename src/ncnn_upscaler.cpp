@@ -0,0 +1,167 @@
+#include "ncnn_upscaler.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#include "gpu.h"
+#include "mat.h"
+#include "net.h"
+
+namespace icecale {
+
+namespace {
+
+// ncnn's Vulkan instance is process-wide; keep it alive while any engine exists so the device is initialised once.
+std::mutex gpuInstanceMutex;
+int gpuInstanceUsers = 0;
+
+void acquireGpuInstance() {
+    std::lock_guard<std::mutex> lock(gpuInstanceMutex);
+    if (gpuInstanceUsers++ == 0) {
+        ncnn::create_gpu_instance();
+    }
+}
+
+void releaseGpuInstance() {
+    std::lock_guard<std::mutex> lock(gpuInstanceMutex);
+    if (--gpuInstanceUsers == 0) {
+        ncnn::destroy_gpu_instance();
+    }
+}
+
+// Mirrors the heap-budget table realesrgan-ncnn-vulkan uses when -t is left at auto.
+int defaultTileSize(int gpuIndex) {
+    const std::uint32_t heapBudget = ncnn::get_gpu_device(gpuIndex)->get_heap_budget();
+    if (heapBudget > 1900) {
+        return 200;
+    }
+    if (heapBudget > 550) {
+        return 100;
+    }
+    if (heapBudget > 190) {
+        return 64;
+    }
+    return 32;
+}
+
+class NcnnUpscaler final : public FrameUpscaler {
+public:
+    NcnnUpscaler(const NcnnModelFiles& model, int gpuIndex, int tileSize) : scale_(model.scale), gpuIndex_(gpuIndex) {
+        acquireGpuInstance();
+        try {
+            if (gpuIndex < 0 || gpuIndex >= ncnn::get_gpu_count()) {
+                throw std::runtime_error("Vulkan device " + std::to_string(gpuIndex) + " is not available to ncnn.");
+            }
+
+            net_.opt.use_vulkan_compute = true;
+            net_.opt.use_fp16_packed = model.precision != Precision::Fp32;
+            net_.opt.use_fp16_storage = model.precision != Precision::Fp32;
+            net_.opt.use_fp16_arithmetic = model.precision == Precision::Fp16;
+            net_.opt.use_int8_storage = model.precision != Precision::Fp32;
+            // Quantized layers only run as int8 when asked for; float models are unaffected either way.
+            net_.opt.use_int8_inference = model.precision == Precision::Int8;
+            net_.set_vulkan_device(gpuIndex);
+
+            if (net_.load_param(model.param.string().c_str()) != 0) {
+                throw std::runtime_error("Failed to load ncnn model params: " + model.param.string());
+            }
+            if (net_.load_model(model.bin.string().c_str()) != 0) {
+                throw std::runtime_error("Failed to load ncnn model weights: " + model.bin.string());
+            }
+
+            setTileSize(tileSize);
+        } catch (...) {
+            net_.clear();
+            releaseGpuInstance();
+            throw;
+        }
+    }
+
+    ~NcnnUpscaler() override {
+        net_.clear();
+        releaseGpuInstance();
+    }
+
+    int scale() const override { return scale_; }
+
+    void setTileSize(int tileSize) override { tileSize_ = tileSize > 0 ? tileSize : defaultTileSize(gpuIndex_); }
+
+    void upscale(const RgbFrame& input, RgbFrame& output) override {
+        upscaleRegion(input, 0, 0, input.width, input.height, output);
+    }
+
+    void upscaleRegion(const RgbFrame& input, int x, int y, int w, int h, RgbFrame& output) override {
+        if (x < 0 || y < 0 || w <= 0 || h <= 0 || x + w > input.width || y + h > input.height) {
+            throw std::runtime_error("Upscale region lies outside the frame.");
+        }
+        output.width = w * scale_;
+        output.height = h * scale_;
+        output.pixels.resize(static_cast<std::size_t>(output.width) * output.height * 3);
+
+        for (int ty = y; ty < y + h; ty += tileSize_) {
+            for (int tx = x; tx < x + w; tx += tileSize_) {
+                upscaleTile(input, output, x, y, tx, ty, std::min(tileSize_, x + w - tx),
+                            std::min(tileSize_, y + h - ty));
+            }
+        }
+    }
+
+private:
+    // Each tile is inferred with a few pixels of surrounding context, which are cut away again after upscaling so
+    // neighbouring tiles meet without seams. The tile lands in output relative to the region origin (originX, originY).
+    void upscaleTile(const RgbFrame& input, RgbFrame& output, int originX, int originY, int x, int y, int w, int h) {
+        const int padLeft = std::min(kPrepadding, x);
+        const int padTop = std::min(kPrepadding, y);
+        const int padRight = std::min(kPrepadding, input.width - (x + w));
+        const int padBottom = std::min(kPrepadding, input.height - (y + h));
+
+        const int regionWidth = w + padLeft + padRight;
+        const int regionHeight = h + padTop + padBottom;
+        const std::size_t inStride = static_cast<std::size_t>(input.width) * 3;
+        const unsigned char* regionStart =
+            input.pixels.data() + static_cast<std::size_t>(y - padTop) * inStride + static_cast<std::size_t>(x - padLeft) * 3;
+
+        ncnn::Mat in = ncnn::Mat::from_pixels(regionStart, ncnn::Mat::PIXEL_RGB, regionWidth, regionHeight,
+                                              static_cast<int>(inStride));
+        const float normalize[3] = {1 / 255.f, 1 / 255.f, 1 / 255.f};
+        in.substract_mean_normalize(nullptr, normalize);
+
+        ncnn::Mat out;
+        {
+            ncnn::Extractor ex = net_.create_extractor();
+            ex.input("data", in);
+            if (ex.extract("output", out) != 0) {
+                throw std::runtime_error("ncnn inference failed.");
+            }
+        }
+
+        const float denormalize[3] = {255.f, 255.f, 255.f};
+        out.substract_mean_normalize(nullptr, denormalize);
+
+        ncnn::Mat cropped;
+        ncnn::copy_cut_border(out, cropped, padTop * scale_, padBottom * scale_, padLeft * scale_, padRight * scale_);
+
+        const std::size_t outStride = static_cast<std::size_t>(output.width) * 3;
+        unsigned char* dst = output.pixels.data() + static_cast<std::size_t>((y - originY) * scale_) * outStride +
+                             static_cast<std::size_t>((x - originX) * scale_) * 3;
+        cropped.to_pixels(dst, ncnn::Mat::PIXEL_RGB, static_cast<int>(outStride));
+    }
+
+    static constexpr int kPrepadding = 10;
+
+    ncnn::Net net_;
+    int scale_;
+    int gpuIndex_;
+    int tileSize_ = 0;
+};
+
+}  // namespace
+
+std::unique_ptr<FrameUpscaler> createNcnnUpscaler(const NcnnModelFiles& model, int gpuIndex, int tileSize) {
+    return std::make_unique<NcnnUpscaler>(model, gpuIndex, tileSize);
+}
+
+}  // namespace icecale
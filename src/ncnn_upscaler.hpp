@@ -0,0 +1,22 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+
+#include "upscaler.hpp"
+
+namespace icecale {
+
+struct NcnnModelFiles {
+    std::filesystem::path param;
+    std::filesystem::path bin;
+    int scale = 4;
+    Precision precision = Precision::Mixed;
+};
+
+// Loads a Real-ESRGAN ncnn model (or another model with the same "data" / "output" blobs) onto one Vulkan device.
+// tileSize 0 picks a tile from the device heap budget, the same way realesrgan-ncnn-vulkan does. Throws
+// std::runtime_error when no usable device or model is found.
+std::unique_ptr<FrameUpscaler> createNcnnUpscaler(const NcnnModelFiles& model, int gpuIndex, int tileSize);
+
+}  // namespace icecale
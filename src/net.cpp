@@ -0,0 +1,424 @@
+#include "net.hpp"
+
+#include "process.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+namespace icecale {
+
+namespace {
+
+#ifdef _WIN32
+using NativeSocket = SOCKET;
+const std::intptr_t kInvalidHandle = static_cast<std::intptr_t>(INVALID_SOCKET);
+
+// Winsock is initialised once for the process and left running until it exits.
+void startNetworking() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        WSADATA data;
+        if (WSAStartup(MAKEWORD(2, 2), &data) != 0) {
+            throw std::runtime_error("Failed to initialise Winsock.");
+        }
+    });
+}
+
+std::string lastError() {
+    return "error " + std::to_string(WSAGetLastError());
+}
+
+void closeNative(NativeSocket s) {
+    closesocket(s);
+}
+#else
+using NativeSocket = int;
+const std::intptr_t kInvalidHandle = -1;
+
+void startNetworking() {}
+
+std::string lastError() {
+    return std::strerror(errno);
+}
+
+void closeNative(NativeSocket s) {
+    ::close(s);
+}
+#endif
+
+NativeSocket native(std::intptr_t handle) {
+    return static_cast<NativeSocket>(handle);
+}
+
+std::string describeAddress(const sockaddr* address, socklen_t length) {
+    char host[NI_MAXHOST] = "?";
+    char service[NI_MAXSERV] = "?";
+    getnameinfo(address, length, host, sizeof(host), service, sizeof(service), NI_NUMERICHOST | NI_NUMERICSERV);
+    return std::string(host) + ":" + service;
+}
+
+// Sockets are kept out of child processes: an inherited connection would stay open after this process closed it, so
+// the peer would never see it end. Where the socket cannot be created close-on-exec in one call, it is created and
+// marked under the lock Process spawns under.
+#ifdef SOCK_CLOEXEC
+NativeSocket openSocket(int family, int type, int protocol) {
+    return ::socket(family, type | SOCK_CLOEXEC, protocol);
+}
+
+NativeSocket acceptSocket(NativeSocket listener, sockaddr* address, socklen_t* length) {
+    return ::accept4(listener, address, length, SOCK_CLOEXEC);
+}
+#else
+void keepFromChildren(NativeSocket s) {
+    if (static_cast<std::intptr_t>(s) == kInvalidHandle) {
+        return;
+    }
+#ifdef _WIN32
+    SetHandleInformation(reinterpret_cast<HANDLE>(s), HANDLE_FLAG_INHERIT, 0);
+#else
+    ::fcntl(s, F_SETFD, FD_CLOEXEC);
+#endif
+}
+
+NativeSocket openSocket(int family, int type, int protocol) {
+    std::lock_guard<std::mutex> lock(spawnMutex());
+    const NativeSocket s = ::socket(family, type, protocol);
+    keepFromChildren(s);
+    return s;
+}
+
+NativeSocket acceptSocket(NativeSocket listener, sockaddr* address, socklen_t* length) {
+    std::lock_guard<std::mutex> lock(spawnMutex());
+    const NativeSocket s = ::accept(listener, address, length);
+    keepFromChildren(s);
+    return s;
+}
+#endif
+
+// Frames and segment files are sent in large writes; without this the last partial packet of every protocol line
+// would wait for Nagle's timer.
+void disableNagle(NativeSocket s) {
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&one), sizeof(one));
+}
+
+}  // namespace
+
+Socket::Socket(std::intptr_t handle, std::string peer) : handle_(handle), peer_(std::move(peer)) {}
+
+Socket::~Socket() {
+    close();
+}
+
+Socket::Socket(Socket&& other) noexcept
+    : handle_(other.handle_), peer_(std::move(other.peer_)), buffer_(std::move(other.buffer_)) {
+    other.handle_ = kInvalidHandle;
+}
+
+Socket& Socket::operator=(Socket&& other) noexcept {
+    if (this != &other) {
+        close();
+        handle_ = other.handle_;
+        peer_ = std::move(other.peer_);
+        buffer_ = std::move(other.buffer_);
+        other.handle_ = kInvalidHandle;
+    }
+    return *this;
+}
+
+Socket Socket::connect(const std::string& host, int port) {
+    startNetworking();
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if (int rc = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses); rc != 0) {
+        throw std::runtime_error("Cannot resolve " + host + ": " + gai_strerror(rc));
+    }
+
+    std::string reason = "no address";
+    for (addrinfo* a = addresses; a; a = a->ai_next) {
+        NativeSocket s = openSocket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (static_cast<std::intptr_t>(s) == kInvalidHandle) {
+            reason = lastError();
+            continue;
+        }
+        if (::connect(s, a->ai_addr, static_cast<socklen_t>(a->ai_addrlen)) != 0) {
+            reason = lastError();
+            closeNative(s);
+            continue;
+        }
+        disableNagle(s);
+        Socket connected(static_cast<std::intptr_t>(s),
+                         describeAddress(a->ai_addr, static_cast<socklen_t>(a->ai_addrlen)));
+        freeaddrinfo(addresses);
+        return connected;
+    }
+    freeaddrinfo(addresses);
+    throw std::runtime_error("Cannot connect to " + host + ":" + std::to_string(port) + ": " + reason);
+}
+
+Socket Socket::listen(int port, bool loopbackOnly) {
+    startNetworking();
+    // An IPv6 socket with V6ONLY off takes IPv4 connections too; hosts without IPv6 fall back to IPv4 only. A
+    // loopback-only socket is plain IPv4 on 127.0.0.1, which every local client can reach.
+    NativeSocket s = loopbackOnly ? static_cast<NativeSocket>(kInvalidHandle) : openSocket(AF_INET6, SOCK_STREAM, 0);
+    bool ipv6 = static_cast<std::intptr_t>(s) != kInvalidHandle;
+    if (!ipv6) {
+        s = openSocket(AF_INET, SOCK_STREAM, 0);
+        if (static_cast<std::intptr_t>(s) == kInvalidHandle) {
+            throw std::runtime_error("Cannot create a socket: " + lastError());
+        }
+    }
+    int one = 1;
+    int zero = 0;
+    // Lets a coordinator restarted for the next job rebind the port while old connections linger in TIME_WAIT.
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&one), sizeof(one));
+
+    int rc = 0;
+    if (ipv6) {
+        setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<const char*>(&zero), sizeof(zero));
+        sockaddr_in6 address{};
+        address.sin6_family = AF_INET6;
+        address.sin6_addr = in6addr_any;
+        address.sin6_port = htons(static_cast<unsigned short>(port));
+        rc = ::bind(s, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+    } else {
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(loopbackOnly ? INADDR_LOOPBACK : INADDR_ANY);
+        address.sin_port = htons(static_cast<unsigned short>(port));
+        rc = ::bind(s, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+    }
+    if (rc != 0 || ::listen(s, 16) != 0) {
+        const std::string reason = lastError();
+        closeNative(s);
+        throw std::runtime_error("Cannot listen on port " + std::to_string(port) + ": " + reason);
+    }
+    return Socket(static_cast<std::intptr_t>(s), (loopbackOnly ? "127.0.0.1:" : "*:") + std::to_string(port));
+}
+
+bool Socket::valid() const {
+    return handle_ != kInvalidHandle;
+}
+
+bool Socket::waitReadable(int timeoutMs) {
+    if (!buffer_.empty()) {
+        return true;
+    }
+#ifdef _WIN32
+    WSAPOLLFD fd{native(handle_), POLLRDNORM, 0};
+    const int rc = WSAPoll(&fd, 1, timeoutMs);
+#else
+    pollfd fd{native(handle_), POLLIN, 0};
+    const int rc = ::poll(&fd, 1, timeoutMs);
+#endif
+    if (rc < 0) {
+#ifndef _WIN32
+        if (errno == EINTR) {
+            return false;
+        }
+#endif
+        throw std::runtime_error("Waiting on " + peer_ + " failed: " + lastError());
+    }
+    return rc > 0;
+}
+
+Socket Socket::accept() {
+    sockaddr_storage address{};
+    socklen_t length = sizeof(address);
+    NativeSocket s = acceptSocket(native(handle_), reinterpret_cast<sockaddr*>(&address), &length);
+    if (static_cast<std::intptr_t>(s) == kInvalidHandle) {
+        throw std::runtime_error("Accepting a connection failed: " + lastError());
+    }
+    disableNagle(s);
+    return Socket(static_cast<std::intptr_t>(s), describeAddress(reinterpret_cast<const sockaddr*>(&address), length));
+}
+
+void Socket::setReceiveTimeout(int seconds) {
+#ifdef _WIN32
+    DWORD timeout = static_cast<DWORD>(seconds) * 1000;
+#else
+    timeval timeout{};
+    timeout.tv_sec = seconds;
+#endif
+    setsockopt(native(handle_), SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+}
+
+void Socket::sendAll(const void* data, std::size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+#ifdef MSG_NOSIGNAL
+    // A peer that went away must fail the send, not raise SIGPIPE and end the process.
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0;
+#endif
+    while (size > 0) {
+        const int chunk = static_cast<int>(std::min<std::size_t>(size, 1 << 20));
+        const auto sent = ::send(native(handle_), bytes, chunk, flags);
+        if (sent <= 0) {
+#ifndef _WIN32
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+#endif
+            throw std::runtime_error("Sending to " + peer_ + " failed: " + lastError());
+        }
+        bytes += sent;
+        size -= static_cast<std::size_t>(sent);
+    }
+}
+
+void Socket::sendLine(const std::string& line) {
+    const std::string framed = line + "\n";
+    sendAll(framed.data(), framed.size());
+}
+
+std::size_t Socket::receiveSome(char* data, std::size_t size) {
+    for (;;) {
+        const auto received = ::recv(native(handle_), data, static_cast<int>(std::min<std::size_t>(size, 1 << 20)), 0);
+        if (received >= 0) {
+            return static_cast<std::size_t>(received);
+        }
+#ifdef _WIN32
+        const bool timedOut = WSAGetLastError() == WSAETIMEDOUT;
+#else
+        if (errno == EINTR) {
+            continue;
+        }
+        const bool timedOut = errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+        throw std::runtime_error(timedOut ? peer_ + " stopped responding."
+                                          : "Receiving from " + peer_ + " failed: " + lastError());
+    }
+}
+
+bool Socket::readLine(std::string& line) {
+    // Protocol lines are short; anything this long is not a peer speaking the protocol.
+    constexpr std::size_t kMaxLine = 64 * 1024;
+    std::size_t scanned = 0;
+    for (;;) {
+        if (auto newline = buffer_.find('\n', scanned); newline != std::string::npos) {
+            line = buffer_.substr(0, newline);
+            buffer_.erase(0, newline + 1);
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            return true;
+        }
+        if (buffer_.size() > kMaxLine) {
+            throw std::runtime_error(peer_ + " sent an over-long line.");
+        }
+        scanned = buffer_.size();
+        char chunk[4096];
+        const std::size_t received = receiveSome(chunk, sizeof(chunk));
+        if (received == 0) {
+            if (buffer_.empty()) {
+                return false;
+            }
+            throw std::runtime_error(peer_ + " closed the connection mid-line.");
+        }
+        buffer_.append(chunk, received);
+    }
+}
+
+void Socket::readExactly(void* data, std::size_t size) {
+    char* bytes = static_cast<char*>(data);
+    const std::size_t buffered = std::min(size, buffer_.size());
+    std::memcpy(bytes, buffer_.data(), buffered);
+    buffer_.erase(0, buffered);
+    bytes += buffered;
+    size -= buffered;
+    while (size > 0) {
+        const std::size_t received = receiveSome(bytes, size);
+        if (received == 0) {
+            throw std::runtime_error(peer_ + " closed the connection mid-transfer.");
+        }
+        bytes += received;
+        size -= received;
+    }
+}
+
+void Socket::shutdown() {
+    if (valid()) {
+#ifdef _WIN32
+        ::shutdown(native(handle_), SD_BOTH);
+#else
+        ::shutdown(native(handle_), SHUT_RDWR);
+#endif
+    }
+}
+
+void Socket::close() {
+    if (valid()) {
+        closeNative(native(handle_));
+        handle_ = kInvalidHandle;
+    }
+    buffer_.clear();
+}
+
+void sendFile(Socket& socket, const std::filesystem::path& path, std::uintmax_t size) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Cannot read " + path.string());
+    }
+    std::vector<char> chunk(1 << 20);
+    while (size > 0) {
+        const auto want = static_cast<std::streamsize>(std::min<std::uintmax_t>(size, chunk.size()));
+        if (!in.read(chunk.data(), want)) {
+            throw std::runtime_error(path.string() + " is shorter than announced.");
+        }
+        socket.sendAll(chunk.data(), static_cast<std::size_t>(want));
+        size -= static_cast<std::uintmax_t>(want);
+    }
+}
+
+void receiveFile(Socket& socket, const std::filesystem::path& path, std::uintmax_t size) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error("Cannot write " + path.string());
+    }
+    std::vector<char> chunk(1 << 20);
+    while (size > 0) {
+        const auto want = static_cast<std::size_t>(std::min<std::uintmax_t>(size, chunk.size()));
+        socket.readExactly(chunk.data(), want);
+        out.write(chunk.data(), static_cast<std::streamsize>(want));
+        size -= want;
+    }
+    if (!out.flush()) {
+        throw std::runtime_error("Failed to write " + path.string());
+    }
+}
+
+std::string hostName() {
+    startNetworking();
+    char name[256] = {};
+    if (gethostname(name, sizeof(name) - 1) != 0 || name[0] == '\0') {
+        return "unknown";
+    }
+    return name;
+}
+
+}  // namespace icecale
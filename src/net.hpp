@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+namespace icecale {
+
+// A TCP connection (or listening socket) for the coordinator / worker protocol. Reads are buffered, so text lines and
+// binary payloads can follow each other on the same connection. Failures, a closed peer in the middle of a message and
+// receive timeouts all throw std::runtime_error.
+class Socket {
+public:
+    Socket() = default;
+    ~Socket();
+
+    Socket(Socket&& other) noexcept;
+    Socket& operator=(Socket&& other) noexcept;
+    Socket(const Socket&) = delete;
+    Socket& operator=(const Socket&) = delete;
+
+    // Connects to host:port, trying every address the name resolves to.
+    static Socket connect(const std::string& host, int port);
+    // Listens on every interface, or only on the loopback interface.
+    static Socket listen(int port, bool loopbackOnly = false);
+
+    bool valid() const;
+    // "host:port" of the other end.
+    const std::string& peer() const { return peer_; }
+
+    // Waits up to timeoutMs for a connection (or for data); false when none arrived in time.
+    bool waitReadable(int timeoutMs);
+    Socket accept();
+
+    // Blocking reads give up after this many seconds without data; 0 waits forever.
+    void setReceiveTimeout(int seconds);
+
+    void sendAll(const void* data, std::size_t size);
+    // Sends line followed by '\n'.
+    void sendLine(const std::string& line);
+    // Reads up to the next '\n', which is not included. Returns false when the peer closed the connection cleanly
+    // before sending anything more.
+    bool readLine(std::string& line);
+    void readExactly(void* data, std::size_t size);
+
+    // Stops further sends and receives, waking a thread blocked on this socket; safe to call from any thread.
+    void shutdown();
+    void close();
+
+private:
+    Socket(std::intptr_t handle, std::string peer);
+    std::size_t receiveSome(char* data, std::size_t size);
+
+    std::intptr_t handle_ = -1;
+    std::string peer_;
+    // Received but not yet consumed.
+    std::string buffer_;
+};
+
+// Sends the contents of path, which the receiver expects to be exactly size bytes long.
+void sendFile(Socket& socket, const std::filesystem::path& path, std::uintmax_t size);
+// Receives size bytes into path, replacing it.
+void receiveFile(Socket& socket, const std::filesystem::path& path, std::uintmax_t size);
+
+// Name of this machine, for telling workers apart in the coordinator's log.
+std::string hostName();
+
+}  // namespace icecale
@@ -0,0 +1,614 @@
+#include "process.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#include <psapi.h>
+#else
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+#endif
+
+namespace icecale {
+
+// Pipe ends are created non-inheritable and only the child's ends are handed over at spawn time. Spawning under one
+// lock keeps a child started on another thread from inheriting them in between, which would hold pipes open (an
+// encoder would never see the end of its input).
+std::mutex& spawnMutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+namespace {
+
+#ifdef _WIN32
+// Quotes one argument the way the Microsoft C runtime splits command lines.
+std::string quoteArgument(const std::string& arg) {
+    if (!arg.empty() && arg.find_first_of(" \t\n\v\"") == std::string::npos) {
+        return arg;
+    }
+    std::string quoted = "\"";
+    for (auto it = arg.begin();; ++it) {
+        std::size_t backslashes = 0;
+        while (it != arg.end() && *it == '\\') {
+            ++it;
+            ++backslashes;
+        }
+        if (it == arg.end()) {
+            quoted.append(backslashes * 2, '\\');
+            break;
+        }
+        if (*it == '"') {
+            quoted.append(backslashes * 2 + 1, '\\');
+        } else {
+            quoted.append(backslashes, '\\');
+        }
+        quoted.push_back(*it);
+    }
+    quoted.push_back('"');
+    return quoted;
+}
+
+std::string lastErrorMessage() {
+    char* text = nullptr;
+    FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, nullptr,
+                   GetLastError(), 0, reinterpret_cast<char*>(&text), 0, nullptr);
+    std::string message = text ? text : "unknown error";
+    LocalFree(text);
+    while (!message.empty() && (message.back() == '\n' || message.back() == '\r')) {
+        message.pop_back();
+    }
+    return message;
+}
+
+void closeHandle(HANDLE& handle) {
+    if (handle != nullptr && handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(handle);
+    }
+    handle = nullptr;
+}
+#else
+void closeFd(int& fd) {
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    fd = -1;
+}
+
+void makePipe(int fds[2]) {
+    if (::pipe(fds) != 0) {
+        throw std::runtime_error(std::string("Failed to create a pipe: ") + std::strerror(errno));
+    }
+    ::fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    ::fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+}
+#endif
+
+}  // namespace
+
+struct Process::State {
+    ProcessOptions options;
+    std::FILE* in = nullptr;
+    std::FILE* out = nullptr;
+    std::thread drain;
+    mutable std::mutex mutex;
+    std::string captured;
+    std::string partialLine;
+    bool dropped = false;
+    bool waited = false;
+    int exitCode = 0;
+    std::uintmax_t peakMemory = 0;
+#ifdef _WIN32
+    HANDLE process = nullptr;
+    HANDLE capture = nullptr;
+#else
+    pid_t pid = -1;
+    bool exited = false;
+    int status = 0;
+    // errno of a wait4 that failed, in which case status means nothing.
+    int waitError = 0;
+    int capture = -1;
+
+    // Collects the exit status of an exited child, and with it the child's peak memory. A wait that fails for any
+    // reason but EINTR also ends the wait, with the error kept in waitError.
+    bool reap(bool block) {
+        rusage usage{};
+        const pid_t reaped = ::wait4(pid, &status, block ? 0 : WNOHANG, &usage);
+        if (reaped == -1 && errno != EINTR) {
+            waitError = errno;
+            return true;
+        }
+        if (reaped != pid) {
+            return false;
+        }
+#ifdef __APPLE__
+        peakMemory = static_cast<std::uintmax_t>(usage.ru_maxrss);
+#else
+        // Linux reports kilobytes.
+        peakMemory = static_cast<std::uintmax_t>(usage.ru_maxrss) * 1024;
+#endif
+        return true;
+    }
+#endif
+
+    void consume(const char* data, std::size_t size) {
+        if (options.onLine) {
+            for (std::size_t i = 0; i < size; ++i) {
+                if (data[i] == '\n' || data[i] == '\r') {
+                    if (!partialLine.empty()) {
+                        options.onLine(partialLine);
+                        partialLine.clear();
+                    }
+                } else {
+                    partialLine.push_back(data[i]);
+                }
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        captured.append(data, size);
+        if (captured.size() > 2 * options.keepBytes) {
+            captured.erase(0, captured.size() - options.keepBytes);
+            dropped = true;
+        }
+    }
+
+    void flushPartialLine() {
+        if (options.onLine && !partialLine.empty()) {
+            options.onLine(partialLine);
+            partialLine.clear();
+        }
+    }
+
+    // Adds a line of our own to the captured output, once the drain thread is done.
+    void appendNote(const std::string& note) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!captured.empty() && captured.back() != '\n') {
+            captured += '\n';
+        }
+        captured += note + "\n";
+    }
+};
+
+#ifdef _WIN32
+
+Process::Process(const std::vector<std::string>& args, ProcessOptions options) : state_(std::make_unique<State>()) {
+    if (args.empty()) {
+        throw std::runtime_error("No program to start.");
+    }
+    state_->options = std::move(options);
+    const ProcessOptions& opt = state_->options;
+
+    std::string commandLine;
+    for (const auto& arg : args) {
+        commandLine += (commandLine.empty() ? "" : " ") + quoteArgument(arg);
+    }
+
+    SECURITY_ATTRIBUTES inheritable{sizeof(SECURITY_ATTRIBUTES), nullptr, TRUE};
+    HANDLE childIn = nullptr;
+    HANDLE childOut = nullptr;
+    HANDLE childErr = nullptr;
+    HANDLE parentIn = nullptr;
+    HANDLE parentOut = nullptr;
+    std::vector<HANDLE> owned;
+    auto fail = [&](const std::string& what) {
+        for (HANDLE& handle : owned) {
+            closeHandle(handle);
+        }
+        closeHandle(parentIn);
+        closeHandle(parentOut);
+        closeHandle(state_->capture);
+        throw std::runtime_error(what + ": " + lastErrorMessage());
+    };
+    auto openNull = [&](DWORD access) {
+        HANDLE handle = CreateFileA("NUL", access, FILE_SHARE_READ | FILE_SHARE_WRITE, &inheritable, OPEN_EXISTING,
+                                    0, nullptr);
+        if (handle == INVALID_HANDLE_VALUE) {
+            fail("Failed to open NUL");
+        }
+        owned.push_back(handle);
+        return handle;
+    };
+    auto makePipe = [&](HANDLE& read, HANDLE& write, bool parentReads) {
+        if (!CreatePipe(&read, &write, &inheritable, 0)) {
+            fail("Failed to create a pipe");
+        }
+        SetHandleInformation(parentReads ? read : write, HANDLE_FLAG_INHERIT, 0);
+        owned.push_back(parentReads ? write : read);
+    };
+
+    std::lock_guard<std::mutex> lock(spawnMutex());
+    switch (opt.in) {
+        case StreamMode::Pipe:
+            makePipe(childIn, parentIn, false);
+            break;
+        case StreamMode::Inherit:
+            childIn = GetStdHandle(STD_INPUT_HANDLE);
+            break;
+        default:
+            childIn = openNull(GENERIC_READ);
+            break;
+    }
+
+    HANDLE captureWrite = nullptr;
+    if (opt.out == StreamMode::Capture || opt.err == StreamMode::Capture) {
+        makePipe(state_->capture, captureWrite, true);
+    }
+    switch (opt.out) {
+        case StreamMode::Pipe:
+            makePipe(parentOut, childOut, true);
+            break;
+        case StreamMode::Capture:
+            childOut = captureWrite;
+            break;
+        case StreamMode::Inherit:
+            childOut = GetStdHandle(STD_OUTPUT_HANDLE);
+            break;
+        default:
+            childOut = openNull(GENERIC_WRITE);
+            break;
+    }
+    switch (opt.err) {
+        case StreamMode::Capture:
+            childErr = captureWrite;
+            break;
+        case StreamMode::File: {
+            HANDLE file = CreateFileW(opt.errFile.wstring().c_str(), GENERIC_WRITE, FILE_SHARE_READ, &inheritable,
+                                      CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (file == INVALID_HANDLE_VALUE) {
+                fail("Failed to open " + opt.errFile.string());
+            }
+            owned.push_back(file);
+            childErr = file;
+            break;
+        }
+        case StreamMode::Inherit:
+            childErr = GetStdHandle(STD_ERROR_HANDLE);
+            break;
+        default:
+            childErr = openNull(GENERIC_WRITE);
+            break;
+    }
+
+    STARTUPINFOA startup{};
+    startup.cb = sizeof(startup);
+    startup.dwFlags = STARTF_USESTDHANDLES;
+    startup.hStdInput = childIn;
+    startup.hStdOutput = childOut;
+    startup.hStdError = childErr;
+    PROCESS_INFORMATION info{};
+    if (!CreateProcessA(nullptr, commandLine.data(), nullptr, nullptr, TRUE, 0, nullptr, nullptr, &startup, &info)) {
+        fail("Failed to start " + args.front());
+    }
+    CloseHandle(info.hThread);
+    state_->process = info.hProcess;
+    for (HANDLE& handle : owned) {
+        closeHandle(handle);
+    }
+
+    if (parentIn) {
+        state_->in = _fdopen(_open_osfhandle(reinterpret_cast<intptr_t>(parentIn), _O_WRONLY | _O_BINARY), "wb");
+    }
+    if (parentOut) {
+        state_->out = _fdopen(_open_osfhandle(reinterpret_cast<intptr_t>(parentOut), _O_RDONLY | _O_BINARY), "rb");
+    }
+    if (state_->capture) {
+        state_->drain = std::thread([state = state_.get()] {
+            char buffer[64 * 1024];
+            DWORD got = 0;
+            while (ReadFile(state->capture, buffer, sizeof(buffer), &got, nullptr) && got > 0) {
+                state->consume(buffer, got);
+            }
+            state->flushPartialLine();
+        });
+    }
+}
+
+bool Process::finished() {
+    return state_->waited || WaitForSingleObject(state_->process, 0) == WAIT_OBJECT_0;
+}
+
+int Process::wait() {
+    if (state_->waited) {
+        return state_->exitCode;
+    }
+    closeInput();
+    if (state_->out) {
+        std::fclose(state_->out);
+        state_->out = nullptr;
+    }
+    const bool waited = WaitForSingleObject(state_->process, INFINITE) == WAIT_OBJECT_0;
+    DWORD waitError = waited ? 0 : GetLastError();
+    if (state_->drain.joinable()) {
+        state_->drain.join();
+    }
+    closeHandle(state_->capture);
+    DWORD code = 0;
+    if (waited && !GetExitCodeProcess(state_->process, &code)) {
+        waitError = GetLastError();
+    }
+    PROCESS_MEMORY_COUNTERS memory{};
+    if (GetProcessMemoryInfo(state_->process, &memory, sizeof(memory))) {
+        state_->peakMemory = memory.PeakWorkingSetSize;
+    }
+    closeHandle(state_->process);
+    state_->exitCode = static_cast<int>(code);
+    if (waitError != 0) {
+        state_->exitCode = -1;
+        state_->appendNote("Waiting for the process failed (error " + std::to_string(waitError) + ").");
+    }
+    state_->waited = true;
+    return state_->exitCode;
+}
+
+void Process::terminate() {
+    if (!finished()) {
+        TerminateProcess(state_->process, 1);
+    }
+}
+
+#else
+
+Process::Process(const std::vector<std::string>& args, ProcessOptions options) : state_(std::make_unique<State>()) {
+    if (args.empty()) {
+        throw std::runtime_error("No program to start.");
+    }
+    state_->options = std::move(options);
+    const ProcessOptions& opt = state_->options;
+
+    std::vector<char*> argv;
+    for (const auto& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    int inPipe[2] = {-1, -1};
+    int outPipe[2] = {-1, -1};
+    int capturePipe[2] = {-1, -1};
+    auto closeAll = [&] {
+        for (int* fds : {inPipe, outPipe, capturePipe}) {
+            closeFd(fds[0]);
+            closeFd(fds[1]);
+        }
+    };
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    int error = 0;
+    {
+        std::lock_guard<std::mutex> lock(spawnMutex());
+        try {
+            if (opt.in == StreamMode::Pipe) {
+                makePipe(inPipe);
+            }
+            if (opt.out == StreamMode::Pipe) {
+                makePipe(outPipe);
+            }
+            if (opt.out == StreamMode::Capture || opt.err == StreamMode::Capture) {
+                makePipe(capturePipe);
+            }
+        } catch (...) {
+            closeAll();
+            posix_spawn_file_actions_destroy(&actions);
+            throw;
+        }
+
+        switch (opt.in) {
+            case StreamMode::Pipe:
+                posix_spawn_file_actions_adddup2(&actions, inPipe[0], STDIN_FILENO);
+                break;
+            case StreamMode::Inherit:
+                break;
+            default:
+                posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+                break;
+        }
+        switch (opt.out) {
+            case StreamMode::Pipe:
+                posix_spawn_file_actions_adddup2(&actions, outPipe[1], STDOUT_FILENO);
+                break;
+            case StreamMode::Capture:
+                posix_spawn_file_actions_adddup2(&actions, capturePipe[1], STDOUT_FILENO);
+                break;
+            case StreamMode::Inherit:
+                break;
+            default:
+                posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+                break;
+        }
+        switch (opt.err) {
+            case StreamMode::Capture:
+                posix_spawn_file_actions_adddup2(&actions, capturePipe[1], STDERR_FILENO);
+                break;
+            case StreamMode::File:
+                posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, opt.errFile.c_str(),
+                                                 O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                break;
+            case StreamMode::Inherit:
+                break;
+            default:
+                posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+                break;
+        }
+
+        error = posix_spawnp(&state_->pid, argv.front(), &actions, nullptr, argv.data(), environ);
+        closeFd(inPipe[0]);
+        closeFd(outPipe[1]);
+        closeFd(capturePipe[1]);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    if (error != 0) {
+        closeAll();
+        throw std::runtime_error("Failed to start " + args.front() + ": " + std::strerror(error));
+    }
+
+    if (inPipe[1] >= 0) {
+        state_->in = ::fdopen(inPipe[1], "w");
+    }
+    if (outPipe[0] >= 0) {
+        state_->out = ::fdopen(outPipe[0], "r");
+    }
+    if (capturePipe[0] >= 0) {
+        state_->capture = capturePipe[0];
+        state_->drain = std::thread([state = state_.get()] {
+            char buffer[64 * 1024];
+            while (true) {
+                ssize_t got = ::read(state->capture, buffer, sizeof(buffer));
+                if (got < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (got <= 0) {
+                    break;
+                }
+                state->consume(buffer, static_cast<std::size_t>(got));
+            }
+            state->flushPartialLine();
+        });
+    }
+}
+
+bool Process::finished() {
+    if (state_->waited || state_->exited) {
+        return true;
+    }
+    if (state_->reap(false)) {
+        state_->exited = true;
+    }
+    return state_->exited;
+}
+
+int Process::wait() {
+    if (state_->waited) {
+        return state_->exitCode;
+    }
+    closeInput();
+    if (state_->out) {
+        std::fclose(state_->out);
+        state_->out = nullptr;
+    }
+    while (!state_->exited) {
+        state_->exited = state_->reap(true);
+    }
+    if (state_->drain.joinable()) {
+        state_->drain.join();
+    }
+    closeFd(state_->capture);
+
+    if (state_->waitError != 0) {
+        state_->exitCode = -1;
+        state_->appendNote("waitpid failed: " + std::string(std::strerror(state_->waitError)));
+    } else if (WIFEXITED(state_->status)) {
+        state_->exitCode = WEXITSTATUS(state_->status);
+    } else if (WIFSIGNALED(state_->status)) {
+        state_->exitCode = 128 + WTERMSIG(state_->status);
+    } else {
+        state_->exitCode = 1;
+    }
+    state_->waited = true;
+    return state_->exitCode;
+}
+
+void Process::terminate() {
+    if (!finished()) {
+        ::kill(state_->pid, SIGTERM);
+    }
+}
+
+#endif
+
+Process::~Process() {
+    // A child abandoned by an exception is stopped rather than waited for indefinitely.
+    if (!state_->waited) {
+        terminate();
+        wait();
+    }
+}
+
+std::FILE* Process::input() const {
+    return state_->in;
+}
+
+std::FILE* Process::output() const {
+    return state_->out;
+}
+
+void Process::closeInput() {
+    if (state_->in) {
+        std::fclose(state_->in);
+        state_->in = nullptr;
+    }
+}
+
+std::uintmax_t Process::peakMemory() const {
+    return state_->peakMemory;
+}
+
+std::string Process::capturedOutput() const {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    return state_->dropped ? "...\n" + state_->captured : state_->captured;
+}
+
+CommandResult runCommand(const std::vector<std::string>& args) {
+    try {
+        Process process(args);
+        int exitCode = process.wait();
+        return {exitCode, process.capturedOutput()};
+    } catch (const std::exception& ex) {
+        return {127, ex.what()};
+    }
+}
+
+std::uintmax_t ownPeakMemory() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS memory{};
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory))) {
+        return memory.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+#ifdef __linux__
+    // VmHWM honours resetOwnPeakMemory(); ru_maxrss always covers the whole lifetime.
+    std::ifstream status("/proc/self/status");
+    for (std::string line; std::getline(status, line);) {
+        if (line.rfind("VmHWM:", 0) == 0) {
+            return std::strtoull(line.c_str() + 6, nullptr, 10) * 1024;
+        }
+    }
+#endif
+    rusage usage{};
+    if (::getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return static_cast<std::uintmax_t>(usage.ru_maxrss);
+#else
+    return static_cast<std::uintmax_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+void resetOwnPeakMemory() {
+#ifdef __linux__
+    // Writing 5 to clear_refs resets the high-water mark to the current resident size (Linux 4.0 and later).
+    std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+}
+
+}  // namespace icecale
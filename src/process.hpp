@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace icecale {
+
+// How one standard stream of a child process is connected.
+enum class StreamMode {
+    Null,     // /dev/null (NUL on Windows).
+    Inherit,  // Shared with this process.
+    Pipe,     // Readable or writable by the caller through Process::input() / Process::output().
+    Capture,  // Drained in the background; lines go to onLine and the tail is kept for output().
+    File,     // Written to ProcessOptions::errFile (stderr only).
+};
+
+struct ProcessOptions {
+    StreamMode in = StreamMode::Null;
+    StreamMode out = StreamMode::Capture;
+    // When both stdout and stderr are captured they share one pipe, so their lines stay in order like 2>&1.
+    StreamMode err = StreamMode::Capture;
+    std::filesystem::path errFile;
+    // Called from the drain thread for every captured line; '\r' also ends a line, for progress output.
+    std::function<void(std::string_view)> onLine;
+    // Captured output kept for capturedOutput(); older output is dropped first.
+    std::size_t keepBytes = 64 * 1024;
+};
+
+// A child process started directly from an argument vector (posix_spawn / CreateProcess), without a shell, so
+// arguments never need quoting. Captured output is drained by a background thread, so the child cannot stall on a
+// full pipe and several children can run at once while the caller does other work.
+class Process {
+public:
+    // Throws std::runtime_error when the program cannot be started.
+    Process(const std::vector<std::string>& args, ProcessOptions options = {});
+    ~Process();
+
+    Process(const Process&) = delete;
+    Process& operator=(const Process&) = delete;
+
+    // Pipe ends; null unless the stream was opened with StreamMode::Pipe.
+    std::FILE* input() const;
+    std::FILE* output() const;
+    void closeInput();
+
+    // True once the child has exited; never blocks.
+    bool finished();
+    // Closes the caller's pipe ends, waits for the child and its captured output, and returns the exit code
+    // (128 + signal number when it was killed, like a shell reports it). -1 means the exit status could not be
+    // collected; the reason is added to the captured output.
+    int wait();
+    // Asks the child to stop (SIGTERM / TerminateProcess).
+    void terminate();
+
+    std::string capturedOutput() const;
+
+    // Peak resident memory of the child in bytes, once it has exited; 0 where the platform does not report it. On
+    // POSIX systems it covers the largest of the child and the descendants it waited for.
+    std::uintmax_t peakMemory() const;
+
+private:
+    struct State;
+    std::unique_ptr<State> state_;
+};
+
+struct CommandResult {
+    int exitCode{};
+    std::string output;
+};
+
+// Runs a program to completion with stdout and stderr captured together. A program that cannot be started is
+// reported as exit code 127 with the reason as its output, the way a shell would.
+CommandResult runCommand(const std::vector<std::string>& args);
+
+// Held while a child is started. Code that opens a descriptor and only then marks it non-inheritable does both under
+// this lock, so no child is spawned in between and inherits it.
+std::mutex& spawnMutex();
+
+// Peak resident memory of this process in bytes; 0 where the platform does not report it.
+std::uintmax_t ownPeakMemory();
+// Starts a new peak at the current resident size where the platform allows it (Linux); elsewhere the peak keeps
+// covering the whole lifetime of the process.
+void resetOwnPeakMemory();
+
+}  // namespace icecale
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace icecale {
+
+struct RgbFrame {
+    int width{};
+    int height{};
+    std::vector<std::uint8_t> pixels;  // Packed rgb24, row-major, no padding.
+};
+
+// How an in-process engine stores and computes activations. Mixed is realesrgan-ncnn-vulkan's own choice: fp16
+// storage with fp32 arithmetic. Fp16 also computes in fp16 where the device supports it, and Int8 only speeds up
+// models that were quantized for it.
+enum class Precision { Fp32, Mixed, Fp16, Int8 };
+
+// A resident upscaler keeps its model and GPU context alive for the whole run and works on in-memory frames.
+class FrameUpscaler {
+public:
+    virtual ~FrameUpscaler() = default;
+    virtual int scale() const = 0;
+    // Changes the tile inference is split into, so a resident engine can follow the plan of the next job without
+    // reloading its model; 0 picks one from the device memory.
+    virtual void setTileSize(int tileSize) = 0;
+    virtual void upscale(const RgbFrame& input, RgbFrame& output) = 0;
+    // Upscales only the w x h region of input at (x, y) into output, which becomes scale() times the region's size.
+    // Pixels around the region are read as context, so the result lines up with neighbouring regions upscaled
+    // separately, or with the whole frame upscaled at once.
+    virtual void upscaleRegion(const RgbFrame& input, int x, int y, int w, int h, RgbFrame& output) = 0;
+};
+
+}  // namespace icecale